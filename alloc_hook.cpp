@@ -0,0 +1,123 @@
+// Replaces the global operator new and delete with ones that charge every
+// block to the memory phase of the thread allocating it (see memory.h). Link
+// this file into the program, not the library, so that embedders choose.
+//
+// Each block is preceded by a header with its size and phase, so that frees
+// are charged back to the phase that allocated them.
+
+#include "memory.h"
+
+#include "llvm/Support/ErrorHandling.h"
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+struct alignas(16) Header {
+  std::size_t Size;
+  // The phase the block is charged to, and how far into the underlying
+  // allocation the block starts.
+  std::uint32_t Phase;
+  std::uint32_t Offset;
+};
+static_assert(sizeof(Header) == 16, "keeps blocks 16-byte aligned");
+
+void *Allocate(std::size_t Size, std::size_t Align) {
+  std::size_t Offset = Align > sizeof(Header) ? Align : sizeof(Header);
+  void *Base;
+  if (Align > sizeof(Header)) {
+    // aligned_alloc wants a multiple of the alignment.
+    std::size_t Total = (Offset + Size + Align - 1) / Align * Align;
+    Base = std::aligned_alloc(Align, Total);
+  } else {
+    Base = std::malloc(Offset + Size);
+  }
+  if (!Base)
+    return nullptr;
+  char *Block = static_cast<char *>(Base) + Offset;
+  Header *H = reinterpret_cast<Header *>(Block) - 1;
+  H->Size = Size;
+  H->Phase = jlang::noteAllocation(Size);
+  H->Offset = static_cast<std::uint32_t>(Offset);
+  return Block;
+}
+
+void *AllocateOrThrow(std::size_t Size, std::size_t Align) {
+  while (true) {
+    if (void *Block = Allocate(Size, Align))
+      return Block;
+    std::new_handler Handler = std::get_new_handler();
+    // Built without exceptions, like LLVM: running out is fatal.
+    if (!Handler)
+      llvm::report_bad_alloc_error("out of memory");
+    Handler();
+  }
+}
+
+void Release(void *Block) {
+  if (!Block)
+    return;
+  Header *H = static_cast<Header *>(Block) - 1;
+  jlang::noteDeallocation(H->Phase, H->Size);
+  std::free(static_cast<char *>(Block) - H->Offset);
+}
+
+constexpr std::size_t Default = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+} // namespace
+
+void *operator new(std::size_t Size) { return AllocateOrThrow(Size, Default); }
+void *operator new[](std::size_t Size) {
+  return AllocateOrThrow(Size, Default);
+}
+void *operator new(std::size_t Size, const std::nothrow_t &) noexcept {
+  return Allocate(Size, Default);
+}
+void *operator new[](std::size_t Size, const std::nothrow_t &) noexcept {
+  return Allocate(Size, Default);
+}
+void *operator new(std::size_t Size, std::align_val_t Align) {
+  return AllocateOrThrow(Size, static_cast<std::size_t>(Align));
+}
+void *operator new[](std::size_t Size, std::align_val_t Align) {
+  return AllocateOrThrow(Size, static_cast<std::size_t>(Align));
+}
+void *operator new(std::size_t Size, std::align_val_t Align,
+                   const std::nothrow_t &) noexcept {
+  return Allocate(Size, static_cast<std::size_t>(Align));
+}
+void *operator new[](std::size_t Size, std::align_val_t Align,
+                     const std::nothrow_t &) noexcept {
+  return Allocate(Size, static_cast<std::size_t>(Align));
+}
+
+void operator delete(void *Block) noexcept { Release(Block); }
+void operator delete[](void *Block) noexcept { Release(Block); }
+void operator delete(void *Block, std::size_t) noexcept { Release(Block); }
+void operator delete[](void *Block, std::size_t) noexcept { Release(Block); }
+void operator delete(void *Block, const std::nothrow_t &) noexcept {
+  Release(Block);
+}
+void operator delete[](void *Block, const std::nothrow_t &) noexcept {
+  Release(Block);
+}
+void operator delete(void *Block, std::align_val_t) noexcept {
+  Release(Block);
+}
+void operator delete[](void *Block, std::align_val_t) noexcept {
+  Release(Block);
+}
+void operator delete(void *Block, std::size_t, std::align_val_t) noexcept {
+  Release(Block);
+}
+void operator delete[](void *Block, std::size_t, std::align_val_t) noexcept {
+  Release(Block);
+}
+void operator delete(void *Block, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+  Release(Block);
+}
+void operator delete[](void *Block, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+  Release(Block);
+}
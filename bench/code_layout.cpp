@@ -0,0 +1,95 @@
+// Times a call-heavy workload with a mapping per object, with the JIT's code
+// region placing every definition with the hot code, and with the region
+// placing only the definitions that get called, and prints how the region was
+// used. Each of many leaf functions is too big to inline and is followed by a
+// top-level expression, as in a long session, and only every tenth leaf is
+// called. Without the region hot code is spread over a page per function with
+// expression code in between; placed by kind, hot leaves are a page or so
+// apart with the cold ones in between.
+//
+// Usage: code_layout [leaves] [calls]
+
+#include "jlang.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+#include <fmt/format.h>
+
+// Returns calls of the workload per second, or a negative number on failure.
+static double Run(std::size_t RegionSize, std::uint64_t HotCallCount,
+                  unsigned NumLeaves, unsigned NumCalls,
+                  jlang::CodeRegionStats &Stats) {
+  jlang::EngineOptions Opts;
+  Opts.Echo = false;
+  Opts.CodeRegionSize = RegionSize;
+  Opts.HotCallCount = HotCallCount;
+  jlang::Engine Engine(Opts);
+  std::string Body = "x";
+  for (unsigned Term = 0; Term < 40; ++Term)
+    Body = fmt::format("({} + {}) * (x - {})", Body, Term, Term * 0.5);
+  for (unsigned I = 0; I < NumLeaves; ++I)
+    Engine.run(fmt::format("def l{0}(x) {1} * {0}\nl{0}(0.5)\n", I, Body),
+               [](jlang::Evaluation) {});
+
+  // Group the calls, as an expression with thousands of calls would take long
+  // to parse.
+  std::string All = "def all(x) 0";
+  for (unsigned G = 0; G * 100 < NumLeaves; ++G) {
+    std::string Group = fmt::format("def g{}(x) 0", G);
+    for (unsigned I = G * 100; I < NumLeaves && I < G * 100 + 100; I += 10)
+      Group += fmt::format(" + l{}(x)", I);
+    if (!Engine.define(Group))
+      return -1;
+    All += fmt::format(" + g{}(x)", G);
+  }
+  auto *Fn = Engine.compile<double(double)>(All);
+  if (!Fn)
+    return -1;
+
+  // Enough calls to count every called function as hot.
+  for (std::uint64_t I = 0; I < std::max<std::uint64_t>(HotCallCount, 1); ++I)
+    Fn(0.25);
+  Engine.placeHotCode();
+  auto Start = std::chrono::steady_clock::now();
+  double Sum = 0;
+  for (unsigned I = 0; I < NumCalls; ++I)
+    Sum += Fn(I * 1e-6);
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+  // Keep the calls from being optimized away.
+  static volatile double Sink;
+  Sink = Sum;
+  Stats = Engine.codeRegionStats();
+  return NumCalls / Elapsed.count();
+}
+
+int main(int argc, char **argv) {
+  unsigned NumLeaves = argc > 1 ? std::atoi(argv[1]) : 2000;
+  unsigned NumCalls = argc > 2 ? std::atoi(argv[2]) : 2000;
+
+  jlang::CodeRegionStats Stats;
+  std::size_t RegionSize = std::size_t(1) << 30;
+  double PerObject = Run(0, 0, NumLeaves, NumCalls, Stats);
+  double ByKind = Run(RegionSize, 0, NumLeaves, NumCalls, Stats);
+  double ByCalls = Run(RegionSize, 1000, NumLeaves, NumCalls, Stats);
+  if (PerObject < 0 || ByKind < 0 || ByCalls < 0) {
+    fmt::print(stderr, "compilation failed\n");
+    return 1;
+  }
+  fmt::print("{} leaves, calls of every tenth per second:\n", NumLeaves);
+  fmt::print("{:>24} {:>10.0f}\n", "mapping per object", PerObject);
+  fmt::print("{:>24} {:>10.0f} ({:.2f}x)\n", "region, all hot", ByKind,
+             ByKind / PerObject);
+  fmt::print("{:>24} {:>10.0f} ({:.2f}x)\n", "region, hot by calls",
+             ByCalls, ByCalls / PerObject);
+  fmt::print("{} KB of the region in huge pages\n", Stats.HugePageBytes >> 10);
+  for (auto &Z : Stats.Zones)
+    fmt::print("{:>24} {:>8} KB used of {:>8} KB spanned, {:.1f}% lost to "
+               "holes\n",
+               Z.Name, Z.Used >> 10, Z.Span >> 10, Z.fragmentation() * 100);
+  return 0;
+}
@@ -0,0 +1,62 @@
+// Compiles the same workload on 1..N engines at once, one thread per engine,
+// and reports throughput. Engines share no compiler state, so the rate should
+// scale with the number of cores.
+//
+// Usage: engine_scaling [max-threads] [functions-per-engine]
+
+#include "jlang.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+
+static bool CompileWorkload(unsigned NumFunctions) {
+  jlang::Engine Engine;
+  for (unsigned I = 0; I < NumFunctions; ++I) {
+    std::string Source = fmt::format(
+        "def f{0}(x y) (x + {0}) * (y - x) * (x * y + {0}) < x * x + y", I);
+    if (!Engine.compile<double(double, double)>(Source))
+      return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  unsigned MaxThreads = argc > 1 ? std::atoi(argv[1])
+                                 : std::thread::hardware_concurrency();
+  unsigned NumFunctions = argc > 2 ? std::atoi(argv[2]) : 500;
+  if (MaxThreads == 0)
+    MaxThreads = 1;
+
+  fmt::print("{:>8} {:>12} {:>14} {:>8}\n", "engines", "seconds", "functions/s",
+             "speedup");
+  double BaseRate = 0;
+  for (unsigned N = 1; N <= MaxThreads; N *= 2) {
+    std::vector<std::thread> Threads;
+    std::vector<char> Ok(N, 0);
+    auto Start = std::chrono::steady_clock::now();
+    for (unsigned T = 0; T < N; ++T)
+      Threads.emplace_back([&, T] { Ok[T] = CompileWorkload(NumFunctions); });
+    for (auto &T : Threads)
+      T.join();
+    std::chrono::duration<double> Elapsed =
+        std::chrono::steady_clock::now() - Start;
+
+    for (char C : Ok)
+      if (!C) {
+        fmt::print(stderr, "compilation failed\n");
+        return 1;
+      }
+
+    double Rate = N * NumFunctions / Elapsed.count();
+    if (N == 1)
+      BaseRate = Rate;
+    fmt::print("{:>8} {:>12.3f} {:>14.0f} {:>7.2f}x\n", N, Elapsed.count(),
+               Rate, Rate / BaseRate);
+  }
+  return 0;
+}
@@ -0,0 +1,102 @@
+// Builds a shared library from generated files with and without a profile and
+// compares the instruction cache footprint of its hot functions: the 64-byte
+// lines and 4KB pages their code spans. One function in twenty is hot, spread
+// evenly over the files.
+//
+// Usage: function_order [files] [functions-per-file]
+
+#include "build.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+#include <unistd.h>
+
+static void WriteFile(const std::string &Path, const std::string &Text) {
+  std::ofstream(Path) << Text;
+}
+
+struct Footprint {
+  std::size_t Lines = 0;
+  std::size_t Pages = 0;
+};
+
+// Measure what the functions in Hot span in Library, going by `nm -S`.
+static bool Measure(const std::string &Library,
+                    const std::set<std::string> &Hot, Footprint &Result) {
+  FILE *Nm = popen(("nm -S " + Library).c_str(), "r");
+  if (!Nm)
+    return false;
+  std::set<unsigned long> Lines, Pages;
+  char Type, Name[256];
+  unsigned long Addr, Size;
+  while (std::fscanf(Nm, "%lx %lx %c %255s", &Addr, &Size, &Type, Name) == 4) {
+    if (!Hot.count(Name))
+      continue;
+    for (unsigned long A = Addr / 64; A <= (Addr + Size - 1) / 64; ++A)
+      Lines.insert(A);
+    for (unsigned long A = Addr / 4096; A <= (Addr + Size - 1) / 4096; ++A)
+      Pages.insert(A);
+  }
+  pclose(Nm);
+  Result = {Lines.size(), Pages.size()};
+  return !Lines.empty();
+}
+
+int main(int argc, char **argv) {
+  unsigned NumFiles = argc > 1 ? std::atoi(argv[1]) : 200;
+  unsigned PerFile = argc > 2 ? std::atoi(argv[2]) : 10;
+
+  char Dir[] = "/tmp/jlang-order-XXXXXX";
+  if (!mkdtemp(Dir)) {
+    fmt::print(stderr, "can't create a directory\n");
+    return 1;
+  }
+  std::string Root = Dir;
+  std::string All, Profile;
+  std::set<std::string> Hot;
+  for (unsigned I = 0; I < NumFiles; ++I) {
+    std::string Source;
+    for (unsigned J = 0; J < PerFile; ++J) {
+      unsigned N = I * PerFile + J;
+      Source += fmt::format("export def f{0}(x y) (x + {0}) * (y - x) * "
+                            "lerp(x, y, 0.{0}) + clamp(x * y, {0}, 2 * {0}) "
+                            "- smoothstep(0, {0}, x)\n",
+                            N);
+      if (N % 20 == 0) {
+        Hot.insert(fmt::format("f{}", N));
+        Profile += fmt::format("{} f{}\n", 1000000 - N, N);
+      }
+    }
+    WriteFile(fmt::format("{}/f{}.jl", Root, I), Source);
+    All += fmt::format("import \"f{}.jl\"\n", I);
+  }
+  WriteFile(Root + "/all.jl", All);
+  WriteFile(Root + "/profile.txt", Profile);
+
+  jlang::BuildOptions Opts;
+  Opts.Inputs = {Root + "/all.jl"};
+  Opts.CacheDir = Root + "/cache";
+  Opts.Shared = true;
+  Footprint Plain, Ordered;
+  Opts.Output = Root + "/libplain.so";
+  if (!jlang::build(Opts) || !Measure(Opts.Output, Hot, Plain))
+    return 1;
+  Opts.Output = Root + "/libordered.so";
+  Opts.Profile = Root + "/profile.txt";
+  if (!jlang::build(Opts) || !Measure(Opts.Output, Hot, Ordered))
+    return 1;
+
+  fmt::print("{} hot functions of {}, in {}\n", Hot.size(),
+             NumFiles * PerFile, Root);
+  fmt::print("{:>16} {:>12} {:>12}\n", "", "cache lines", "pages");
+  fmt::print("{:>16} {:>12} {:>12}\n", "no profile", Plain.Lines, Plain.Pages);
+  fmt::print("{:>16} {:>12} {:>12}\n", "with profile", Ordered.Lines,
+             Ordered.Pages);
+  return 0;
+}
@@ -0,0 +1,89 @@
+// Generates a tree of files that import each other and times `jlang build`
+// on it: from scratch, with nothing changed, and after editing one file.
+//
+// Usage: incremental_build [files] [jobs]
+
+#include "build.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include <fmt/format.h>
+#include <unistd.h>
+
+static void WriteFile(const std::string &Path, const std::string &Text) {
+  std::ofstream(Path) << Text;
+}
+
+// File I defines gI and hI and imports file I / 10, whose gI it calls.
+static std::string FileSource(unsigned I, double Weight) {
+  std::string Source;
+  std::string Call;
+  if (I >= 10) {
+    Source = fmt::format("import \"f{}.jl\"\n", I / 10);
+    Call = fmt::format(" + g{}(x, y * 0.5)", I / 10);
+  }
+  Source += fmt::format("def g{0}(x y) (x + {0}) * (y - x) * "
+                        "lerp(x, y, {1}){2}\n",
+                        I, Weight, Call);
+  Source += fmt::format("def h{0}(x) g{0}(x, x * 2) - x\n", I);
+  return Source;
+}
+
+// Returns the seconds the build took, or a negative number on failure.
+static double TimeBuild(const jlang::BuildOptions &Opts) {
+  auto Start = std::chrono::steady_clock::now();
+  if (!jlang::build(Opts))
+    return -1;
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+  return Elapsed.count();
+}
+
+int main(int argc, char **argv) {
+  unsigned NumFiles = argc > 1 ? std::atoi(argv[1]) : 2000;
+  unsigned Jobs = argc > 2 ? std::atoi(argv[2]) : 4;
+
+  char Dir[] = "/tmp/jlang-build-XXXXXX";
+  if (!mkdtemp(Dir)) {
+    fmt::print(stderr, "can't create a directory\n");
+    return 1;
+  }
+  std::string Root = Dir;
+  std::string All;
+  for (unsigned I = 0; I < NumFiles; ++I) {
+    WriteFile(fmt::format("{}/f{}.jl", Root, I), FileSource(I, 0.25));
+    All += fmt::format("import \"f{}.jl\"\n", I);
+  }
+  WriteFile(Root + "/all.jl", All);
+
+  jlang::BuildOptions Opts;
+  Opts.Inputs = {Root + "/all.jl"};
+  Opts.Output = Root + "/all.o";
+  Opts.CacheDir = Root + "/cache";
+
+  fmt::print("{} files in {}\n", NumFiles, Root);
+  fmt::print("{:>24} {:>10}\n", "build", "seconds");
+  auto Report = [](const char *What, double Seconds) {
+    if (Seconds < 0) {
+      fmt::print(stderr, "build failed\n");
+      std::exit(1);
+    }
+    fmt::print("{:>24} {:>10.2f}\n", What, Seconds);
+  };
+
+  Opts.Jobs = 1;
+  Opts.CacheDir = Root + "/cache-serial";
+  Report("from scratch, -j 1", TimeBuild(Opts));
+  Opts.Jobs = Jobs;
+  Opts.CacheDir = Root + "/cache";
+  Report(fmt::format("from scratch, -j {}", Jobs).c_str(), TimeBuild(Opts));
+  Report("nothing changed", TimeBuild(Opts));
+  unsigned Edited = NumFiles / 2;
+  WriteFile(fmt::format("{}/f{}.jl", Root, Edited), FileSource(Edited, 0.5));
+  Report("one body changed", TimeBuild(Opts));
+  return 0;
+}
@@ -0,0 +1,86 @@
+// Compiles and evaluates a stream of distinct top-level expressions with code
+// running in process and in an executor process, and reports throughput.
+// "overlapped" evaluates on a pool while the next expression compiles;
+// "serial" evaluates each expression before compiling the next.
+//
+// Usage: out_of_process [expressions] [evaluators]
+
+#include "jlang.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include <fmt/format.h>
+
+static const char *Library = "def f(x y) (x + 1) * (y - x) * (x * y + 2)\n"
+                             "def g(x) f(x, x * 2) - f(x * 3, x)\n";
+
+// Returns expressions per second, or a negative number on failure.
+static double RunWorkload(bool Remote, bool Overlapped, unsigned NumExprs,
+                          unsigned NumEvaluators) {
+  jlang::EngineOptions Opts;
+  Opts.Echo = false;
+  if (Remote)
+    Opts.Executor = "/proc/self/exe";
+  jlang::Engine Engine(Opts);
+  if (!Engine.define(Library))
+    return -1;
+
+  std::atomic<unsigned> Evaluated{0};
+  auto Start = std::chrono::steady_clock::now();
+  {
+    ThreadPool Evaluators(Overlapped ? NumEvaluators : 0);
+    for (unsigned I = 0; I < NumExprs; ++I) {
+      std::string Source =
+          fmt::format("g({0}) + f({0}, g({1})) * {1}", I, I % 7 + 1);
+      Engine.run(Source, [&](jlang::Evaluation E) {
+        if (!Overlapped) {
+          E();
+          ++Evaluated;
+          return;
+        }
+        Evaluators.submit([&, E = std::move(E)] {
+          E();
+          ++Evaluated;
+        });
+      });
+    }
+  }
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+  if (Evaluated != NumExprs)
+    return -1;
+  return NumExprs / Elapsed.count();
+}
+
+int main(int argc, char **argv) {
+  // Started by a remote engine to run its code.
+  int InFd, OutFd;
+  if (argc == 2 && std::sscanf(argv[1], "filedescs=%d,%d", &InFd, &OutFd) == 2)
+    return jlang::runExecutor(InFd, OutFd) ? 0 : 1;
+
+  unsigned NumExprs = argc > 1 ? std::atoi(argv[1]) : 2000;
+  unsigned NumEvaluators = argc > 2 ? std::atoi(argv[2]) : 2;
+  if (NumEvaluators == 0)
+    NumEvaluators = 1;
+
+  fmt::print("{:>16} {:>12} {:>14}\n", "executor", "evaluation",
+             "expressions/s");
+  for (bool Remote : {false, true})
+    for (bool Overlapped : {false, true}) {
+      double Rate = RunWorkload(Remote, Overlapped, NumExprs, NumEvaluators);
+      if (Rate < 0) {
+        fmt::print(stderr, "workload failed\n");
+        return 1;
+      }
+      fmt::print("{:>16} {:>12} {:>14.0f}\n",
+                 Remote ? "out-of-process" : "in-process",
+                 Overlapped ? "overlapped" : "serial", Rate);
+    }
+  return 0;
+}
@@ -0,0 +1,182 @@
+// Drives a running `jlang --serve` with pipelined evaluation requests from
+// several connections at once, and reports latency percentiles and
+// throughput.
+//
+// Usage: server_load socket [connections] [requests-per-connection]
+//                    [pipeline-depth] [rows-per-request]
+
+#include "server.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+static int Connect(const char *Path) {
+  int Fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  sockaddr_un Addr = {};
+  Addr.sun_family = AF_UNIX;
+  std::snprintf(Addr.sun_path, sizeof(Addr.sun_path), "%s", Path);
+  if (connect(Fd, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) < 0) {
+    close(Fd);
+    return -1;
+  }
+  return Fd;
+}
+
+static bool WriteAll(int Fd, const std::string &Buf) {
+  for (std::size_t Pos = 0; Pos < Buf.size();) {
+    ssize_t W = write(Fd, Buf.data() + Pos, Buf.size() - Pos);
+    if (W <= 0)
+      return false;
+    Pos += W;
+  }
+  return true;
+}
+
+// Read one response frame; returns its id and status.
+static bool ReadFrame(int Fd, std::string &Buf, std::uint32_t &Id,
+                      jlang::ResponseStatus &Status) {
+  auto Fill = [&](std::size_t N) {
+    char Chunk[1 << 16];
+    while (Buf.size() < N) {
+      ssize_t R = read(Fd, Chunk, sizeof(Chunk));
+      if (R <= 0)
+        return false;
+      Buf.append(Chunk, R);
+    }
+    return true;
+  };
+  if (!Fill(4))
+    return false;
+  auto Size = jlang::readRaw<std::uint32_t>(Buf.data());
+  if (!Fill(4 + Size))
+    return false;
+  Id = jlang::readRaw<std::uint32_t>(Buf.data() + 4);
+  Status = jlang::ResponseStatus(jlang::readRaw<std::uint8_t>(Buf.data() + 8));
+  Buf.erase(0, 4 + Size);
+  return true;
+}
+
+// Send Requests evaluations of f, keeping Depth in flight, and record the
+// latency of each in Latencies.
+static bool RunConnection(const char *Path, unsigned Requests, unsigned Depth,
+                          unsigned Rows, std::vector<double> &Latencies) {
+  int Fd = Connect(Path);
+  if (Fd < 0)
+    return false;
+
+  std::vector<double> Args(2 * Rows);
+  for (unsigned I = 0; I < Args.size(); ++I)
+    Args[I] = I * 0.5;
+
+  std::vector<Clock::time_point> Sent(Requests);
+  std::string Out, In;
+  unsigned NextId = 0, Received = 0;
+  bool Ok = true;
+  while (Ok && Received < Requests) {
+    Out.clear();
+    for (; NextId < Requests && NextId - Received < Depth; ++NextId) {
+      jlang::appendEvaluate(Out, NextId, "f", Args.data(), Args.size(), Rows);
+      Sent[NextId] = Clock::now();
+    }
+    if (!Out.empty() && !WriteAll(Fd, Out))
+      break;
+
+    std::uint32_t Id;
+    jlang::ResponseStatus Status;
+    if (!ReadFrame(Fd, In, Id, Status) || Id >= Requests ||
+        Status != jlang::ResponseStatus::Ok) {
+      Ok = false;
+      break;
+    }
+    std::chrono::duration<double> Latency = Clock::now() - Sent[Id];
+    Latencies.push_back(Latency.count());
+    ++Received;
+  }
+  close(Fd);
+  return Ok && Received == Requests;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fmt::print(stderr, "usage: server_load socket [connections] "
+                       "[requests-per-connection] [pipeline-depth] "
+                       "[rows-per-request]\n");
+    return 1;
+  }
+  const char *Path = argv[1];
+  unsigned Connections = argc > 2 ? std::atoi(argv[2]) : 4;
+  unsigned Requests = argc > 3 ? std::atoi(argv[3]) : 20000;
+  unsigned Depth = argc > 4 ? std::atoi(argv[4]) : 16;
+  unsigned Rows = argc > 5 ? std::atoi(argv[5]) : 1;
+  Connections = std::max(1u, Connections);
+  Depth = std::max(1u, Depth);
+  Rows = std::max(1u, Rows);
+
+  // Define the function every request calls.
+  int Fd = Connect(Path);
+  if (Fd < 0) {
+    fmt::print(stderr, "can't connect to {}\n", Path);
+    return 1;
+  }
+  std::string Out, In;
+  jlang::appendDefine(Out, 0, "def f(x y) (x + 1) * (y - x) * (x * y + 2)");
+  auto DefineStart = Clock::now();
+  std::uint32_t Id;
+  jlang::ResponseStatus Status;
+  bool Defined = WriteAll(Fd, Out) && ReadFrame(Fd, In, Id, Status) &&
+                 Status == jlang::ResponseStatus::Ok;
+  std::chrono::duration<double> DefineTime = Clock::now() - DefineStart;
+  close(Fd);
+  if (!Defined) {
+    fmt::print(stderr, "definition failed\n");
+    return 1;
+  }
+
+  std::vector<std::vector<double>> Latencies(Connections);
+  std::vector<char> Ok(Connections, 0);
+  std::vector<std::thread> Threads;
+  auto Start = Clock::now();
+  for (unsigned C = 0; C < Connections; ++C)
+    Threads.emplace_back([&, C] {
+      Ok[C] = RunConnection(Path, Requests, Depth, Rows, Latencies[C]);
+    });
+  for (auto &T : Threads)
+    T.join();
+  std::chrono::duration<double> Elapsed = Clock::now() - Start;
+
+  for (char C : Ok)
+    if (!C) {
+      fmt::print(stderr, "a connection failed\n");
+      return 1;
+    }
+
+  std::vector<double> All;
+  for (auto &L : Latencies)
+    All.insert(All.end(), L.begin(), L.end());
+  std::sort(All.begin(), All.end());
+  auto Percentile = [&](double P) {
+    return All[std::min(All.size() - 1, std::size_t(P * All.size()))] * 1e6;
+  };
+
+  fmt::print("define: {:.1f}us\n", DefineTime.count() * 1e6);
+  fmt::print("{} connections, depth {}, {} rows per request\n", Connections,
+             Depth, Rows);
+  fmt::print("{:>10} {:>10} {:>10} {:>14} {:>14}\n", "requests", "p50 us",
+             "p99 us", "requests/s", "rows/s");
+  fmt::print("{:>10} {:>10.1f} {:>10.1f} {:>14.0f} {:>14.0f}\n", All.size(),
+             Percentile(0.50), Percentile(0.99), All.size() / Elapsed.count(),
+             All.size() * Rows / Elapsed.count());
+  return 0;
+}
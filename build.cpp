@@ -0,0 +1,674 @@
+#include "build.h"
+
+#include "jlang.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fmt/format.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace jlang {
+namespace {
+
+// One file of the build.
+struct File {
+  std::string Path;
+  std::string Source;
+  FileInterface Interface;
+  // Indices of the files it imports.
+  std::vector<std::size_t> Imports;
+  // The functions defined by everything it imports, directly or not.
+  std::vector<std::pair<std::string, std::size_t>> Imported;
+
+  // Unoptimized bitcode and the summary of each function, keyed by the
+  // source and what it imports.
+  std::string Key;
+  std::string BitcodePath;
+  std::vector<FunctionSummary> Summaries;
+
+  // Chosen by the thin link: the functions of other files to copy in for
+  // inlining, as indices of their files and names, and the functions of
+  // other files it calls that are pure.
+  std::vector<std::pair<std::size_t, std::string>> CrossImports;
+  std::vector<std::string> PureCallees;
+  // From the profile, if there is one.
+  FunctionLayout Layout;
+  std::string ObjectPath;
+};
+
+// FNV-1a. Keys only have to tell builds of this compiler apart.
+std::uint64_t Hash(std::string_view Data,
+                   std::uint64_t H = 14695981039346656037u) {
+  for (unsigned char C : Data) {
+    H ^= C;
+    H *= 1099511628211u;
+  }
+  return H;
+}
+
+bool ReadFile(const std::string &Path, std::string &Out) {
+  std::ifstream In(Path, std::ios::binary);
+  if (!In)
+    return false;
+  Out.assign(std::istreambuf_iterator<char>(In), {});
+  return true;
+}
+
+std::string RealPath(const std::string &Path) {
+  char Buf[PATH_MAX];
+  return realpath(Path.c_str(), Buf) ? Buf : "";
+}
+
+std::string DirName(const std::string &Path) {
+  auto Slash = Path.rfind('/');
+  return Slash == std::string::npos ? "." : Path.substr(0, Slash);
+}
+
+// Read and scan every file reachable from Inputs.
+bool LoadFiles(const std::vector<std::string> &Inputs,
+               std::vector<File> &Files) {
+  std::map<std::string, std::size_t> Index;
+  // Adds Path if it's new; returns its index, or -1 if it can't be read.
+  auto Add = [&](const std::string &Path) -> long {
+    std::string Real = RealPath(Path);
+    if (Real.empty()) {
+      fmt::print(stderr, "Can't find {}\n", Path);
+      return -1;
+    }
+    auto [It, New] = Index.emplace(Real, Files.size());
+    if (New) {
+      Files.emplace_back();
+      Files.back().Path = Real;
+    }
+    return It->second;
+  };
+
+  for (auto &Input : Inputs)
+    if (Add(Input) < 0)
+      return false;
+  // Files grows as imports are found.
+  for (std::size_t I = 0; I < Files.size(); ++I) {
+    std::string Path = Files[I].Path;
+    std::string Source;
+    FileInterface Interface;
+    if (!ReadFile(Path, Source)) {
+      fmt::print(stderr, "Can't read {}: {}\n", Path, std::strerror(errno));
+      return false;
+    }
+    if (!scanFile(Source, Interface)) {
+      fmt::print(stderr, "Can't parse {}\n", Path);
+      return false;
+    }
+    std::vector<std::size_t> Imports;
+    for (auto &Import : Interface.Imports) {
+      long J = Add(Import[0] == '/' ? Import : DirName(Path) + "/" + Import);
+      if (J < 0)
+        return false;
+      Imports.push_back(J);
+    }
+    Files[I].Source = std::move(Source);
+    Files[I].Interface = std::move(Interface);
+    Files[I].Imports = std::move(Imports);
+  }
+  return true;
+}
+
+// Fill in what each file imports, and reject functions defined twice.
+bool ResolveImports(std::vector<File> &Files) {
+  std::map<std::string, std::size_t> DefinedIn;
+  for (std::size_t I = 0; I < Files.size(); ++I)
+    for (auto &[Name, Arity] : Files[I].Interface.Functions) {
+      auto [It, New] = DefinedIn.emplace(Name, I);
+      if (!New && It->second != I) {
+        fmt::print(stderr, "{} is defined in both {} and {}\n", Name,
+                   Files[It->second].Path, Files[I].Path);
+        return false;
+      }
+    }
+
+  for (auto &F : Files) {
+    std::set<std::size_t> Seen;
+    std::vector<std::size_t> Stack(F.Imports);
+    while (!Stack.empty()) {
+      std::size_t J = Stack.back();
+      Stack.pop_back();
+      if (&Files[J] == &F || !Seen.insert(J).second)
+        continue;
+      Stack.insert(Stack.end(), Files[J].Imports.begin(),
+                   Files[J].Imports.end());
+    }
+    // Sorted, so that the cache key doesn't depend on import order.
+    std::map<std::string, std::size_t> Imported;
+    for (std::size_t J : Seen)
+      for (auto &Fn : Files[J].Interface.Functions)
+        Imported.insert(Fn);
+    F.Imported.assign(Imported.begin(), Imported.end());
+  }
+  return true;
+}
+
+// Bitcode depends on the compiler, the source, and the functions the file
+// imports; those are all compileToBitcode sees.
+std::string BitcodeKey(const std::string &CompilerId, const File &F) {
+  std::uint64_t H = Hash(CompilerId);
+  H = Hash(F.Source, Hash(std::to_string(F.Source.size()), H));
+  for (auto &[Name, Arity] : F.Imported)
+    H = Hash(fmt::format("{}/{};", Name, Arity), H);
+  return fmt::format("{:016x}", H);
+}
+
+// The object depends on the bitcode, on the code of each function imported
+// into it, and on what's known to be pure.
+std::string ObjectKey(const std::vector<File> &Files, const File &F) {
+  std::map<std::string, std::uint64_t> FunctionHashes;
+  for (auto &[I, Name] : F.CrossImports)
+    for (auto &S : Files[I].Summaries)
+      if (S.Name == Name)
+        FunctionHashes[Name] = S.Hash;
+  std::uint64_t H = Hash(F.Key);
+  for (auto &[Name, FnHash] : FunctionHashes)
+    H = Hash(fmt::format("import {} {};", Name, FnHash), H);
+  for (auto &Name : F.PureCallees)
+    H = Hash(fmt::format("pure {};", Name), H);
+  for (auto &Name : F.Layout.Hot)
+    H = Hash(fmt::format("hot {};", Name), H);
+  for (auto &Name : F.Layout.Cold)
+    H = Hash(fmt::format("cold {};", Name), H);
+  return fmt::format("{:016x}", H);
+}
+
+bool ReadProfile(const std::string &Path,
+                 std::map<std::string, std::uint64_t> &Counts) {
+  std::string Text;
+  if (!ReadFile(Path, Text)) {
+    fmt::print(stderr, "Can't read {}: {}\n", Path, std::strerror(errno));
+    return false;
+  }
+  std::istringstream In(Text);
+  std::string Line;
+  for (unsigned LineNo = 1; std::getline(In, Line); ++LineNo) {
+    std::istringstream Fields(Line);
+    std::uint64_t Count;
+    std::string Name;
+    if (Line.find_first_not_of(" \t") == std::string::npos ||
+        Line[Line.find_first_not_of(" \t")] == '#')
+      continue;
+    if (!(Fields >> Count >> Name)) {
+      fmt::print(stderr, "{}:{}: expected a count and a function name\n",
+                 Path, LineNo);
+      return false;
+    }
+    Counts[Name] += Count;
+  }
+  return true;
+}
+
+// Split the functions of the build into hot, cold and the rest by their call
+// counts, the way LLVM's profile summary does. Returns the hot functions,
+// hottest first.
+std::vector<std::string>
+LayOut(std::vector<File> &Files,
+       const std::map<std::string, std::uint64_t> &Counts) {
+  std::vector<std::pair<std::uint64_t, std::string>> Called;
+  std::uint64_t Total = 0;
+  for (auto &F : Files) {
+    F.Layout = {};
+    for (auto &S : F.Summaries) {
+      auto It = Counts.find(S.Name);
+      if (It == Counts.end() || It->second == 0) {
+        F.Layout.Cold.push_back(S.Name);
+        continue;
+      }
+      Called.emplace_back(It->second, S.Name);
+      Total += It->second;
+    }
+  }
+  std::sort(Called.begin(), Called.end(), [](auto &A, auto &B) {
+    return A.first != B.first ? A.first > B.first : A.second < B.second;
+  });
+
+  std::set<std::string> Hot;
+  std::vector<std::string> Order;
+  std::uint64_t Covered = 0;
+  for (auto &[Count, Name] : Called) {
+    // Until 99% of the calls are covered.
+    if (Covered >= Total - Total / 100)
+      break;
+    Covered += Count;
+    Hot.insert(Name);
+    Order.push_back(Name);
+  }
+  for (auto &F : Files)
+    for (auto &S : F.Summaries)
+      if (Hot.count(S.Name))
+        F.Layout.Hot.push_back(S.Name);
+  return Order;
+}
+
+// Summaries are kept next to the bitcode, a function per line:
+//   name size hash pure callee...
+std::string FormatSummaries(const std::vector<FunctionSummary> &Summaries) {
+  std::string Out;
+  for (auto &S : Summaries) {
+    Out += fmt::format("{} {} {} {}", S.Name, S.Size, S.Hash, int(S.Pure));
+    for (auto &Callee : S.Callees)
+      Out += " " + Callee;
+    Out += "\n";
+  }
+  return Out;
+}
+
+bool ParseSummaries(const std::string &Text,
+                    std::vector<FunctionSummary> &Summaries) {
+  std::istringstream In(Text);
+  std::string Line;
+  while (std::getline(In, Line)) {
+    std::istringstream Fields(Line);
+    FunctionSummary S;
+    int Pure;
+    if (!(Fields >> S.Name >> S.Size >> S.Hash >> Pure))
+      return false;
+    S.Pure = Pure;
+    for (std::string Callee; Fields >> Callee;)
+      S.Callees.push_back(Callee);
+    Summaries.push_back(std::move(S));
+  }
+  return true;
+}
+
+// The thin link: from the summaries of every file, work out which functions
+// are pure and which small callees each file should copy in from others.
+void ThinLink(std::vector<File> &Files, unsigned ImportLimit) {
+  struct Def {
+    std::size_t File;
+    const FunctionSummary *Summary;
+  };
+  std::map<std::string, Def> Defs;
+  for (std::size_t I = 0; I < Files.size(); ++I)
+    for (auto &S : Files[I].Summaries)
+      Defs[S.Name] = {I, &S};
+
+  // A function is pure if it and everything it calls are.
+  std::set<std::string> Impure;
+  for (auto &[Name, D] : Defs)
+    if (!D.Summary->Pure)
+      Impure.insert(Name);
+  for (bool Changed = true; Changed;) {
+    Changed = false;
+    for (auto &[Name, D] : Defs)
+      if (!Impure.count(Name) &&
+          std::any_of(D.Summary->Callees.begin(), D.Summary->Callees.end(),
+                      [&](const std::string &C) { return Impure.count(C); }))
+        Changed = Impure.insert(Name).second;
+  }
+
+  for (std::size_t I = 0; I < Files.size(); ++I) {
+    File &F = Files[I];
+    // Like ThinLTO, callees of imported functions are imported under a
+    // tighter limit, so that chains of calls don't pull in whole files.
+    std::set<std::string> Imports, Called;
+    std::vector<std::pair<std::string, double>> Work;
+    for (auto &S : F.Summaries)
+      for (auto &Callee : S.Callees)
+        Work.emplace_back(Callee, ImportLimit);
+    while (!Work.empty()) {
+      auto [Name, Limit] = Work.back();
+      Work.pop_back();
+      auto D = Defs.find(Name);
+      if (D == Defs.end() || D->second.File == I)
+        continue;
+      Called.insert(Name);
+      if (D->second.Summary->Size > Limit || !Imports.insert(Name).second)
+        continue;
+      for (auto &Callee : D->second.Summary->Callees)
+        Work.emplace_back(Callee, Limit * 0.7);
+    }
+    F.CrossImports.clear();
+    for (auto &Name : Imports)
+      F.CrossImports.emplace_back(Defs[Name].File, Name);
+    F.PureCallees.clear();
+    for (auto &Name : Called)
+      if (!Impure.count(Name))
+        F.PureCallees.push_back(Name);
+  }
+}
+
+// Run Task on each of Items on Jobs threads. Returns false if any fails.
+template <typename T, typename Fn>
+bool RunParallel(const std::vector<T> &Items, unsigned Jobs, Fn Task) {
+  std::atomic<bool> Failed{false};
+  {
+    ThreadPool Workers(std::max(1u, Jobs));
+    for (auto &Item : Items)
+      Workers.submit([&] {
+        if (!Task(Item))
+          Failed = true;
+      });
+  }
+  return !Failed;
+}
+
+bool WriteFile(const std::string &Path, const std::string &Data) {
+  // Written aside and renamed, so that an interrupted build leaves no
+  // truncated file behind.
+  std::string Tmp = fmt::format("{}.{}.tmp", Path, getpid());
+  std::ofstream Out(Tmp, std::ios::binary);
+  Out.write(Data.data(), Data.size());
+  Out.close();
+  if (!Out || std::rename(Tmp.c_str(), Path.c_str()) != 0) {
+    std::remove(Tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// libfoo.so -> libfoo.h
+std::string HeaderPath(const std::string &Output) {
+  auto Slash = Output.rfind('/');
+  auto Dot = Output.rfind('.');
+  if (Dot == std::string::npos || (Slash != std::string::npos && Dot < Slash))
+    Dot = Output.size();
+  return Output.substr(0, Dot) + ".h";
+}
+
+bool IsCKeyword(const std::string &Name) {
+  // C's, and C++'s too since the header is also included from C++.
+  static const std::set<std::string> Keywords = {
+      "alignas",  "alignof",   "and",      "asm",       "auto",
+      "bool",     "break",     "case",     "catch",     "char",
+      "class",    "const",     "continue", "default",   "delete",
+      "do",       "double",    "else",     "enum",      "explicit",
+      "extern",   "false",     "float",    "for",       "friend",
+      "goto",     "if",        "inline",   "int",       "long",
+      "mutable",  "namespace", "new",      "not",       "operator",
+      "or",       "private",   "protected", "public",   "register",
+      "restrict", "return",    "short",    "signed",    "sizeof",
+      "static",   "struct",    "switch",   "template",  "this",
+      "throw",    "true",      "try",      "typedef",   "typename",
+      "union",    "unsigned",  "using",    "virtual",   "void",
+      "volatile", "while",     "xor"};
+  return Keywords.count(Name);
+}
+
+// A C header declaring every exported function, for Options.Shared. Returns
+// false if nothing is exported or an export can't be declared in C.
+bool MakeHeader(const std::vector<File> &Files, const std::string &Output,
+                std::string &Header) {
+  if (std::none_of(Files.begin(), Files.end(), [](const File &F) {
+        return !F.Interface.Exports.empty();
+      })) {
+    fmt::print(stderr, "Nothing to export: no function is defined with "
+                       "`export def`\n");
+    return false;
+  }
+
+  std::string Base = HeaderPath(Output);
+  Base = Base.substr(Base.rfind('/') + 1);
+  std::string Guard = std::isdigit(Base[0]) ? "_" : "";
+  for (char C : Base)
+    Guard += std::isalnum(C) ? std::toupper(C) : '_';
+
+  Header = fmt::format("// Generated by jlang build. Link with {}.\n"
+                       "#ifndef {}\n#define {}\n\n"
+                       "#ifdef __cplusplus\nextern \"C\" {{\n#endif\n\n",
+                       Output.substr(Output.rfind('/') + 1), Guard, Guard);
+  for (auto &F : Files)
+    for (auto &[Name, Params] : F.Interface.Exports) {
+      if (IsCKeyword(Name)) {
+        fmt::print(stderr, "{} in {} can't be exported: it's a C keyword\n",
+                   Name, F.Path);
+        return false;
+      }
+      std::string Args;
+      for (auto &Param : Params)
+        Args += fmt::format("{}double {}{}", Args.empty() ? "" : ", ", Param,
+                            IsCKeyword(Param) ? "_" : "");
+      Header += fmt::format("double {}({});\n", Name,
+                            Args.empty() ? "void" : Args);
+    }
+  Header += fmt::format("\n#ifdef __cplusplus\n}}\n#endif\n\n#endif // {}\n",
+                        Guard);
+  return true;
+}
+
+// A linker script that puts the sections of the hot functions first, in
+// Order: GNU ld has no symbol ordering file.
+std::string OrderScript(const std::vector<std::string> &Order) {
+  std::string Script = "SECTIONS\n{\n  .text.hot : {\n";
+  for (auto &Name : Order)
+    Script += fmt::format("    *(.text.hot.{})\n", Name);
+  Script += "    *(.text.hot .text.hot.*)\n  }\n}\nINSERT BEFORE .text;\n";
+  return Script;
+}
+
+bool Link(const std::vector<File> &Files, const BuildOptions &Options,
+          const std::string &Script) {
+  const std::string &Output = Options.Output;
+  // Through a response file, as thousands of objects may not fit on a
+  // command line.
+  std::string Response;
+  for (auto &F : Files)
+    Response += F.ObjectPath + "\n";
+  std::string ResponsePath = Options.CacheDir + "/link.rsp";
+  if (!WriteFile(ResponsePath, Response)) {
+    fmt::print(stderr, "Can't write {}\n", ResponsePath);
+    return false;
+  }
+
+  std::string ResponseArg = "@" + ResponsePath;
+  std::vector<const char *> Argv = {"ld", "-r"};
+  std::string ScriptPath = Options.CacheDir + "/exports.map";
+  if (Options.Shared) {
+    // Only the exported functions; the rest, and the prelude functions every
+    // object carries a copy of, stay local to the library.
+    std::string Script = "{\n  global:\n";
+    for (auto &F : Files)
+      for (auto &Export : F.Interface.Exports)
+        Script += fmt::format("    {};\n", Export.first);
+    Script += "  local: *;\n};\n";
+    if (!WriteFile(ScriptPath, Script)) {
+      fmt::print(stderr, "Can't write {}\n", ScriptPath);
+      return false;
+    }
+    Argv = {"ld", "-shared", "--version-script", ScriptPath.c_str()};
+  }
+  std::string OrderPath = Options.CacheDir + "/order.ld";
+  if (!Script.empty()) {
+    if (!WriteFile(OrderPath, Script)) {
+      fmt::print(stderr, "Can't write {}\n", OrderPath);
+      return false;
+    }
+    // With INSERT, the script amends the default one instead of replacing it.
+    Argv.insert(Argv.end(), {"-T", OrderPath.c_str()});
+  }
+  Argv.insert(Argv.end(), {"-o", Output.c_str(), ResponseArg.c_str()});
+  if (Options.Shared)
+    Argv.push_back("-lm");
+  Argv.push_back(nullptr);
+  pid_t Pid;
+  int Status;
+  if (posix_spawnp(&Pid, "ld", nullptr, nullptr,
+                   const_cast<char **>(Argv.data()), environ) != 0 ||
+      waitpid(Pid, &Status, 0) < 0 || !WIFEXITED(Status) ||
+      WEXITSTATUS(Status) != 0) {
+    fmt::print(stderr, "Linking {} failed\n", Output);
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+bool build(const BuildOptions &Options) {
+  auto Start = std::chrono::steady_clock::now();
+  std::vector<File> Files;
+  if (!LoadFiles(Options.Inputs, Files) || !ResolveImports(Files))
+    return false;
+
+  if (mkdir(Options.CacheDir.c_str(), 0777) != 0 && errno != EEXIST) {
+    fmt::print(stderr, "Can't create {}: {}\n", Options.CacheDir,
+               std::strerror(errno));
+    return false;
+  }
+
+  // Codegen each changed file to bitcode and summarize it.
+  std::string CompilerId = compilerId();
+  std::vector<File *> StaleBitcode;
+  for (auto &F : Files) {
+    F.Key = BitcodeKey(CompilerId, F);
+    F.BitcodePath = Options.CacheDir + "/" + F.Key + ".bc";
+    std::string Summaries;
+    if (!ReadFile(Options.CacheDir + "/" + F.Key + ".summary", Summaries) ||
+        !ParseSummaries(Summaries, F.Summaries)) {
+      F.Summaries.clear();
+      StaleBitcode.push_back(&F);
+    }
+  }
+  bool Ok = RunParallel(StaleBitcode, Options.Jobs, [&](File *F) {
+    std::string Bitcode;
+    if (!compileToBitcode(F->Path, F->Source, F->Imported, Bitcode,
+                          F->Summaries)) {
+      fmt::print(stderr, "Compiling {} failed\n", F->Path);
+      return false;
+    }
+    // The summary goes last: it marks the bitcode as complete.
+    if (!WriteFile(F->BitcodePath, Bitcode) ||
+        !WriteFile(Options.CacheDir + "/" + F->Key + ".summary",
+                   FormatSummaries(F->Summaries))) {
+      fmt::print(stderr, "Can't write {}\n", F->BitcodePath);
+      return false;
+    }
+    return true;
+  });
+  if (!Ok)
+    return false;
+
+  // Optimize each file whose bitcode, imports or layout changed, in parallel.
+  ThinLink(Files, Options.ImportLimit);
+  std::vector<std::string> HotOrder;
+  if (!Options.Profile.empty()) {
+    std::map<std::string, std::uint64_t> Counts;
+    if (!ReadProfile(Options.Profile, Counts))
+      return false;
+    HotOrder = LayOut(Files, Counts);
+  }
+  std::vector<File *> StaleObjects;
+  std::string Manifest;
+  for (auto &F : Files) {
+    F.ObjectPath = Options.CacheDir + "/" + ObjectKey(Files, F) + ".o";
+    Manifest += F.ObjectPath + "\n";
+    struct stat St;
+    if (stat(F.ObjectPath.c_str(), &St) != 0)
+      StaleObjects.push_back(&F);
+  }
+  Ok = RunParallel(StaleObjects, Options.Jobs, [&](File *F) {
+    std::map<std::size_t, std::string> Bitcode;
+    auto Load = [&](std::size_t I) -> const std::string * {
+      auto [It, New] = Bitcode.emplace(I, std::string());
+      if (New && !ReadFile(Files[I].BitcodePath, It->second)) {
+        fmt::print(stderr, "Can't read {}\n", Files[I].BitcodePath);
+        return nullptr;
+      }
+      return &It->second;
+    };
+    const std::string *Own = Load(F - Files.data());
+    std::vector<ImportedFunction> Imports;
+    for (auto &[I, Name] : F->CrossImports) {
+      const std::string *From = Load(I);
+      if (!Own || !From)
+        return false;
+      Imports.push_back({*From, Name});
+    }
+    std::string Object;
+    if (!Own || !compileBitcode(F->Path, *Own, Imports, F->PureCallees,
+                                Object, F->Layout)) {
+      fmt::print(stderr, "Optimizing {} failed\n", F->Path);
+      return false;
+    }
+    if (!WriteFile(F->ObjectPath, Object)) {
+      fmt::print(stderr, "Can't write {}\n", F->ObjectPath);
+      return false;
+    }
+    return true;
+  });
+  if (!Ok)
+    return false;
+
+  std::string Script;
+  if (!HotOrder.empty()) {
+    Script = OrderScript(HotOrder);
+    Manifest += Script;
+  }
+  std::string Header;
+  if (Options.Shared) {
+    if (!MakeHeader(Files, Options.Output, Header))
+      return false;
+    Manifest += "shared\n" + Header;
+  }
+
+  // The objects of the last link, so that an unchanged build skips it.
+  std::string ManifestPath =
+      fmt::format("{}/{:016x}.link", Options.CacheDir,
+                  Hash(RealPath(".") + "/" + Options.Output));
+  std::string LastManifest;
+  struct stat St;
+  bool UpToDate = StaleObjects.empty() &&
+                  stat(Options.Output.c_str(), &St) == 0 &&
+                  (!Options.Shared ||
+                   stat(HeaderPath(Options.Output).c_str(), &St) == 0) &&
+                  ReadFile(ManifestPath, LastManifest) &&
+                  LastManifest == Manifest;
+  if (!UpToDate) {
+    if (!Link(Files, Options, Script))
+      return false;
+    if (Options.Shared && !WriteFile(HeaderPath(Options.Output), Header)) {
+      fmt::print(stderr, "Can't write {}\n", HeaderPath(Options.Output));
+      return false;
+    }
+    WriteFile(ManifestPath, Manifest);
+  }
+
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+  if (UpToDate)
+    fmt::print("{} is up to date ({} files, {:.2f}s)\n", Options.Output,
+               Files.size(), Elapsed.count());
+  else
+    fmt::print("Compiled {} and optimized {} of {} files, and linked {} in "
+               "{:.2f}s\n",
+               StaleBitcode.size(), StaleObjects.size(), Files.size(),
+               Options.Output, Elapsed.count());
+  if (!Options.Profile.empty()) {
+    std::size_t Cold = 0;
+    for (auto &F : Files)
+      Cold += F.Layout.Cold.size();
+    fmt::print("Placed {} hot functions first and split out {} cold ones\n",
+               HotOrder.size(), Cold);
+  }
+  return true;
+}
+
+} // namespace jlang
@@ -0,0 +1,46 @@
+#ifndef JLANG_BUILD_H
+#define JLANG_BUILD_H
+
+#include <string>
+#include <vector>
+
+namespace jlang {
+
+struct BuildOptions {
+  // The files to build. The files they import are built with them.
+  std::vector<std::string> Inputs;
+  // The relocatable object every file is linked into.
+  std::string Output = "a.o";
+  // Where the object of each file is kept between builds.
+  std::string CacheDir = ".jlang-cache";
+  // How many files to compile at once.
+  unsigned Jobs = 1;
+  // Functions of at most this many instructions are copied into the files
+  // that call them, so they can be inlined across files. Zero turns that off.
+  unsigned ImportLimit = 60;
+  // Link a shared library that exports only the functions defined with
+  // `export def`, instead of a relocatable object, and write a C header that
+  // declares them next to it: libfoo.so gets libfoo.h.
+  bool Shared = false;
+  // Call counts to lay functions out by, a `count name` line per function.
+  // The functions that take 99% of the calls are placed together, hottest
+  // first, and the ones never called are optimized for size and split out.
+  std::string Profile;
+};
+
+// Compile every file reachable from Options.Inputs through imports and link
+// the objects with `ld -r`, in the manner of ThinLTO: each file is compiled to
+// bitcode with a summary of its functions, a thin link over the summaries
+// picks small callees to copy across files and finds pure functions, and then
+// each file is optimized on its own. Both steps are cached, so a file is only
+// recompiled when its source, the functions its imports define, or the
+// compiler changed, and reoptimized when something it imported changed too.
+// Returns false if a file fails to compile or the link fails.
+//
+// Objects are position independent and only need libm, so a shared library
+// built from them has no dependency on jlang or LLVM.
+bool build(const BuildOptions &Options);
+
+} // namespace jlang
+
+#endif // JLANG_BUILD_H
@@ -0,0 +1,328 @@
+#include "code_region.h"
+
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
+#include "llvm/Support/Memory.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <system_error>
+
+#include <fmt/format.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace llvm::jitlink;
+
+namespace jlang {
+namespace {
+
+// Zones, and the views of the region, are aligned to the size of a huge page.
+constexpr std::size_t ChunkSize = 2 << 20;
+// The smallest unit handed out, and the least alignment.
+constexpr std::size_t Granule = 16;
+
+std::size_t AlignUp(std::size_t N, std::size_t A) {
+  return (N + A - 1) / A * A;
+}
+
+Error ErrnoError(const char *What) {
+  return createStringError(std::error_code(errno, std::generic_category()),
+                           "%s: %s", What, std::strerror(errno));
+}
+
+// Reserve Size bytes of address space starting on a chunk boundary.
+char *Reserve(std::size_t Size) {
+  std::size_t Reserved = Size + ChunkSize;
+  void *Addr = mmap(nullptr, Reserved, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (Addr == MAP_FAILED)
+    return nullptr;
+  char *Mapped = static_cast<char *>(Addr);
+  char *Base = reinterpret_cast<char *>(
+      AlignUp(reinterpret_cast<std::uintptr_t>(Mapped), ChunkSize));
+  if (Base != Mapped)
+    munmap(Mapped, Base - Mapped);
+  munmap(Base + Size, Mapped + Reserved - (Base + Size));
+  return Base;
+}
+
+// How much of [Base, Base + Size) the kernel backs with huge pages.
+std::size_t HugePageBytes(const char *Base, std::size_t Size) {
+  auto Begin = reinterpret_cast<std::uintptr_t>(Base);
+  std::ifstream Smaps("/proc/self/smaps");
+  std::size_t Bytes = 0;
+  bool Inside = false;
+  for (std::string Line; std::getline(Smaps, Line);) {
+    std::uintptr_t Start, End;
+    std::size_t KB;
+    if (std::sscanf(Line.c_str(), "%" SCNxPTR "-%" SCNxPTR " ", &Start,
+                    &End) == 2)
+      Inside = Start >= Begin && End <= Begin + Size;
+    else if (Inside &&
+             std::sscanf(Line.c_str(), "ShmemPmdMapped: %zu kB", &KB) == 1)
+      Bytes += KB * 1024;
+  }
+  return Bytes;
+}
+
+} // namespace
+
+struct CodeRegion::FinalizedInfo {
+  std::vector<Piece> Pieces;
+  std::vector<orc::shared::WrapperFunctionCall> DeallocActions;
+};
+
+// Segments are laid out in working memory of their own and copied into the
+// region on finalize, once they're fully linked.
+class CodeRegion::InFlight : public InFlightAlloc {
+public:
+  InFlight(CodeRegion &Region, LinkGraph &G) : Region(Region), G(G) {}
+  ~InFlight() override { releaseAll(); }
+
+  void abandon(OnAbandonedFunction OnAbandoned) override {
+    releaseAll();
+    OnAbandoned(Error::success());
+  }
+
+  void finalize(OnFinalizedFunction OnFinalized) override {
+    for (auto &S : Segments)
+      Region.write(*S.P.Z, S.P.Z->Base + S.P.Offset, S.Working.get(),
+                   S.P.Size);
+    auto DeallocActions = orc::shared::runFinalizeActions(G.allocActions());
+    if (!DeallocActions) {
+      releaseAll();
+      OnFinalized(DeallocActions.takeError());
+      return;
+    }
+    auto Info = std::make_unique<FinalizedInfo>();
+    Info->DeallocActions = std::move(*DeallocActions);
+    for (auto &S : Segments)
+      if (S.Policy == MemDeallocPolicy::Standard)
+        Info->Pieces.push_back(S.P);
+      else
+        Region.release(S.P);
+    Segments.clear();
+    OnFinalized(FinalizedAlloc(orc::ExecutorAddr::fromPtr(Info.release())));
+  }
+
+  void releaseAll() {
+    for (auto &S : Segments)
+      Region.release(S.P);
+    Segments.clear();
+  }
+
+  struct Segment {
+    Piece P;
+    MemDeallocPolicy Policy;
+    std::unique_ptr<char[]> Working;
+  };
+
+  CodeRegion &Region;
+  LinkGraph &G;
+  std::vector<Segment> Segments;
+};
+
+Expected<std::unique_ptr<CodeRegion>> CodeRegion::Create(std::size_t Size,
+                                                         HotnessFn IsHot) {
+  // Four zones of whole chunks, on a chunk boundary.
+  Size = AlignUp(std::max(Size, 4 * ChunkSize), 4 * ChunkSize);
+  // The region is a memory file mapped twice: code runs from a view that is
+  // never writable, and is copied in through a writable alias, so no page is
+  // ever writable and executable at once.
+  int Fd = memfd_create("jlang-code", MFD_CLOEXEC);
+  if (Fd < 0)
+    return ErrnoError("Can't create the JIT's code region");
+  char *Base = nullptr, *Alias = nullptr;
+  auto Fail = [&](const char *What) {
+    auto Err = ErrnoError(What);
+    if (Base)
+      munmap(Base, Size);
+    if (Alias)
+      munmap(Alias, Size);
+    ::close(Fd);
+    return Err;
+  };
+  if (ftruncate(Fd, Size) != 0)
+    return Fail("Can't size the JIT's code region");
+  if (!(Base = Reserve(Size)))
+    return Fail("Can't reserve the JIT's code region");
+  if (mmap(Base, Size, PROT_NONE, MAP_SHARED | MAP_FIXED, Fd, 0) == MAP_FAILED)
+    return Fail("Can't map the JIT's code region");
+  if (!(Alias = Reserve(Size)))
+    return Fail("Can't reserve the JIT's code region");
+  if (mmap(Alias, Size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, Fd,
+           0) == MAP_FAILED)
+    return Fail("Can't map the JIT's code region");
+  // Only a hint: unless the kernel allows huge pages for shared memory
+  // (shmem_enabled), the region gets small pages.
+  madvise(Base, Size, MADV_HUGEPAGE);
+  madvise(Alias, Size, MADV_HUGEPAGE);
+
+  std::unique_ptr<CodeRegion> Region(
+      new CodeRegion(Base, Alias, Size, std::move(IsHot)));
+  for (Zone *Z : {&Region->HotCode, &Region->ColdCode, &Region->ReadOnly,
+                  &Region->ReadWrite})
+    if (mprotect(Z->Base, Z->Size, Z->Prot) != 0)
+      return Fail("Can't set up the JIT's code region");
+  ::close(Fd);
+  return Region;
+}
+
+CodeRegion::CodeRegion(char *Base, char *Alias, std::size_t Size,
+                       HotnessFn IsHot)
+    : Base(Base), Alias(Alias), Size(Size), IsHot(std::move(IsHot)) {
+  std::size_t ZoneSize = Size / 4;
+  HotCode = {"hot code", Base, ZoneSize, PROT_READ | PROT_EXEC, {}};
+  ColdCode = {"cold code", Base + ZoneSize, ZoneSize, PROT_READ | PROT_EXEC,
+              {}};
+  ReadOnly = {"read-only data", Base + 2 * ZoneSize, ZoneSize, PROT_READ, {}};
+  ReadWrite = {"data", Base + 3 * ZoneSize, ZoneSize, PROT_READ | PROT_WRITE,
+               {}};
+}
+
+CodeRegion::~CodeRegion() {
+  munmap(Base, Size);
+  munmap(Alias, Size);
+}
+
+void CodeRegion::allocate(const JITLinkDylib *, LinkGraph &G,
+                          OnAllocatedFunction OnAllocated) {
+  bool Hot = !IsHot || IsHot(G);
+  auto Alloc = std::make_unique<InFlight>(*this, G);
+  BasicLayout Layout(G);
+  for (auto &[Group, Seg] : Layout.segments()) {
+    std::size_t SegSize =
+        AlignUp(Seg.ContentSize + Seg.ZeroFillSize, Granule);
+    MemProt Prot = Group.getMemProt();
+    Zone &Z = (Prot & MemProt::Exec) != MemProt::None
+                  ? (Hot ? HotCode : ColdCode)
+              : (Prot & MemProt::Write) != MemProt::None ? ReadWrite
+                                                         : ReadOnly;
+    std::size_t Offset = 0;
+    if (SegSize && !take(Z, SegSize,
+                         std::max<std::size_t>(Seg.Alignment.value(), Granule),
+                         Offset)) {
+      OnAllocated(createStringError(inconvertibleErrorCode(),
+                                    "The JIT's %s zone is full", Z.Name));
+      return;
+    }
+    // Value-initialized, which takes care of zero-fill.
+    auto Working = std::make_unique<char[]>(SegSize);
+    Seg.Addr = orc::ExecutorAddr::fromPtr(Z.Base + Offset);
+    Seg.WorkingMem = Working.get();
+    if (SegSize)
+      Alloc->Segments.push_back({{&Z, Offset, SegSize},
+                                 Group.getMemDeallocPolicy(),
+                                 std::move(Working)});
+  }
+  if (auto Err = Layout.apply()) {
+    OnAllocated(std::move(Err));
+    return;
+  }
+  OnAllocated(std::move(Alloc));
+}
+
+void CodeRegion::deallocate(std::vector<FinalizedAlloc> Allocs,
+                            OnDeallocatedFunction OnDeallocated) {
+  Error Err = Error::success();
+  for (auto It = Allocs.rbegin(); It != Allocs.rend(); ++It) {
+    auto *Info = It->release().toPtr<FinalizedInfo *>();
+    Err = joinErrors(std::move(Err),
+                     orc::shared::runDeallocActions(Info->DeallocActions));
+    for (auto &P : Info->Pieces)
+      release(P);
+    delete Info;
+  }
+  OnDeallocated(std::move(Err));
+}
+
+bool CodeRegion::take(Zone &Z, std::size_t Size, std::size_t Align,
+                      std::size_t &Offset) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  // The lowest hole that fits, so that live code stays packed.
+  for (auto It = Z.Free.begin(); It != Z.Free.end(); ++It) {
+    std::size_t Start = AlignUp(It->first, Align);
+    std::size_t BlockStart = It->first, End = It->first + It->second;
+    if (Start + Size > End)
+      continue;
+    Z.Free.erase(It);
+    if (Start > BlockStart)
+      Z.Free[BlockStart] = Start - BlockStart;
+    if (End > Start + Size)
+      Z.Free[Start + Size] = End - (Start + Size);
+    Offset = Start;
+    Z.Used += Size;
+    ++Z.Allocations;
+    return true;
+  }
+  std::size_t Start = AlignUp(Z.Top, Align);
+  if (Start + Size > Z.Size)
+    return false;
+  if (Start > Z.Top)
+    Z.Free[Z.Top] = Start - Z.Top;
+  Z.Top = Start + Size;
+  Offset = Start;
+  Z.Used += Size;
+  ++Z.Allocations;
+  return true;
+}
+
+void CodeRegion::release(const Piece &P) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Zone &Z = *P.Z;
+  Z.Used -= P.Size;
+  --Z.Allocations;
+  // Merge with the holes on either side.
+  std::size_t Start = P.Offset, End = P.Offset + P.Size;
+  auto Next = Z.Free.lower_bound(Start);
+  if (Next != Z.Free.end() && Next->first == End) {
+    End += Next->second;
+    Next = Z.Free.erase(Next);
+  }
+  if (Next != Z.Free.begin()) {
+    auto Prev = std::prev(Next);
+    if (Prev->first + Prev->second == Start) {
+      Start = Prev->first;
+      Z.Free.erase(Prev);
+    }
+  }
+  if (End == Z.Top)
+    Z.Top = Start;
+  else
+    Z.Free[Start] = End - Start;
+}
+
+void CodeRegion::write(Zone &Z, char *Dest, const char *Src,
+                       std::size_t Size) {
+  std::memcpy(Alias + (Dest - Base), Src, Size);
+  if (Z.Prot & PROT_EXEC)
+    sys::Memory::InvalidateInstructionCache(Dest, Size);
+}
+
+CodeRegionStats CodeRegion::stats() {
+  CodeRegionStats Stats;
+  Stats.Enabled = true;
+  Stats.Reserved = Size;
+  Stats.HugePageBytes = HugePageBytes(Base, Size);
+  std::lock_guard<std::mutex> Lock(Mutex);
+  for (Zone *Z : {&HotCode, &ColdCode, &ReadOnly, &ReadWrite}) {
+    CodeRegionStats::Zone ZS;
+    ZS.Name = Z->Name;
+    ZS.Size = Z->Size;
+    ZS.Used = Z->Used;
+    ZS.Span = Z->Top;
+    ZS.Allocations = Z->Allocations;
+    ZS.FreeBlocks = Z->Free.size();
+    for (auto &[Offset, Size] : Z->Free)
+      ZS.LargestFree = std::max(ZS.LargestFree, Size);
+    Stats.Zones.push_back(ZS);
+  }
+  return Stats;
+}
+
+} // namespace jlang
@@ -0,0 +1,94 @@
+#ifndef JLANG_CODE_REGION_H
+#define JLANG_CODE_REGION_H
+
+#include "jlang.h"
+
+#include "llvm/ExecutionEngine/JITLink/JITLinkMemoryManager.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace jlang {
+
+// A JITLink memory manager that places everything the JIT links in one
+// reserved region, backed by 2MB pages where the kernel allows, instead of
+// mapping pages for each object. The region is split into zones: hot code,
+// cold code, read-only data and writable data. Allocations are packed first
+// fit from the start of their zone, so hot code shares as few pages, and
+// iTLB entries, as it can.
+//
+// The region is a memory file with two views. Code runs from one in which
+// the code zones are only ever readable and executable, and is copied in
+// through the other, which is writable and never executable. Protections
+// therefore never change after setup and huge pages aren't split.
+class CodeRegion : public llvm::jitlink::JITLinkMemoryManager {
+public:
+  // Decides whether the code of a graph goes in the hot zone.
+  using HotnessFn = std::function<bool(const llvm::jitlink::LinkGraph &)>;
+
+  // Reserves Size bytes of address space; nothing is committed until code is
+  // written.
+  static llvm::Expected<std::unique_ptr<CodeRegion>> Create(std::size_t Size,
+                                                            HotnessFn IsHot);
+  ~CodeRegion() override;
+
+  void allocate(const llvm::jitlink::JITLinkDylib *JD,
+                llvm::jitlink::LinkGraph &G,
+                OnAllocatedFunction OnAllocated) override;
+  using JITLinkMemoryManager::allocate;
+  void deallocate(std::vector<FinalizedAlloc> Allocs,
+                  OnDeallocatedFunction OnDeallocated) override;
+  using JITLinkMemoryManager::deallocate;
+
+  CodeRegionStats stats();
+
+private:
+  // A part of the region handing out space first fit.
+  struct Zone {
+    const char *Name;
+    char *Base;
+    std::size_t Size;
+    // Protection of the view code runs from, as PROT_ flags.
+    int Prot;
+    // Free blocks below Top, by offset.
+    std::map<std::size_t, std::size_t> Free;
+    // Everything from Top on is free.
+    std::size_t Top = 0;
+    std::size_t Used = 0;
+    std::size_t Allocations = 0;
+  };
+
+  // Where a segment of a graph went.
+  struct Piece {
+    Zone *Z;
+    std::size_t Offset;
+    std::size_t Size;
+  };
+
+  class InFlight;
+  struct FinalizedInfo;
+
+  CodeRegion(char *Base, char *Alias, std::size_t Size, HotnessFn IsHot);
+  // Returns false if the zone is full.
+  bool take(Zone &Z, std::size_t Size, std::size_t Align, std::size_t &Offset);
+  void release(const Piece &P);
+  // Copy Size bytes to Dest in Z through the writable view.
+  void write(Zone &Z, char *Dest, const char *Src, std::size_t Size);
+
+  char *Base;
+  // The writable view of the region, at the same offsets.
+  char *Alias;
+  std::size_t Size;
+  HotnessFn IsHot;
+  std::mutex Mutex;
+  Zone HotCode, ColdCode, ReadOnly, ReadWrite;
+};
+
+} // namespace jlang
+
+#endif // JLANG_CODE_REGION_H
@@ -1,26 +1,91 @@
+#include "jlang.h"
+
+#include "code_region.h"
+#include "memory.h"
+#include "profiler.h"
+
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/JITLink/EHFrameSupport.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/EPCDynamicLibrarySearchGenerator.h"
+#include "llvm/ExecutionEngine/Orc/EPCEHFrameRegistrar.h"
+#include "llvm/ExecutionEngine/Orc/EPCGenericMemoryAccess.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ObjectTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/Shared/OrcRTBridge.h"
+#include "llvm/ExecutionEngine/Orc/SimpleRemoteEPC.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/SimpleExecutorMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/SimpleRemoteEPCServer.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
-
+#include "llvm/Linker/Linker.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Remarks/Remark.h"
+#include "llvm/Remarks/RemarkSerializer.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <functional>
+#include <limits>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <new>
+#include <set>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include <fmt/format.h>
+#include <sys/wait.h>
+#include <unistd.h>
 using namespace llvm;
 enum Token {
   tok_eof = -1,
@@ -30,24 +95,74 @@ enum Token {
 
   tok_identifier = -4,
   tok_number = -5,
+
+  tok_var = -6,
+
+  tok_import = -7,
+  tok_string = -8,
+
+  tok_export = -9,
+};
+
+// A position in a source, counted from 1. Zero means unknown, as for code
+// from a Builder or a snapshot.
+struct SourceLoc {
+  unsigned Line = 0;
+  unsigned Col = 0;
 };
 
-static std::string IdentifierStr;
-static double NumVal;
+// The lexer reads from an in-memory source handed in by the engine.
+class Lexer {
+public:
+  void setInput(std::string_view Source, std::string Name) {
+    Input = Source;
+    InputPos = 0;
+    LastChar = ' ';
+    File = std::move(Name);
+    Next = {1, 1};
+  }
+  int gettok();
+
+  std::string IdentifierStr;
+  double NumVal;
+  // The name of the source, and where the last token started in it.
+  std::string File;
+  SourceLoc TokLoc;
+
+private:
+  int readChar() {
+    CharLoc = Next;
+    if (InputPos == Input.size())
+      return EOF;
+    char C = Input[InputPos++];
+    if (C == '\n')
+      Next = {Next.Line + 1, 1};
+    else
+      ++Next.Col;
+    return static_cast<unsigned char>(C);
+  }
+
+  std::string_view Input;
+  size_t InputPos = 0;
+  int LastChar = ' ';
+  // Where LastChar is, and where the next character is.
+  SourceLoc CharLoc, Next;
+};
 
-static int gettok() {
-  static int LastChar = ' ';
+int Lexer::gettok() {
+  TimeTraceScope Scope("Lex");
 
   // deal with spaces
   while (std::isspace(LastChar)) {
-    LastChar = getchar();
+    LastChar = readChar();
   }
+  TokLoc = CharLoc;
 
   // deal with alpha
   if (std::isalpha(LastChar)) {
     IdentifierStr = LastChar;
 
-    while (std::isalnum(LastChar = getchar())) {
+    while (std::isalnum(LastChar = readChar())) {
       IdentifierStr += LastChar;
     }
 
@@ -55,17 +170,35 @@ static int gettok() {
       return tok_def;
     if (IdentifierStr == "extern")
       return tok_extern;
+    if (IdentifierStr == "var")
+      return tok_var;
+    if (IdentifierStr == "import")
+      return tok_import;
+    if (IdentifierStr == "export")
+      return tok_export;
     return tok_identifier;
   }
 
+  // deal with strings, which only name files to import
+  if (LastChar == '"') {
+    IdentifierStr.clear();
+    while ((LastChar = readChar()) != '"' && LastChar != EOF &&
+           LastChar != '\n')
+      IdentifierStr += LastChar;
+    if (LastChar != '"')
+      return LastChar;
+    LastChar = readChar();
+    return tok_string;
+  }
+
   // deal with numbers
-  if (std::isdigit((LastChar) || LastChar == '.')) {
+  if (std::isdigit(LastChar) || LastChar == '.') {
     std::string NumStr;
 
     do {
       NumStr += LastChar;
-      LastChar = getchar();
-    } while (std::isdigit((LastChar) || LastChar == '.'));
+      LastChar = readChar();
+    } while (std::isdigit(LastChar) || LastChar == '.');
 
     NumVal = std::strtod(NumStr.c_str(), nullptr);
     return tok_number;
@@ -74,7 +207,7 @@ static int gettok() {
   // deal with comments
   if (LastChar == '#') {
     do {
-      LastChar = getchar();
+      LastChar = readChar();
     } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
     if (LastChar != EOF)
@@ -86,23 +219,60 @@ static int gettok() {
     return tok_eof;
 
   int ThisChar = LastChar;
-  LastChar = getchar();
+  LastChar = readChar();
 
   return ThisChar;
 }
 
 // namespace {
 
+class ChunkPool;
+class FunctionAST;
+class PrototypeAST;
+struct CodeGenContext;
+
+// Variable bindings for one evaluation of a function body. Each name maps to a
+// column of N values, so one interpreter dispatch covers a whole chunk.
+struct EvalFrame {
+  const std::map<std::string, std::unique_ptr<FunctionAST>> &FunctionDefs;
+  // Declared prototypes, which give the arity of extern functions.
+  const std::map<std::string, std::unique_ptr<PrototypeAST>> &Protos;
+  // Host variables bound with Engine::bind.
+  const std::map<std::string, const double *> &Bindings;
+  ChunkPool &Pool;
+  std::map<std::string, const double *> Vars;
+};
+
 class ExprAST {
 public:
   virtual ~ExprAST() = default;
-  virtual Value *codegen() = 0;
+  virtual Value *codegen(CodeGenContext &CG) = 0;
+  // Evaluate the expression for N (<= ChunkSize) lanes. The result is written
+  // to Scratch, or a pointer to an existing column is returned instead.
+  virtual const double *evalChunk(EvalFrame &Frame, double *Scratch,
+                                  size_t N) = 0;
+  // Append a canonical encoding of the expression to Key. Parameters are
+  // encoded by position, so expressions differing only in parameter names,
+  // whitespace or comments get the same key.
+  virtual void profile(std::string &Key,
+                       const std::vector<std::string> &Params) const = 0;
+  // Append a binary encoding of the expression to Out, for session
+  // snapshots. ReadExpr decodes it.
+  virtual void serialize(std::string &Out) const = 0;
+
+  // Where the expression starts, or its operator for a binary expression.
+  SourceLoc Loc;
 };
 
 class NumberExprAST : public ExprAST {
 public:
   NumberExprAST(double v) : Val(v) {}
-  Value *codegen() override;
+  Value *codegen(CodeGenContext &CG) override;
+  const double *evalChunk(EvalFrame &Frame, double *Scratch,
+                          size_t N) override;
+  void profile(std::string &Key,
+               const std::vector<std::string> &Params) const override;
+  void serialize(std::string &Out) const override;
 
 private:
   double Val;
@@ -111,7 +281,12 @@ private:
 class VariableExprAST : public ExprAST {
 public:
   VariableExprAST(const std::string &str) : Name(str) {}
-  Value *codegen() override;
+  Value *codegen(CodeGenContext &CG) override;
+  const double *evalChunk(EvalFrame &Frame, double *Scratch,
+                          size_t N) override;
+  void profile(std::string &Key,
+               const std::vector<std::string> &Params) const override;
+  void serialize(std::string &Out) const override;
 
 private:
   std::string Name;
@@ -122,7 +297,12 @@ public:
   BinaryExprAST(char op, std::unique_ptr<ExprAST> lhs,
                 std::unique_ptr<ExprAST> rhs)
       : Op(op), LHS(std::move(lhs)), RHS(std::move(rhs)) {}
-  Value *codegen() override;
+  Value *codegen(CodeGenContext &CG) override;
+  const double *evalChunk(EvalFrame &Frame, double *Scratch,
+                          size_t N) override;
+  void profile(std::string &Key,
+               const std::vector<std::string> &Params) const override;
+  void serialize(std::string &Out) const override;
 
 private:
   char Op;
@@ -134,11 +314,18 @@ public:
   CallExprAST(const std::string &callee,
               std::vector<std::unique_ptr<ExprAST>> args)
       : Callee(callee), Args(std::move(args)) {}
-  Value *codegen() override;
+  Value *codegen(CodeGenContext &CG) override;
+  const double *evalChunk(EvalFrame &Frame, double *Scratch,
+                          size_t N) override;
+  void profile(std::string &Key,
+               const std::vector<std::string> &Params) const override;
+  void serialize(std::string &Out) const override;
 
 private:
   std::string Callee;
   std::vector<std::unique_ptr<ExprAST>> Args;
+  // Resolved lazily when the callee is not a jlang definition.
+  void *ExternAddr = nullptr;
 };
 
 class PrototypeAST {
@@ -146,39 +333,48 @@ public:
   PrototypeAST(const std::string &name, std::vector<std::string> args)
       : Name(name), Args(std::move(args)) {}
   const std::string &getName() const { return this->Name; }
-  Function *codegen();
+  const std::vector<std::string> &getArgs() const { return this->Args; }
+  Function *codegen(CodeGenContext &CG);
 
 private:
   std::string Name;
   std::vector<std::string> Args;
 };
 
+// A double owned by the host, declared with `extern var name` and bound to an
+// address through Engine::bind.
+class ExternVarAST {
+public:
+  ExternVarAST(const std::string &name) : Name(name) {}
+  const std::string &getName() const { return this->Name; }
+  GlobalVariable *codegen(CodeGenContext &CG);
+
+private:
+  std::string Name;
+};
+
 class FunctionAST {
 public:
   FunctionAST(std::unique_ptr<PrototypeAST> proto,
               std::unique_ptr<ExprAST> body)
       : Proto(std::move(proto)), Body(std::move(body)) {}
-  Function *codegen();
+  Function *codegen(CodeGenContext &CG);
+  std::string profile() const {
+    std::string Key;
+    Body->profile(Key, Proto->getArgs());
+    return Key;
+  }
   std::unique_ptr<PrototypeAST> Proto;
   std::unique_ptr<ExprAST> Body;
+  // Defined with `export def`, for shared libraries. Engines ignore it.
+  bool Exported = false;
+  // The source it was defined in and where its name is.
+  std::string File;
+  SourceLoc Loc;
 };
 
 //}// namespace
 
-static int CurTok;
-static int getNextTok() { return CurTok = gettok(); }
-std::map<char, int> BinopPrecedence;
-
-static int GetTokPrecedence() {
-  if (!isascii(CurTok))
-    return -1;
-
-  int TokPrec = BinopPrecedence[CurTok];
-  if (TokPrec <= 0)
-    return -1;
-  return TokPrec;
-}
-
 std::unique_ptr<ExprAST> LogError(const char *Str) {
   fmt::print("Log Error: {}\n", Str);
   return nullptr;
@@ -189,15 +385,84 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
   return nullptr;
 }
 
-static std::unique_ptr<ExprAST> ParseExpression();
+class Parser {
+public:
+  Parser() {
+    BinopPrecedence['<'] = 10;
+    BinopPrecedence['+'] = 20;
+    BinopPrecedence['-'] = 20;
+    BinopPrecedence['*'] = 40; // highest.
+  }
+
+  void setInput(std::string_view Source, std::string File = "<input>") {
+    Lex.setInput(Source, std::move(File));
+  }
+  int getNextTok() {
+    CurTok = Lex.gettok();
+    CurLoc = Lex.TokLoc;
+    Stats.Tokens += CurTok != tok_eof;
+    Stats.Identifiers += CurTok == tok_identifier;
+    return CurTok;
+  }
+
+  std::unique_ptr<FunctionAST> ParseDefinition();
+  std::unique_ptr<PrototypeAST> ParsePrototype();
+  std::unique_ptr<ExternVarAST> ParseExternVar();
+  std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+  bool ParseImport(std::string &Path);
+
+  // Where the parser is in its source, saved while an import reads another.
+  struct InputState {
+    Lexer Lex;
+    int CurTok;
+    SourceLoc CurLoc;
+  };
+  InputState saveInput() const { return {Lex, CurTok, CurLoc}; }
+  void restoreInput(InputState State) {
+    Lex = State.Lex;
+    CurTok = State.CurTok;
+    CurLoc = State.CurLoc;
+  }
+
+  int CurTok;
+  SourceLoc CurLoc;
+  // The front end's counters: tokens and AST nodes.
+  jlang::EngineStats Stats;
+
+private:
+  int GetTokPrecedence();
+  std::unique_ptr<ExprAST> ParseExpression();
+  std::unique_ptr<ExprAST> ParseNumberExpr();
+  std::unique_ptr<ExprAST> ParseParenExpr();
+  std::unique_ptr<ExprAST> ParseIdentifierExpr();
+  std::unique_ptr<ExprAST> ParsePrimary();
+  std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
+                                         std::unique_ptr<ExprAST> LHS);
+
+  Lexer Lex;
+  std::map<char, int> BinopPrecedence;
+  unsigned AnonExprCount = 0;
+};
+
+int Parser::GetTokPrecedence() {
+  if (!isascii(CurTok))
+    return -1;
+
+  int TokPrec = BinopPrecedence[CurTok];
+  if (TokPrec <= 0)
+    return -1;
+  return TokPrec;
+}
 
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-  auto Result = std::make_unique<NumberExprAST>(NumVal);
+std::unique_ptr<ExprAST> Parser::ParseNumberExpr() {
+  auto Result = std::make_unique<NumberExprAST>(Lex.NumVal);
+  Result->Loc = CurLoc;
+  ++Stats.NumberNodes;
   getNextTok();
   return std::move(Result);
 }
 
-static std::unique_ptr<ExprAST> ParseParenExpr() {
+std::unique_ptr<ExprAST> Parser::ParseParenExpr() {
   getNextTok();
   auto V = ParseExpression();
   if (!V)
@@ -209,12 +474,17 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
   return V;
 }
 
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string IdName = IdentifierStr;
+std::unique_ptr<ExprAST> Parser::ParseIdentifierExpr() {
+  std::string IdName = Lex.IdentifierStr;
+  SourceLoc Loc = CurLoc;
   getNextTok();
 
-  if (CurTok != '(')
-    return std::make_unique<VariableExprAST>(IdName);
+  if (CurTok != '(') {
+    ++Stats.VariableNodes;
+    auto Var = std::make_unique<VariableExprAST>(IdName);
+    Var->Loc = Loc;
+    return Var;
+  }
 
   getNextTok();
 
@@ -234,9 +504,12 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     }
   }
   getNextTok(); // eat )
-  return std::make_unique<CallExprAST>(IdName, std::move(Args));
+  ++Stats.CallNodes;
+  auto Call = std::make_unique<CallExprAST>(IdName, std::move(Args));
+  Call->Loc = Loc;
+  return Call;
 }
-static std::unique_ptr<ExprAST> ParsePrimary() {
+std::unique_ptr<ExprAST> Parser::ParsePrimary() {
   switch (CurTok) {
   default:
     LogError("Unkown token while parsing!");
@@ -249,8 +522,8 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
   }
 }
 
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
+std::unique_ptr<ExprAST> Parser::ParseBinOpRHS(int ExprPrec,
+                                               std::unique_ptr<ExprAST> LHS) {
   while (true) {
     int TokPrec = GetTokPrecedence();
 
@@ -258,6 +531,7 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
       return LHS;
 
     int BinOp = CurTok;
+    SourceLoc OpLoc = CurLoc;
     getNextTok();
 
     auto RHS = ParsePrimary();
@@ -266,26 +540,28 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
 
     int NextPrec = GetTokPrecedence();
     if (TokPrec < NextPrec) {
-      RHS = ParseBinOpRHS(TokPrec + 1, std::move(LHS));
+      RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
       if (!RHS)
         return nullptr;
     }
     LHS =
         std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    LHS->Loc = OpLoc;
+    ++Stats.BinaryNodes;
   }
 }
 
-static std::unique_ptr<ExprAST> ParseExpression() {
+std::unique_ptr<ExprAST> Parser::ParseExpression() {
   auto LHS = ParsePrimary();
   if (!LHS)
     return nullptr;
   return ParseBinOpRHS(0, std::move(LHS));
 }
 
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
+std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
   if (CurTok != tok_identifier)
     return LogErrorP("Expected fucntion name in prototype");
-  std::string Fname = IdentifierStr;
+  std::string Fname = Lex.IdentifierStr;
   getNextTok();
 
   if (CurTok != '(')
@@ -294,101 +570,141 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
   std::vector<std::string> ArgNames;
 
   while (getNextTok() == tok_identifier) {
-    ArgNames.push_back(IdentifierStr);
+    ArgNames.push_back(Lex.IdentifierStr);
   }
   if (CurTok != ')')
     return LogErrorP("Expected ')' name in prototype");
 
   getNextTok();
 
+  ++Stats.PrototypeNodes;
   return std::make_unique<PrototypeAST>(Fname, std::move(ArgNames));
 }
 
-static std::unique_ptr<FunctionAST> ParseDefinition() {
+std::unique_ptr<FunctionAST> Parser::ParseDefinition() {
+  TimeTraceScope Scope("Parse");
+  jlang::MemoryPhaseScope Memory(jlang::MemoryPhase::Parse);
+  bool Exported = CurTok == tok_export;
+  if (Exported) {
+    getNextTok(); // eat export
+    if (CurTok != tok_def) {
+      LogError("Expected 'def' after 'export'");
+      return nullptr;
+    }
+  }
   getNextTok();
+  SourceLoc Loc = CurLoc;
   auto Proto = ParsePrototype();
   if (!Proto)
     return nullptr;
 
-  if (auto E = ParseExpression())
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-  return nullptr;
+  auto E = ParseExpression();
+  if (!E)
+    return nullptr;
+  auto FnAST = std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+  FnAST->Exported = Exported;
+  FnAST->File = Lex.File;
+  FnAST->Loc = Loc;
+  ++Stats.FunctionNodes;
+  return FnAST;
 }
 
-static std::unique_ptr<PrototypeAST> ParseExtern() {
+std::unique_ptr<ExternVarAST> Parser::ParseExternVar() {
+  getNextTok(); // eat var
+  if (CurTok != tok_identifier) {
+    LogError("Expected variable name after 'extern var'");
+    return nullptr;
+  }
+  auto Var = std::make_unique<ExternVarAST>(Lex.IdentifierStr);
   getNextTok();
-  return ParsePrototype();
+  return Var;
 }
 
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-  if (auto E = ParseExpression()) {
-    auto Proto = std::make_unique<PrototypeAST>("__anon_expr",
-                                                std::vector<std::string>());
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-  }
-  return nullptr;
-}
-static void HandleDefinition() {
-  if (auto FnAST = ParseDefinition()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fmt::print("Parsed a function definition.\n");
-      FnIR->print(errs());
-      std::printf("\n");
-    }
-  } else {
-    getNextTok();
+// import ::= 'import' string
+bool Parser::ParseImport(std::string &Path) {
+  if (getNextTok() != tok_string) {
+    LogError("Expected a file name in quotes after 'import'");
+    return false;
   }
+  Path = Lex.IdentifierStr;
+  getNextTok();
+  return true;
 }
 
-static void HandleExtern() {
-  if (auto ProtoAST = ParseExtern()) {
-    if (auto *FnIR = ProtoAST->codegen()) {
-      fmt::print("Parsed an extern\n");
-      FnIR->print(errs());
-      std::printf("\n");
-    }
-  } else {
-    getNextTok();
+std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
+  TimeTraceScope Scope("Parse");
+  jlang::MemoryPhaseScope Memory(jlang::MemoryPhase::Parse);
+  SourceLoc Loc = CurLoc;
+  if (auto E = ParseExpression()) {
+    // Each expression gets its own name, since earlier ones stay in the JIT.
+    auto Proto = std::make_unique<PrototypeAST>(
+        "__anon_expr" + std::to_string(AnonExprCount++),
+        std::vector<std::string>());
+    ++Stats.PrototypeNodes;
+    ++Stats.FunctionNodes;
+    auto FnAST = std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    FnAST->File = Lex.File;
+    FnAST->Loc = Loc;
+    return FnAST;
   }
+  return nullptr;
 }
-static void HandleTopLevelExpression() {
-  if (auto FnAST = ParseTopLevelExpr()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fmt::print("Parsed a top-level expr\n");
-      FnIR->print(errs());
-      std::printf("\n");
-    }
-  } else {
-    getNextTok();
-  }
+
+// The symbol compiled code polls for Engine::cancel.
+static const char *const CancelFlagSymbol = "__jlang_cancelled";
+
+// The counter of calls to a definition in the cold code is this followed by
+// its name.
+static const char *const CallCounterPrefix = "__jlang_calls.";
+
+// Bodies of definitions are named NAME.vN while they count their calls in the
+// cold code, and NAME.hN once they're placed with the hot code.
+static bool IsCountingBody(StringRef Body) {
+  return Body.rsplit('.').second.startswith("v");
 }
 
-static void MainLoop() {
-  while (true) {
-    fmt::print("Jlang>");
-    switch (CurTok) {
-    case tok_eof:
-      return;
-    case ';':
-      getNextTok();
-      break;
-    case tok_def:
-      HandleDefinition();
-      break;
-    case tok_extern:
-      HandleExtern();
-      break;
-    default:
-      HandleTopLevelExpression();
-      break;
-    }
-  }
+// Count calls to F, the body of Name, on entry. The count is only a hint, so
+// the increment is a relaxed load and store rather than a locked add.
+static void InsertCallCounter(llvm::Function &F, StringRef Name) {
+  Module &M = *F.getParent();
+  auto *Int64Ty = Type::getInt64Ty(M.getContext());
+  auto *Counter =
+      M.getOrInsertGlobal((CallCounterPrefix + Name).str(), Int64Ty);
+  IRBuilder<> B(&*F.getEntryBlock().getFirstInsertionPt());
+  auto *Calls = B.CreateAlignedLoad(Int64Ty, Counter, Align(8));
+  Calls->setAtomic(AtomicOrdering::Monotonic);
+  B.CreateAlignedStore(B.CreateAdd(Calls, B.getInt64(1)), Counter, Align(8))
+      ->setAtomic(AtomicOrdering::Monotonic);
 }
 
-static std::unique_ptr<LLVMContext> TheContext;
-static std::unique_ptr<IRBuilder<>> Builder;
-static std::unique_ptr<Module> TheModule;
-static std::map<std::string, Value *> NamedValues;
+// Everything codegen needs while building the current module.
+struct CodeGenContext {
+  std::unique_ptr<LLVMContext> TheContext;
+  std::unique_ptr<IRBuilder<>> Builder;
+  std::unique_ptr<Module> TheModule;
+  std::map<std::string, Value *> NamedValues;
+  std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+  std::map<std::string, std::unique_ptr<ExternVarAST>> ExternVars;
+  // When set, every function returns NaN on entry once the flag behind
+  // CancelFlagSymbol becomes true.
+  bool Cancellable = false;
+  // When set, functions get line tables, so that optimization remarks can
+  // point into the jlang source.
+  bool DebugInfo = false;
+  std::unique_ptr<DIBuilder> DI;
+  // The function being generated, while DebugInfo is set.
+  DISubprogram *Scope = nullptr;
+
+  Function *getFunction(const std::string &Name);
+  // Attribute the instructions built from here on to Loc.
+  void setLocation(SourceLoc Loc) {
+    if (Scope)
+      Builder->SetCurrentDebugLocation(
+          DILocation::get(*TheContext, Loc.Line, Loc.Col, Scope));
+  }
+  void beginFunction(Function &F, const FunctionAST &FnAST);
+  void endFunction();
+};
 
 Value *LogErrorV(const char *Str) {
   LogError(Str);
@@ -397,42 +713,62 @@ Value *LogErrorV(const char *Str) {
 
 // In the LLVM IR, numeric constants are represented with the ConstantFP class,
 // which holds the numeric value in an APFloat internally
-Value *NumberExprAST::codegen() {
-  return ConstantFP::get(*TheContext, APFloat(Val));
+Value *NumberExprAST::codegen(CodeGenContext &CG) {
+  return ConstantFP::get(*CG.TheContext, APFloat(Val));
 }
 
-Value *VariableExprAST::codegen() {
-  Value *V = NamedValues[Name];
-  if (!V)
-    LogErrorV("Unkown variable name!");
-  return V;
+Value *VariableExprAST::codegen(CodeGenContext &CG) {
+  Value *V = CG.NamedValues[Name];
+  if (V)
+    return V;
+
+  // Host variables are read afresh on every use, so formulas see live state.
+  auto VI = CG.ExternVars.find(Name);
+  if (VI == CG.ExternVars.end())
+    return LogErrorV("Unkown variable name!");
+  return CG.Builder->CreateLoad(Type::getDoubleTy(*CG.TheContext),
+                                VI->second->codegen(CG), Name);
 }
 
-Value *BinaryExprAST::codegen() {
-  Value *L = LHS->codegen();
-  Value *R = RHS->codegen();
+Value *BinaryExprAST::codegen(CodeGenContext &CG) {
+  Value *L = LHS->codegen(CG);
+  Value *R = RHS->codegen(CG);
 
   if (!L || !R) {
     return nullptr;
   }
 
+  CG.setLocation(Loc);
   switch (Op) {
   case '+':
-    return Builder->CreateFAdd(L, R, "addtmp");
+    return CG.Builder->CreateFAdd(L, R, "addtmp");
   case '-':
-    return Builder->CreateFSub(L, R, "subtmp");
+    return CG.Builder->CreateFSub(L, R, "subtmp");
   case '*':
-    return Builder->CreateFMul(L, R, "multmp");
+    return CG.Builder->CreateFMul(L, R, "multmp");
   case '<':
-    L = Builder->CreateFCmpULT(L, R, "cmptmp");
-    return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
+    L = CG.Builder->CreateFCmpULT(L, R, "cmptmp");
+    return CG.Builder->CreateUIToFP(L, Type::getDoubleTy(*CG.TheContext),
+                                    "booltmp");
   default:
     return LogErrorV("invalid binary operator!");
   }
 }
 
-Value *CallExprAST::codegen() {
-  Function *CalleeF = TheModule->getFunction(Callee);
+// Functions may live in modules already handed to the JIT, so fall back to
+// re-declaring them in the current module from their prototype.
+Function *CodeGenContext::getFunction(const std::string &Name) {
+  if (auto *F = TheModule->getFunction(Name))
+    return F;
+
+  auto FI = FunctionProtos.find(Name);
+  if (FI != FunctionProtos.end())
+    return FI->second->codegen(*this);
+  return nullptr;
+}
+
+Value *CallExprAST::codegen(CodeGenContext &CG) {
+  Function *CalleeF = CG.getFunction(Callee);
   if (!CalleeF) {
     return LogErrorV("Unkown function referenced!");
   }
@@ -443,19 +779,20 @@ Value *CallExprAST::codegen() {
 
   std::vector<Value *> ArgsV;
   for (auto &i : Args) {
-    ArgsV.push_back(i->codegen());
+    ArgsV.push_back(i->codegen(CG));
     if (!ArgsV.back())
       return nullptr;
   }
-  return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  CG.setLocation(Loc);
+  return CG.Builder->CreateCall(CalleeF, ArgsV, "calltmp");
 }
 
-Function *PrototypeAST::codegen() {
-  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
+Function *PrototypeAST::codegen(CodeGenContext &CG) {
+  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*CG.TheContext));
   FunctionType *FT =
-      FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+      FunctionType::get(Type::getDoubleTy(*CG.TheContext), Doubles, false);
   Function *F =
-      Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+      Function::Create(FT, Function::ExternalLinkage, Name, CG.TheModule.get());
 
   auto Idx = 0;
   for (auto &Arg : F->args()) {
@@ -465,52 +802,2917 @@ Function *PrototypeAST::codegen() {
   return F;
 }
 
-Function *FunctionAST::codegen() {
-  Function *TheFunction = TheModule->getFunction(Proto->getName());
+// Give F a subprogram in a line-tables-only compile unit, made with the
+// module's first function.
+void CodeGenContext::beginFunction(Function &F, const FunctionAST &FnAST) {
+  if (!DI) {
+    DI = std::make_unique<DIBuilder>(*TheModule);
+    DI->createCompileUnit(dwarf::DW_LANG_C, DI->createFile(FnAST.File, "."),
+                          "jlang", /*isOptimized=*/true, "", 0, "",
+                          DICompileUnit::LineTablesOnly);
+    TheModule->addModuleFlag(Module::Warning, "Debug Info Version",
+                             DEBUG_METADATA_VERSION);
+  }
+  DIFile *File = DI->createFile(FnAST.File, ".");
+  unsigned Line = FnAST.Loc.Line;
+  Scope = DI->createFunction(
+      File, FnAST.Proto->getName(), StringRef(), File, Line,
+      DI->createSubroutineType(DI->getOrCreateTypeArray({})), Line,
+      DINode::FlagZero,
+      DISubprogram::SPFlagDefinition | DISubprogram::SPFlagOptimized);
+  F.setSubprogram(Scope);
+  setLocation(FnAST.Loc);
+}
 
-  if (!TheFunction)
-    TheFunction = Proto->codegen();
+void CodeGenContext::endFunction() {
+  if (!Scope)
+    return;
+  DI->finalizeSubprogram(Scope);
+  Scope = nullptr;
+  Builder->SetCurrentDebugLocation(DebugLoc());
+}
+
+// The global is only declared; JIT symbol resolution wires it to the address
+// given to Engine::bind.
+GlobalVariable *ExternVarAST::codegen(CodeGenContext &CG) {
+  if (auto *GV = CG.TheModule->getNamedGlobal(Name))
+    return GV;
+  return new GlobalVariable(*CG.TheModule, Type::getDoubleTy(*CG.TheContext),
+                            /*isConstant=*/false, GlobalValue::ExternalLinkage,
+                            nullptr, Name);
+}
+
+Function *FunctionAST::codegen(CodeGenContext &CG) {
+  TimeTraceScope Scope("Codegen", Proto->getName());
+  jlang::MemoryPhaseScope Memory(jlang::MemoryPhase::Codegen);
+  CG.FunctionProtos[Proto->getName()] =
+      std::make_unique<PrototypeAST>(*Proto);
+  bool Declared = CG.TheModule->getFunction(Proto->getName());
+  Function *TheFunction = CG.getFunction(Proto->getName());
 
   if (!TheFunction)
     return nullptr;
 
-  BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
-  Builder->SetInsertPoint(BB);
+  BasicBlock *BB = BasicBlock::Create(*CG.TheContext, "entry", TheFunction);
+  CG.Builder->SetInsertPoint(BB);
+  if (CG.DebugInfo)
+    CG.beginFunction(*TheFunction, *this);
+
+  // Only recursion can run for long, so polling for cancellation on entry is
+  // enough to stop any evaluation. The flag is reached through a symbol
+  // rather than its address, so that the code can be saved in a snapshot.
+  if (CG.Cancellable) {
+    static_assert(sizeof(std::atomic<bool>) == 1, "polled as an i8");
+    auto *Int8Ty = Type::getInt8Ty(*CG.TheContext);
+    auto *FlagPtr = CG.TheModule->getOrInsertGlobal(CancelFlagSymbol, Int8Ty);
+    auto *Flag = CG.Builder->CreateLoad(Int8Ty, FlagPtr, /*isVolatile=*/true,
+                                        "cancelled");
+    auto *CancelBB =
+        BasicBlock::Create(*CG.TheContext, "cancel", TheFunction);
+    auto *BodyBB = BasicBlock::Create(*CG.TheContext, "body", TheFunction);
+    CG.Builder->CreateCondBr(
+        CG.Builder->CreateICmpNE(Flag, CG.Builder->getInt8(0)), CancelBB,
+        BodyBB);
+    CG.Builder->SetInsertPoint(CancelBB);
+    CG.Builder->CreateRet(
+        ConstantFP::getNaN(Type::getDoubleTy(*CG.TheContext)));
+    CG.Builder->SetInsertPoint(BodyBB);
+  }
 
-  NamedValues.clear();
+  CG.NamedValues.clear();
 
   for (auto &Arg : TheFunction->args())
-    NamedValues[std::string(Arg.getName())] = &Arg;
-
-  if (Value *RetVal = Body->codegen()) {
-    Builder->CreateRet(RetVal);
+    CG.NamedValues[std::string(Arg.getName())] = &Arg;
+
+  Value *RetVal = Body->codegen(CG);
+  if (RetVal)
+    CG.Builder->CreateRet(RetVal);
+  CG.endFunction();
+  if (RetVal) {
+    TimeTraceScope Scope("Verify", Proto->getName());
     verifyFunction(*TheFunction);
 
     return TheFunction;
   }
 
-  TheFunction->eraseFromParent();
+  // A declaration that was already in the module may have callers.
+  if (Declared)
+    TheFunction->deleteBody();
+  else
+    TheFunction->eraseFromParent();
+  return nullptr;
+}
+
+// Optimize a module on its way into the JIT.
+static void OptimizeModule(Module &M, TargetMachine *TM) {
+  TimeTraceScope Scope("Optimize", M.getModuleIdentifier());
+  jlang::MemoryPhaseScope Memory(jlang::MemoryPhase::Optimize);
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+
+  PassBuilder PB(TM);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2).run(M, MAM);
+}
+
+// The interpreter runs the AST directly, for hosts that can't map executable
+// memory. Every node works on a chunk of ChunkSize lanes at a time so that the
+// virtual dispatch is paid once per chunk, and the per-lane loops are simple
+// enough for the compiler to vectorize.
+static constexpr size_t ChunkSize = 1024;
+
+class ChunkPool {
+public:
+  double *acquire() {
+    if (Free.empty())
+      return Owned.emplace_back(new double[ChunkSize]).get();
+    double *C = Free.back();
+    Free.pop_back();
+    return C;
+  }
+  void release(double *C) { Free.push_back(C); }
+
+private:
+  std::vector<std::unique_ptr<double[]>> Owned;
+  std::vector<double *> Free;
+};
+
+// Returns a scratch chunk to its pool when it goes out of scope.
+class ChunkRef {
+public:
+  explicit ChunkRef(ChunkPool &P) : Pool(P), Data(P.acquire()) {}
+  ChunkRef(const ChunkRef &) = delete;
+  ChunkRef &operator=(const ChunkRef &) = delete;
+  ~ChunkRef() { Pool.release(Data); }
+  double *get() const { return Data; }
+
+private:
+  ChunkPool &Pool;
+  double *Data;
+};
+
+const double *LogErrorC(const char *Str) {
+  LogError(Str);
   return nullptr;
 }
 
-static void InitializeModule() {
-  TheContext = std::make_unique<LLVMContext>();
-  TheModule = std::make_unique<Module>("Jun's JIT", *TheContext);
+const double *NumberExprAST::evalChunk(EvalFrame &Frame, double *Scratch,
+                                       size_t N) {
+  std::fill_n(Scratch, N, Val);
+  return Scratch;
+}
 
-  Builder = std::make_unique<IRBuilder<>>(*TheContext);
+const double *VariableExprAST::evalChunk(EvalFrame &Frame, double *Scratch,
+                                         size_t N) {
+  auto It = Frame.Vars.find(Name);
+  if (It != Frame.Vars.end())
+    return It->second;
+
+  auto BI = Frame.Bindings.find(Name);
+  if (BI == Frame.Bindings.end())
+    return LogErrorC("Unkown variable name!");
+  std::fill_n(Scratch, N, *BI->second);
+  return Scratch;
 }
-int main() {
 
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40; // highest.
+const double *BinaryExprAST::evalChunk(EvalFrame &Frame, double *Scratch,
+                                       size_t N) {
+  const double *L = LHS->evalChunk(Frame, Scratch, N);
+  if (!L)
+    return nullptr;
 
-  fmt::print("Jlang>");
-  getNextTok();
-  InitializeModule();
+  // The left result may live in Scratch, so the right side needs its own.
+  ChunkRef Tmp(Frame.Pool);
+  const double *R = RHS->evalChunk(Frame, Tmp.get(), N);
+  if (!R)
+    return nullptr;
 
-  MainLoop();
-  TheModule->print(errs(), nullptr);
-  return 0;
+  switch (Op) {
+  case '+':
+    for (size_t I = 0; I < N; ++I)
+      Scratch[I] = L[I] + R[I];
+    break;
+  case '-':
+    for (size_t I = 0; I < N; ++I)
+      Scratch[I] = L[I] - R[I];
+    break;
+  case '*':
+    for (size_t I = 0; I < N; ++I)
+      Scratch[I] = L[I] * R[I];
+    break;
+  case '<':
+    // Unordered less-than, matching the fcmp ult emitted by codegen.
+    for (size_t I = 0; I < N; ++I)
+      Scratch[I] = !(L[I] >= R[I]) ? 1.0 : 0.0;
+    break;
+  default:
+    return LogErrorC("invalid binary operator!");
+  }
+  return Scratch;
+}
+
+const double *CallExprAST::evalChunk(EvalFrame &Frame, double *Scratch,
+                                     size_t N) {
+  auto &FunctionDefs = Frame.FunctionDefs;
+  auto Def = FunctionDefs.find(Callee);
+  if (Def != FunctionDefs.end()) {
+    if (Def->second->Proto->getArgs().size() != Args.size())
+      return LogErrorC("Incorrect argument number!");
+  } else {
+    // The extern's prototype, not this call, says what the native function
+    // takes.
+    auto Proto = Frame.Protos.find(Callee);
+    if (Proto == Frame.Protos.end())
+      return LogErrorC("Unkown function referenced!");
+    if (Proto->second->getArgs().size() != Args.size())
+      return LogErrorC("Incorrect argument number!");
+    if (!ExternAddr)
+      ExternAddr = dlsym(RTLD_DEFAULT, Callee.c_str());
+    if (!ExternAddr)
+      return LogErrorC("Unkown function referenced!");
+  }
+
+  std::vector<std::unique_ptr<ChunkRef>> ArgChunks;
+  std::vector<const double *> ArgsV;
+  for (auto &Arg : Args) {
+    ArgChunks.push_back(std::make_unique<ChunkRef>(Frame.Pool));
+    ArgsV.push_back(Arg->evalChunk(Frame, ArgChunks.back()->get(), N));
+    if (!ArgsV.back())
+      return nullptr;
+  }
+
+  if (Def != FunctionDefs.end()) {
+    EvalFrame CalleeFrame{FunctionDefs, Frame.Protos, Frame.Bindings,
+                          Frame.Pool, {}};
+    auto &Params = Def->second->Proto->getArgs();
+    for (size_t I = 0; I < Params.size(); ++I)
+      CalleeFrame.Vars[Params[I]] = ArgsV[I];
+
+    const double *Result =
+        Def->second->Body->evalChunk(CalleeFrame, Scratch, N);
+    // The body may hand back one of our argument chunks, which are about to
+    // be released.
+    if (Result && Result != Scratch)
+      std::copy_n(Result, N, Scratch);
+    return Result ? Scratch : nullptr;
+  }
+
+  // Externs are native functions taking and returning doubles, called lane by
+  // lane.
+  const double *const *A = ArgsV.data();
+  switch (Args.size()) {
+  case 0: {
+    auto *F = reinterpret_cast<double (*)()>(ExternAddr);
+    for (size_t I = 0; I < N; ++I)
+      Scratch[I] = F();
+    break;
+  }
+  case 1: {
+    auto *F = reinterpret_cast<double (*)(double)>(ExternAddr);
+    for (size_t I = 0; I < N; ++I)
+      Scratch[I] = F(A[0][I]);
+    break;
+  }
+  case 2: {
+    auto *F = reinterpret_cast<double (*)(double, double)>(ExternAddr);
+    for (size_t I = 0; I < N; ++I)
+      Scratch[I] = F(A[0][I], A[1][I]);
+    break;
+  }
+  case 3: {
+    auto *F = reinterpret_cast<double (*)(double, double, double)>(ExternAddr);
+    for (size_t I = 0; I < N; ++I)
+      Scratch[I] = F(A[0][I], A[1][I], A[2][I]);
+    break;
+  }
+  default:
+    return LogErrorC("Too many arguments for an extern call!");
+  }
+  return Scratch;
+}
+
+void NumberExprAST::profile(std::string &Key,
+                            const std::vector<std::string> &Params) const {
+  Key += 'n';
+  Key.append(reinterpret_cast<const char *>(&Val), sizeof(Val));
+}
+
+void VariableExprAST::profile(std::string &Key,
+                              const std::vector<std::string> &Params) const {
+  auto It = std::find(Params.begin(), Params.end(), Name);
+  if (It != Params.end()) {
+    Key += fmt::format("a{};", It - Params.begin());
+    return;
+  }
+  Key += 'v';
+  Key += Name;
+  Key += ';';
+}
+
+void BinaryExprAST::profile(std::string &Key,
+                            const std::vector<std::string> &Params) const {
+  Key += 'b';
+  Key += Op;
+  LHS->profile(Key, Params);
+  RHS->profile(Key, Params);
+}
+
+void CallExprAST::profile(std::string &Key,
+                          const std::vector<std::string> &Params) const {
+  Key += fmt::format("c{};{};", Callee, Args.size());
+  for (auto &Arg : Args)
+    Arg->profile(Key, Params);
+}
+
+// Session snapshots are little more than these fields appended one after
+// another, so they can be read in place from a mapped file.
+template <typename T> static void WriteRaw(std::string &Out, T Val) {
+  Out.append(reinterpret_cast<const char *>(&Val), sizeof(T));
+}
+
+static void WriteString(std::string &Out, StringRef Str) {
+  WriteRaw<uint32_t>(Out, Str.size());
+  Out.append(Str.begin(), Str.end());
+}
+
+// Reads the fields written above, failing on truncated input.
+class SnapshotReader {
+public:
+  explicit SnapshotReader(StringRef Data) : Data(Data) {}
+  bool failed() const { return Failed; }
+  size_t remaining() const { return Pos < Data.size() ? Data.size() - Pos : 0; }
+
+  template <typename T> T read() {
+    T Val{};
+    StringRef Bytes = readBytes(sizeof(T));
+    if (!Failed)
+      std::memcpy(&Val, Bytes.data(), sizeof(T));
+    return Val;
+  }
+
+  StringRef readString() { return readBytes(read<uint32_t>()); }
+
+  // Read N bytes starting at the next multiple of Align.
+  StringRef readBytes(size_t N, size_t Align = 1) {
+    size_t Start = alignTo(Pos, Align);
+    if (Failed || Start > Data.size() || Data.size() - Start < N) {
+      Failed = true;
+      return {};
+    }
+    Pos = Start + N;
+    return Data.substr(Start, N);
+  }
+
+private:
+  StringRef Data;
+  size_t Pos = 0;
+  bool Failed = false;
+};
+
+void NumberExprAST::serialize(std::string &Out) const {
+  Out += 'n';
+  WriteRaw(Out, Val);
+}
+
+void VariableExprAST::serialize(std::string &Out) const {
+  Out += 'v';
+  WriteString(Out, Name);
+}
+
+void BinaryExprAST::serialize(std::string &Out) const {
+  Out += 'b';
+  Out += Op;
+  LHS->serialize(Out);
+  RHS->serialize(Out);
+}
+
+void CallExprAST::serialize(std::string &Out) const {
+  Out += 'c';
+  WriteString(Out, Callee);
+  WriteRaw<uint32_t>(Out, Args.size());
+  for (auto &Arg : Args)
+    Arg->serialize(Out);
+}
+
+static std::unique_ptr<ExprAST> ReadExpr(SnapshotReader &R) {
+  switch (R.read<char>()) {
+  case 'n':
+    return std::make_unique<NumberExprAST>(R.read<double>());
+  case 'v':
+    return std::make_unique<VariableExprAST>(R.readString().str());
+  case 'b': {
+    char Op = R.read<char>();
+    auto LHS = ReadExpr(R);
+    auto RHS = LHS ? ReadExpr(R) : nullptr;
+    if (!RHS)
+      return nullptr;
+    return std::make_unique<BinaryExprAST>(Op, std::move(LHS),
+                                           std::move(RHS));
+  }
+  case 'c': {
+    std::string Callee = R.readString().str();
+    uint32_t NumArgs = R.read<uint32_t>();
+    if (R.failed() || NumArgs > R.remaining())
+      return nullptr;
+    std::vector<std::unique_ptr<ExprAST>> Args(NumArgs);
+    for (auto &Arg : Args)
+      if (!(Arg = ReadExpr(R)))
+        return nullptr;
+    return std::make_unique<CallExprAST>(Callee, std::move(Args));
+  }
+  }
+  return nullptr;
+}
+
+// Evaluate Fn over N rows. Columns holds one array of N values per parameter.
+static bool
+EvalBatch(const std::map<std::string, std::unique_ptr<FunctionAST>> &Defs,
+          const std::map<std::string, std::unique_ptr<PrototypeAST>> &Protos,
+          const std::map<std::string, const double *> &Bindings,
+          FunctionAST &Fn, const std::vector<const double *> &Columns,
+          double *Out, size_t N) {
+  auto &Params = Fn.Proto->getArgs();
+  if (Params.size() != Columns.size()) {
+    LogError("Incorrect argument number!");
+    return false;
+  }
+
+  ChunkPool Pool;
+  ChunkRef Scratch(Pool);
+  for (size_t Begin = 0; Begin < N; Begin += ChunkSize) {
+    size_t Len = std::min(ChunkSize, N - Begin);
+    EvalFrame Frame{Defs, Protos, Bindings, Pool, {}};
+    for (size_t I = 0; I < Params.size(); ++I)
+      Frame.Vars[Params[I]] = Columns[I] + Begin;
+
+    const double *Result = Fn.Body->evalChunk(Frame, Scratch.get(), Len);
+    if (!Result)
+      return false;
+    std::copy_n(Result, Len, Out + Begin);
+  }
+  return true;
+}
+
+// Emit `CWrapperFunctionResult F.wrapper(const char *, size_t)` calling the
+// nullary F. The double result fits in the result's inline data, so the pair
+// {bits, size} is all it returns. Returns the wrapper's name.
+static std::string EmitResultWrapper(CodeGenContext &CG, Function *F) {
+  auto &Ctx = *CG.TheContext;
+  Type *I64 = Type::getInt64Ty(Ctx);
+  auto *ResultTy = StructType::get(I64, I64);
+  auto *FT = FunctionType::get(
+      ResultTy, {Type::getInt8PtrTy(Ctx), I64}, false);
+  auto *W = Function::Create(FT, Function::ExternalLinkage,
+                             F->getName() + ".wrapper", CG.TheModule.get());
+
+  IRBuilder<> B(BasicBlock::Create(Ctx, "entry", W));
+  Value *Bits = B.CreateBitCast(B.CreateCall(F), I64);
+  Value *Result = B.CreateInsertValue(UndefValue::get(ResultTy), Bits, 0);
+  Value *Size = ConstantInt::get(I64, sizeof(double));
+  Result = B.CreateInsertValue(Result, Size, 1);
+  B.CreateRet(Result);
+  return std::string(W->getName());
+}
+
+// Free the code and data of a module added under RT.
+static void RemoveTracker(orc::ResourceTracker &RT) {
+  if (auto Err = RT.remove())
+    LogError(toString(std::move(Err)).c_str());
+}
+
+// The module of a compiled top-level expression. Its code is freed when the
+// last reference goes away, unless it was handed out by Engine::compile.
+class ExprCode {
+public:
+  explicit ExprCode(orc::ResourceTrackerSP RT) : RT(std::move(RT)) {}
+  ~ExprCode() {
+    if (!Pinned)
+      RemoveTracker(*RT);
+  }
+
+  bool Pinned = false;
+
+private:
+  orc::ResourceTrackerSP RT;
+};
+
+// An LRU cache of compiled top-level expressions keyed by their AST profile,
+// so that resubmitting an expression skips codegen and the JIT.
+class ExprCache {
+public:
+  struct Entry {
+    std::string Key;
+    std::string Name;
+    void *Addr;
+    std::shared_ptr<ExprCode> Code;
+    // The functions it calls. A hit skips codegen and with it the checks of
+    // each call, so entries go when one of these is redefined.
+    std::vector<std::string> Callees;
+  };
+
+  explicit ExprCache(size_t Capacity) : Capacity(Capacity) {}
+  size_t capacity() const { return Capacity; }
+  size_t size() const { return LRU.size(); }
+
+  Entry *lookup(const std::string &Key) {
+    auto It = Index.find(Key);
+    if (It == Index.end())
+      return nullptr;
+    LRU.splice(LRU.begin(), LRU, It->second);
+    return &*It->second;
+  }
+
+  void insert(std::string Key, std::string Name, void *Addr,
+              std::shared_ptr<ExprCode> Code,
+              std::vector<std::string> Callees) {
+    if (LRU.size() == Capacity) {
+      Index.erase(LRU.back().Key);
+      LRU.pop_back();
+      ++Stats.Evictions;
+    }
+    LRU.push_front({std::move(Key), std::move(Name), Addr, std::move(Code),
+                    std::move(Callees)});
+    Index[LRU.front().Key] = LRU.begin();
+  }
+
+  // Drop every entry that calls Callee. Evaluations still running keep their
+  // code alive through ExprCode.
+  void evictCallers(const std::string &Callee) {
+    for (auto It = LRU.begin(); It != LRU.end();) {
+      if (std::find(It->Callees.begin(), It->Callees.end(), Callee) ==
+          It->Callees.end()) {
+        ++It;
+        continue;
+      }
+      Index.erase(It->Key);
+      It = LRU.erase(It);
+      ++Stats.Evictions;
+    }
+  }
+
+  jlang::ExprCacheStats Stats;
+
+private:
+  size_t Capacity;
+  std::list<Entry> LRU;
+  std::unordered_map<std::string, std::list<Entry>::iterator> Index;
+};
+
+// The standard prelude in prelude.ll, which the build assembles into bitcode
+// and embeds as these. The references are strong so that linking libjlang
+// pulls prelude.o out of the archive; EngineOptions::Prelude turns it off.
+extern "C" {
+extern unsigned char prelude_bc[];
+extern unsigned int prelude_bc_len;
+}
+
+static MemoryBufferRef PreludeBitcode() {
+  return MemoryBufferRef(
+      StringRef(reinterpret_cast<const char *>(prelude_bc), prelude_bc_len),
+      "prelude");
 }
+
+// Parameter names for prototypes known only by their arity.
+static std::vector<std::string> PlaceholderArgs(size_t Arity) {
+  std::vector<std::string> Args;
+  for (size_t I = 0; I < Arity; ++I)
+    Args.push_back("x" + std::to_string(I));
+  return Args;
+}
+
+// Declare every prelude function in CG, reading only the bitcode's symbol
+// table, and add the names of those it defines to Defined.
+static bool DeclarePreludeProtos(CodeGenContext &CG,
+                                 std::set<std::string> &Defined) {
+  LLVMContext Ctx;
+  auto Prelude = getLazyBitcodeModule(PreludeBitcode(), Ctx);
+  if (!Prelude) {
+    LogError(toString(Prelude.takeError()).c_str());
+    return false;
+  }
+  for (auto &F : **Prelude) {
+    if (F.isIntrinsic())
+      continue;
+    std::string Name(F.getName());
+    // Argument names aren't known until the body is read.
+    CG.FunctionProtos[Name] =
+        std::make_unique<PrototypeAST>(Name, PlaceholderArgs(F.arg_size()));
+    if (!F.isDeclaration())
+      Defined.insert(Name);
+  }
+  return true;
+}
+
+// Link the prelude functions that M calls into it with the given linkage.
+// The JIT uses available_externally copies, which the optimizer can inline
+// and then drops. Function bodies are only read from the bitcode when they
+// are linked.
+static Error
+LinkPrelude(Module &M, const std::set<std::string> &Names,
+            GlobalValue::LinkageTypes Linkage =
+                GlobalValue::AvailableExternallyLinkage) {
+  std::set<std::string> Defined;
+  bool Calls = false;
+  for (auto &F : M) {
+    if (!F.isDeclaration())
+      Defined.insert(std::string(F.getName()));
+    else if (Names.count(std::string(F.getName())))
+      Calls = true;
+  }
+  if (!Calls)
+    return Error::success();
+
+  auto Prelude = getLazyBitcodeModule(PreludeBitcode(), M.getContext());
+  if (!Prelude)
+    return Prelude.takeError();
+  (*Prelude)->setDataLayout(M.getDataLayout());
+  (*Prelude)->setTargetTriple(M.getTargetTriple());
+  if (Linker::linkModules(M, std::move(*Prelude), Linker::LinkOnlyNeeded))
+    return make_error<StringError>("Couldn't link the prelude",
+                                   inconvertibleErrorCode());
+  for (auto &F : M)
+    if (!F.isDeclaration() && !Defined.count(std::string(F.getName())))
+      F.setLinkage(Linkage);
+  return Error::success();
+}
+
+// Compiles each prelude function the first time the JIT looks it up. Lookups
+// can come from any thread that calls a restored body.
+class PreludeGenerator : public orc::DefinitionGenerator {
+public:
+  PreludeGenerator(orc::LLJIT &J, std::set<std::string> Names)
+      : J(J), Names(std::move(Names)) {}
+
+  Error tryToGenerate(orc::LookupState &LS, orc::LookupKind K,
+                      orc::JITDylib &JD,
+                      orc::JITDylibLookupFlags JDLookupFlags,
+                      const orc::SymbolLookupSet &LookupSet) override {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto &[Sym, Flags] : LookupSet) {
+      std::string Name((*Sym).str());
+      if (!Names.count(Name) || !Generated.insert(Name).second)
+        continue;
+      if (auto Err = generate(JD, Name))
+        return Err;
+    }
+    return Error::success();
+  }
+
+private:
+  // A module that defines Name, with the prelude functions it calls linked in
+  // for inlining.
+  Error generate(orc::JITDylib &JD, const std::string &Name) {
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = std::make_unique<Module>("prelude:" + Name, *Ctx);
+    M->setDataLayout(J.getDataLayout());
+    // Every prelude function takes and returns doubles.
+    auto Prelude = getLazyBitcodeModule(PreludeBitcode(), *Ctx);
+    if (!Prelude)
+      return Prelude.takeError();
+    auto *Ty = (*Prelude)->getFunction(Name)->getFunctionType();
+    M->getOrInsertFunction(Name, Ty);
+    if (auto Err = LinkPrelude(*M, Names))
+      return Err;
+    M->getFunction(Name)->setLinkage(GlobalValue::ExternalLinkage);
+    return J.addIRModule(JD, orc::ThreadSafeModule(std::move(M),
+                                                   std::move(Ctx)));
+  }
+
+  orc::LLJIT &J;
+  const std::set<std::string> Names;
+  std::mutex Mutex;
+  std::set<std::string> Generated;
+};
+
+namespace jlang {
+
+// All state of one engine. Nothing is shared between engines, so each can be
+// used from its own thread.
+class Engine::Impl {
+public:
+  explicit Impl(EngineOptions Opts);
+
+  Expected<std::unique_ptr<orc::LLJIT>>
+  CreateLocalJIT(const EngineOptions &Opts);
+  Expected<std::unique_ptr<orc::LLJIT>>
+  CreateRemoteJIT(const std::string &Program);
+  void InitializeModule();
+  bool AddModuleToJIT(orc::ResourceTrackerSP RT = nullptr);
+  void *LookupFunction(const std::string &Name);
+
+  bool CompileDefinition(FunctionAST &FnAST, bool Echo);
+  void DefineCallCounter(const std::string &Name);
+  std::size_t PlaceHotCode();
+  void OptimizeWithRemarks(Module &M);
+  Error CreateStub(const std::string &Name, void *Addr);
+  Error UpdateStub(const std::string &Name, void *Addr);
+  bool AddDefinition(std::unique_ptr<FunctionAST> FnAST);
+  void RecompileDependents(const std::string &Name);
+  void HandleDefinition();
+  void HandleExtern();
+  void HandleExternVar();
+  void HandleImport();
+  void HandleTopLevelExpression();
+  void EvaluateExpr(void *Addr, std::shared_ptr<ExprCode> Code);
+  bool CallExecutor(void *Addr, double &Val);
+  bool ExecutorAlive();
+  bool CanCallCode();
+  void MainLoop();
+  bool Save(const std::string &Path);
+  bool Restore(const std::string &Path);
+  void DeclarePrelude();
+
+  // An executor process running compiled code. It exits once the JIT, which
+  // is destroyed first, disconnects.
+  struct ExecutorProcess {
+    pid_t Pid = -1;
+    ~ExecutorProcess() {
+      if (Pid > 0)
+        waitpid(Pid, nullptr, 0);
+    }
+  };
+
+  Parser P;
+  CodeGenContext CG;
+  ExecutorProcess Executor;
+  // A restored snapshot, which the JIT links code out of.
+  std::unique_ptr<MemoryBuffer> Snapshot;
+  std::unique_ptr<orc::LLJIT> TheJIT;
+  std::unique_ptr<TargetMachine> TM;
+  // Where the JIT places code in this process; owned by its linking layer.
+  CodeRegion *Region = nullptr;
+
+  // Callers reach each definition through a stub, so a redefinition only has
+  // to repoint the stub and free the tracker of the old body.
+  std::unique_ptr<orc::IndirectStubsManager> Stubs;
+  // In an executor process the stubs are jumps through these pointers.
+  std::map<std::string, JITTargetAddress> RemoteStubs;
+  std::map<std::string, orc::ResourceTrackerSP> Bodies;
+  // The stubs of restored definitions start out at trampolines that link the
+  // body on the first call. LazyBodies maps each such stub to the body it is
+  // waiting for; calls can resolve it from any thread.
+  std::unique_ptr<orc::LazyCallThroughManager> LazyCalls;
+  std::mutex LazyMutex;
+  std::map<std::string, std::string> LazyBodies;
+  // The object code of each definition's current body, for Save. Objects are
+  // linked on whichever thread looks one up.
+  struct ObjectCode {
+    std::string Body;
+    std::unique_ptr<MemoryBuffer> Buffer;
+  };
+  std::mutex ObjectsMutex;
+  std::map<std::string, ObjectCode> Objects;
+  // The optimized IR of each definition's current body, for optimizedIR.
+  // Bodies may be optimized on any thread that looks one up.
+  std::mutex IRMutex;
+  std::map<std::string, std::string> OptimizedIR;
+  // The optimizer's remarks on the latest compile of each function, kept
+  // while CollectRemarks is set; EngineOptions::Remarks.
+  bool CollectRemarks;
+  std::mutex RemarksMutex;
+  std::map<std::string, std::vector<Remark>> Remarks;
+  std::map<std::string, unsigned> Versions;
+  // Callees whose bodies were offered to the inliner when compiling each
+  // definition, and the reverse: the definitions that have to be recompiled
+  // when a callee changes.
+  std::map<std::string, std::vector<std::string>> InlinedCallees;
+  std::map<std::string, std::set<std::string>> InlinedInto;
+
+  // Definitions count their calls until PlaceHotCode finds HotCallCount of
+  // them and moves the function to the hot code, where it stays. Compiled
+  // code updates the counts from any thread; the map only changes here.
+  bool CountCalls = false;
+  std::uint64_t HotCallCount;
+  std::map<std::string, std::atomic<std::uint64_t>> CallCounts;
+  std::set<std::string> HotFunctions;
+
+  // Files read by import items, by real path, and the directory of the one
+  // being read, which its own imports are relative to.
+  std::set<std::string> Imported;
+  std::string ImportDir;
+
+  // The functions the prelude defines. Their names can't be redefined.
+  std::set<std::string> PreludeFunctions;
+
+  // Definitions are kept after codegen so the interpreter can run them.
+  std::map<std::string, std::unique_ptr<FunctionAST>> FunctionDefs;
+  std::map<std::string, const double *> Bindings;
+  ExprCache Cache;
+
+  // When set, each item is echoed and top-level expressions are evaluated, as
+  // the REPL does. Library compiles only define them.
+  bool ReplMode = true;
+  // Outside REPL mode, compile expressions and keep their code for as long as
+  // the engine lives, as Engine::compile hands it out. Engine::define rejects
+  // them instead, so that a long-lived engine doesn't accumulate their code.
+  bool PinExprs = false;
+  // Echo items in REPL mode; EngineOptions::Echo.
+  bool Echo;
+  bool echoing() const { return ReplMode && Echo; }
+  // Evaluate with the AST interpreter instead of the JIT.
+  bool Interpret;
+  // Compiled code runs in an executor process, not in this one.
+  bool Remote = false;
+  // Set once a call into the executor fails, which means it has died. Calls
+  // may be made from any thread.
+  std::atomic<bool> ExecutorLost{false};
+  // Set when any item of the current source fails to compile.
+  bool HadError = false;
+  // The function most recently defined by one of the handlers.
+  std::string LastFunction;
+  // The code of the last top-level expression, if that was the last item.
+  void *LastExprAddr = nullptr;
+  // Receives top-level expressions instead of evaluating them, if set.
+  const std::function<void(Evaluation)> *Evaluator = nullptr;
+  // Set by Engine::cancel. Compiled code polls it on function entry.
+  std::atomic<bool> Cancelled{false};
+  // EngineOptions::FramePointers.
+  bool FramePointers;
+
+  // Definitions and expressions compiled, for Engine::stats; the parser
+  // keeps the front end's counters.
+  EngineStats Compiled;
+  // Counted as the JIT optimizes and links, which lookups on any thread can
+  // make it do.
+  struct JITCounters {
+    std::atomic<std::uint64_t> Modules{0};
+    std::atomic<std::uint64_t> InstructionsBefore{0};
+    std::atomic<std::uint64_t> InstructionsAfter{0};
+    std::atomic<std::uint64_t> Objects{0};
+    std::atomic<std::uint64_t> CodeBytes{0};
+    std::atomic<std::uint64_t> DataBytes{0};
+  } Counters;
+};
+
+Engine::Impl::Impl(EngineOptions Opts)
+    : HotCallCount(Opts.HotCallCount), Cache(Opts.ExprCacheSize),
+      Echo(Opts.Echo), Interpret(Opts.Interpret),
+      Remote(!Opts.Interpret && !Opts.Executor.empty()),
+      FramePointers(Opts.FramePointers) {
+  CollectRemarks = CG.DebugInfo = Opts.Remarks && !Interpret;
+  if (Opts.Perf && Remote)
+    LogError("Code in an executor process isn't registered with perf");
+  if (Opts.Cancellable && Remote)
+    LogError("Code in an executor process can't be cancelled");
+  else if (Opts.Cancellable)
+    CG.Cancellable = true;
+  if (!Interpret) {
+    auto J = Remote ? CreateRemoteJIT(Opts.Executor)
+                    : CreateLocalJIT(Opts);
+    if (J) {
+      TheJIT = std::move(*J);
+      // Without the region there's nowhere to move hot code to.
+      CountCalls = Region && HotCallCount;
+      auto AddGenerator = [this](auto Gen) {
+        if (Gen)
+          TheJIT->getMainJITDylib().addGenerator(std::move(*Gen));
+        else
+          LogError(toString(Gen.takeError()).c_str());
+      };
+      if (Remote)
+        AddGenerator(orc::EPCDynamicLibrarySearchGenerator::GetForTargetProcess(
+            TheJIT->getExecutionSession()));
+      else
+        AddGenerator(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            TheJIT->getDataLayout().getGlobalPrefix()));
+
+      if (!Remote) {
+        Stubs = orc::createLocalIndirectStubsManagerBuilder(
+            TheJIT->getTargetTriple())();
+        // Always defined, so that code saved by a cancellable engine can be
+        // restored into any other.
+        auto &JD = TheJIT->getMainJITDylib();
+        cantFail(JD.define(orc::absoluteSymbols(
+            {{TheJIT->mangleAndIntern(CancelFlagSymbol),
+              JITEvaluatedSymbol(pointerToJITTargetAddress(&Cancelled),
+                                 JITSymbolFlags::Exported)}})));
+        // Keep a copy of the object code of every definition.
+        TheJIT->getObjTransformLayer().setTransform(
+            [this](std::unique_ptr<MemoryBuffer> Obj)
+                -> Expected<std::unique_ptr<MemoryBuffer>> {
+              StringRef Id = Obj->getBufferIdentifier();
+              if (Id.consume_front("def:") &&
+                  Id.consume_back("-jitted-objectbuffer")) {
+                auto Copy =
+                    MemoryBuffer::getMemBufferCopy(Obj->getBuffer(), Id);
+                std::lock_guard<std::mutex> Lock(ObjectsMutex);
+                Objects[Id.rsplit('.').first.str()] = {Id.str(),
+                                                       std::move(Copy)};
+              }
+              return std::move(Obj);
+            });
+      }
+
+      if (auto JTMB = orc::JITTargetMachineBuilder::detectHost()) {
+        if (auto TMOrErr = JTMB->createTargetMachine())
+          TM = std::move(*TMOrErr);
+        else
+          LogError(toString(TMOrErr.takeError()).c_str());
+      } else {
+        LogError(toString(JTMB.takeError()).c_str());
+      }
+      TheJIT->getIRTransformLayer().setTransform(
+          [this](orc::ThreadSafeModule TSM,
+                 const orc::MaterializationResponsibility &R) {
+            TSM.withModuleDo([this](Module &M) {
+              StringRef Body = M.getModuleIdentifier();
+              bool Definition = Body.consume_front("def:");
+              if (Definition && IsCountingBody(Body))
+                if (llvm::Function *F = M.getFunction(Body))
+                  InsertCallCounter(*F, Body.rsplit('.').first);
+              if (FramePointers)
+                for (llvm::Function &F : M)
+                  if (!F.isDeclaration())
+                    F.addFnAttr("frame-pointer", "all");
+              Counters.InstructionsBefore += M.getInstructionCount();
+              if (CollectRemarks)
+                OptimizeWithRemarks(M);
+              else
+                OptimizeModule(M, TM.get());
+              ++Counters.Modules;
+              Counters.InstructionsAfter += M.getInstructionCount();
+              if (!Definition)
+                return;
+              if (llvm::Function *F = M.getFunction(Body)) {
+                std::string IR;
+                raw_string_ostream OS(IR);
+                F->print(OS);
+                std::lock_guard<std::mutex> Lock(IRMutex);
+                OptimizedIR[Body.rsplit('.').first.str()] = std::move(IR);
+              }
+            });
+            return Expected<orc::ThreadSafeModule>(std::move(TSM));
+          });
+    } else {
+      // Hosts that forbid executable memory still get the interpreter.
+      LogError(toString(J.takeError()).c_str());
+      Interpret = true;
+      Remote = false;
+    }
+  }
+  // The interpreter can't run bitcode.
+  if (Opts.Prelude && !Interpret && PreludeBitcode().getBufferSize())
+    DeclarePrelude();
+  InitializeModule();
+}
+
+void Engine::Impl::DeclarePrelude() {
+  if (!DeclarePreludeProtos(CG, PreludeFunctions))
+    return;
+  TheJIT->getMainJITDylib().addGenerator(
+      std::make_unique<PreludeGenerator>(*TheJIT, PreludeFunctions));
+}
+
+// Counts the objects JITLink links for Engine::stats, and the bytes of code
+// and data in them.
+class StatsPlugin : public orc::ObjectLinkingLayer::Plugin {
+public:
+  StatsPlugin(std::atomic<std::uint64_t> &Objects,
+              std::atomic<std::uint64_t> &CodeBytes,
+              std::atomic<std::uint64_t> &DataBytes)
+      : Objects(Objects), CodeBytes(CodeBytes), DataBytes(DataBytes) {}
+
+  void modifyPassConfig(orc::MaterializationResponsibility &,
+                        jitlink::LinkGraph &,
+                        jitlink::PassConfiguration &Config) override {
+    Config.PostAllocationPasses.push_back([this](jitlink::LinkGraph &G) {
+      ++Objects;
+      for (auto &Sec : G.sections()) {
+        std::uint64_t Bytes = 0;
+        for (auto *B : Sec.blocks())
+          Bytes += B->getSize();
+        bool Code = (Sec.getMemProt() & jitlink::MemProt::Exec) !=
+                    jitlink::MemProt::None;
+        (Code ? CodeBytes : DataBytes) += Bytes;
+      }
+      return Error::success();
+    });
+  }
+  Error notifyFailed(orc::MaterializationResponsibility &) override {
+    return Error::success();
+  }
+  Error notifyRemovingResources(orc::ResourceKey) override {
+    return Error::success();
+  }
+  void notifyTransferringResources(orc::ResourceKey,
+                                   orc::ResourceKey) override {}
+
+private:
+  std::atomic<std::uint64_t> &Objects, &CodeBytes, &DataBytes;
+};
+
+// Compiles modules the JIT materializes to objects as LLJIT does by default,
+// in a time trace scope of its own.
+class TimedCompiler : public orc::IRCompileLayer::IRCompiler {
+public:
+  explicit TimedCompiler(std::unique_ptr<orc::IRCompileLayer::IRCompiler> C)
+      : IRCompiler(C->getManglingOptions()), C(std::move(C)) {}
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    TimeTraceScope Scope("EmitCode", M.getModuleIdentifier());
+    MemoryPhaseScope Memory(MemoryPhase::EmitCode);
+    return (*C)(M);
+  }
+
+  static Expected<std::unique_ptr<orc::IRCompileLayer::IRCompiler>>
+  Create(orc::JITTargetMachineBuilder JTMB) {
+    auto TM = JTMB.createTargetMachine();
+    if (!TM)
+      return TM.takeError();
+    return std::make_unique<TimedCompiler>(
+        std::make_unique<orc::TMOwningSimpleCompiler>(std::move(*TM)));
+  }
+
+private:
+  std::unique_ptr<orc::IRCompileLayer::IRCompiler> C;
+};
+
+// Start Program as an executor process connected over a pair of pipes, with
+// the command line llvm-jitlink-executor takes, and build a JIT that links
+// code into it.
+Expected<std::unique_ptr<orc::LLJIT>>
+Engine::Impl::CreateRemoteJIT(const std::string &Program) {
+  int ToExecutor[2], FromExecutor[2];
+  if (pipe2(ToExecutor, O_CLOEXEC) < 0)
+    return errorCodeToError(std::error_code(errno, std::generic_category()));
+  if (pipe2(FromExecutor, O_CLOEXEC) < 0) {
+    close(ToExecutor[0]);
+    close(ToExecutor[1]);
+    return errorCodeToError(std::error_code(errno, std::generic_category()));
+  }
+
+  std::string FDs =
+      fmt::format("filedescs={},{}", ToExecutor[0], FromExecutor[1]);
+  Executor.Pid = fork();
+  if (Executor.Pid == 0) {
+    fcntl(ToExecutor[0], F_SETFD, 0);
+    fcntl(FromExecutor[1], F_SETFD, 0);
+    execl(Program.c_str(), Program.c_str(), FDs.c_str(), nullptr);
+    _exit(127);
+  }
+  close(ToExecutor[0]);
+  close(FromExecutor[1]);
+  if (Executor.Pid < 0) {
+    close(ToExecutor[1]);
+    close(FromExecutor[0]);
+    return errorCodeToError(std::error_code(errno, std::generic_category()));
+  }
+
+  // Stubs are repointed by writing executor memory, which SimpleRemoteEPC
+  // has no default for in LLVM 14.
+  orc::SimpleRemoteEPC::Setup S;
+  S.CreateMemoryAccess = [](orc::SimpleRemoteEPC &EPC)
+      -> Expected<std::unique_ptr<orc::ExecutorProcessControl::MemoryAccess>> {
+    orc::EPCGenericMemoryAccess::FuncAddrs FAs;
+    if (auto Err = EPC.getBootstrapSymbols(
+            {{FAs.WriteUInt8s, orc::rt::MemoryWriteUInt8sWrapperName},
+             {FAs.WriteUInt16s, orc::rt::MemoryWriteUInt16sWrapperName},
+             {FAs.WriteUInt32s, orc::rt::MemoryWriteUInt32sWrapperName},
+             {FAs.WriteUInt64s, orc::rt::MemoryWriteUInt64sWrapperName},
+             {FAs.WriteBuffers, orc::rt::MemoryWriteBuffersWrapperName}}))
+      return std::move(Err);
+    return std::make_unique<orc::EPCGenericMemoryAccess>(EPC, FAs);
+  };
+  auto EPC = orc::SimpleRemoteEPC::Create<orc::FDSimpleRemoteEPCTransport>(
+      std::make_unique<orc::DynamicThreadPoolTaskDispatcher>(), std::move(S),
+      FromExecutor[0], ToExecutor[1]);
+  if (!EPC)
+    return EPC.takeError();
+
+  // JITLink, which links into another process, wants PIC in the small code
+  // model.
+  orc::JITTargetMachineBuilder JTMB((*EPC)->getTargetTriple());
+  JTMB.setRelocationModel(Reloc::PIC_);
+  JTMB.setCodeModel(CodeModel::Small);
+  return orc::LLJITBuilder()
+      .setJITTargetMachineBuilder(std::move(JTMB))
+      .setExecutorProcessControl(std::move(*EPC))
+      .setCompileFunctionCreator(TimedCompiler::Create)
+      .setPlatformSetUp(orc::setUpInactivePlatform)
+      .setObjectLinkingLayerCreator(
+          [this](orc::ExecutionSession &ES, const Triple &)
+              -> Expected<std::unique_ptr<orc::ObjectLayer>> {
+            auto Layer = std::make_unique<orc::ObjectLinkingLayer>(ES);
+            auto Registrar = orc::EPCEHFrameRegistrar::Create(ES);
+            if (!Registrar)
+              return Registrar.takeError();
+            Layer->addPlugin(std::make_unique<orc::EHFrameRegistrationPlugin>(
+                ES, std::move(*Registrar)));
+            Layer->addPlugin(std::make_unique<StatsPlugin>(
+                Counters.Objects, Counters.CodeBytes, Counters.DataBytes));
+            return std::move(Layer);
+          })
+      .create();
+}
+
+// How profiles name a JIT'd function: definitions by their own name rather
+// than their current body's, and all top-level expressions as one.
+static std::string ProfileName(StringRef Symbol) {
+  if (Symbol.startswith("__anon_expr"))
+    return "<top-level>";
+  auto [Name, Version] = Symbol.rsplit(".v");
+  if (!Version.empty() &&
+      Version.find_first_not_of("0123456789") == StringRef::npos)
+    return Name.str();
+  return Symbol.str();
+}
+
+// Names the functions of each graph JITLink links for Profiler.
+class ProfilerPlugin : public orc::ObjectLinkingLayer::Plugin {
+public:
+  void modifyPassConfig(orc::MaterializationResponsibility &,
+                        jitlink::LinkGraph &,
+                        jitlink::PassConfiguration &Config) override {
+    Config.PostFixupPasses.push_back([](jitlink::LinkGraph &G) {
+      for (auto *Sym : G.defined_symbols())
+        if (Sym->isCallable() && Sym->hasName())
+          registerJITFunction(Sym->getAddress().getValue(), Sym->getSize(),
+                              ProfileName(Sym->getName()));
+      return Error::success();
+    });
+  }
+  Error notifyFailed(orc::MaterializationResponsibility &) override {
+    return Error::success();
+  }
+  Error notifyRemovingResources(orc::ResourceKey) override {
+    return Error::success();
+  }
+  void notifyTransferringResources(orc::ResourceKey,
+                                   orc::ResourceKey) override {}
+};
+
+struct LoadedFunction {
+  std::uint64_t Addr;
+  std::uint64_t Size;
+  std::string Name;
+};
+
+// The functions of an object RuntimeDyld loaded, and where they went.
+static std::vector<LoadedFunction>
+LoadedFunctions(const object::ObjectFile &Obj,
+                const RuntimeDyld::LoadedObjectInfo &Info) {
+  std::vector<LoadedFunction> Functions;
+  for (auto &[Sym, Size] : object::computeSymbolSizes(Obj)) {
+    auto Type = Sym.getType();
+    auto Name = Sym.getName();
+    auto Section = Sym.getSection();
+    auto Value = Sym.getValue();
+    if (!Type || !Name || !Section || !Value ||
+        *Type != object::SymbolRef::ST_Function ||
+        *Section == Obj.section_end()) {
+      consumeError(Type.takeError());
+      consumeError(Name.takeError());
+      consumeError(Section.takeError());
+      consumeError(Value.takeError());
+      continue;
+    }
+    Functions.push_back(
+        {Info.getSectionLoadAddress(**Section) + *Value, Size, Name->str()});
+  }
+  return Functions;
+}
+
+// Append functions the JIT loaded to /tmp/perf-PID.map, which perf reads to
+// name samples in code that no file backs.
+static void WritePerfMap(const std::vector<LoadedFunction> &Functions) {
+  std::string Lines;
+  for (const LoadedFunction &F : Functions)
+    Lines += fmt::format("{:x} {:x} {}\n", F.Addr, F.Size, F.Name);
+
+  // Engines share the file; each line goes in whole.
+  static std::mutex Mutex;
+  static FILE *Map =
+      std::fopen(fmt::format("/tmp/perf-{}.map", getpid()).c_str(), "a");
+  std::lock_guard<std::mutex> Lock(Mutex);
+  if (Map) {
+    std::fputs(Lines.c_str(), Map);
+    std::fflush(Map);
+  }
+}
+
+// Code linked in this process goes through JITLink into a CodeRegion, in the
+// small code model, since everything in the region is within reach of
+// PC-relative calls and loads. LLVM's perf listener only works with
+// RuntimeDyld, so with EngineOptions::Perf objects are linked by that instead.
+Expected<std::unique_ptr<orc::LLJIT>>
+Engine::Impl::CreateLocalJIT(const EngineOptions &Opts) {
+  if (Opts.Perf)
+    return orc::LLJITBuilder()
+        .setCompileFunctionCreator(TimedCompiler::Create)
+        .setObjectLinkingLayerCreator(
+            [this](orc::ExecutionSession &ES, const Triple &)
+                -> Expected<std::unique_ptr<orc::ObjectLayer>> {
+              auto Layer = std::make_unique<orc::RTDyldObjectLinkingLayer>(
+                  ES, [] { return std::make_unique<SectionMemoryManager>(); });
+              // Null if LLVM was built without perf support.
+              auto *Listener = JITEventListener::createPerfJITEventListener();
+              if (Listener)
+                Layer->registerJITEventListener(*Listener);
+              Layer->setNotifyLoaded(
+                  [this](orc::MaterializationResponsibility &,
+                         const object::ObjectFile &Obj,
+                         const RuntimeDyld::LoadedObjectInfo &Info) {
+                    ++Counters.Objects;
+                    for (auto &Sec : Obj.sections())
+                      if (Info.getSectionLoadAddress(Sec))
+                        (Sec.isText() ? Counters.CodeBytes
+                                      : Counters.DataBytes) += Sec.getSize();
+                    auto Functions = LoadedFunctions(Obj, Info);
+                    WritePerfMap(Functions);
+                    for (LoadedFunction &F : Functions)
+                      registerJITFunction(F.Addr, F.Size,
+                                          ProfileName(F.Name));
+                  });
+              return std::move(Layer);
+            })
+        .create();
+
+  auto JTMB = orc::JITTargetMachineBuilder::detectHost();
+  if (!JTMB)
+    return JTMB.takeError();
+  JTMB->setRelocationModel(Reloc::PIC_);
+  JTMB->setCodeModel(CodeModel::Small);
+  std::size_t RegionSize = Opts.CodeRegionSize;
+  return orc::LLJITBuilder()
+      .setJITTargetMachineBuilder(std::move(*JTMB))
+      .setCompileFunctionCreator(TimedCompiler::Create)
+      .setObjectLinkingLayerCreator(
+          [this, RegionSize](orc::ExecutionSession &ES, const Triple &)
+              -> Expected<std::unique_ptr<orc::ObjectLayer>> {
+            std::unique_ptr<orc::ObjectLinkingLayer> Layer;
+            if (RegionSize) {
+              // Top-level expressions are cold, and so are definitions until
+              // PlaceHotCode moves them; see HandleTopLevelExpression.
+              auto R = CodeRegion::Create(
+                  RegionSize, [](const jitlink::LinkGraph &G) {
+                    StringRef Name = G.getName();
+                    if (Name.startswith("expr:"))
+                      return false;
+                    Name.consume_front("def:");
+                    Name.consume_back("-jitted-objectbuffer");
+                    return !IsCountingBody(Name);
+                  });
+              // Hosts that don't allow executable shared memory still get
+              // pages for each object.
+              if (R) {
+                Region = R->get();
+                Layer = std::make_unique<orc::ObjectLinkingLayer>(
+                    ES, std::move(*R));
+              } else {
+                LogError(toString(R.takeError()).c_str());
+              }
+            }
+            if (!Layer)
+              Layer = std::make_unique<orc::ObjectLinkingLayer>(ES);
+            Layer->addPlugin(std::make_unique<orc::EHFrameRegistrationPlugin>(
+                ES, std::make_unique<jitlink::InProcessEHFrameRegistrar>()));
+            Layer->addPlugin(std::make_unique<ProfilerPlugin>());
+            Layer->addPlugin(std::make_unique<StatsPlugin>(
+                Counters.Objects, Counters.CodeBytes, Counters.DataBytes));
+            return std::move(Layer);
+          })
+      .create();
+}
+
+// Collects the remarks the optimizer makes about the jlang functions of a
+// module, by function. Callees offered for inlining and the prelude are
+// left out: their copies are dropped after optimization.
+class RemarkCollector : public DiagnosticHandler {
+public:
+  bool handleDiagnostics(const DiagnosticInfo &DI) override {
+    auto *Diag = dyn_cast<DiagnosticInfoIROptimization>(&DI);
+    if (!Diag)
+      return false;
+    const llvm::Function &F = Diag->getFunction();
+    if (!F.getSubprogram() || F.hasAvailableExternallyLinkage())
+      return true;
+    Remark R;
+    switch (DI.getKind()) {
+    case DK_OptimizationRemark:
+      R.Kind = "Passed";
+      break;
+    case DK_OptimizationRemarkMissed:
+      R.Kind = "Missed";
+      break;
+    case DK_OptimizationFailure:
+      R.Kind = "Failure";
+      break;
+    default:
+      R.Kind = "Analysis";
+    }
+    R.Pass = Diag->getPassName();
+    R.Name = Diag->getRemarkName().str();
+    R.Function = ProfileName(F.getName());
+    R.File = F.getSubprogram()->getFilename().str();
+    if (Diag->isLocationAvailable()) {
+      R.Line = Diag->getLocation().getLine();
+      R.Column = Diag->getLocation().getColumn();
+    }
+    R.Message = Diag->getMsg();
+    for (auto &Arg : Diag->getArgs())
+      R.Args.emplace_back(Arg.Key, Arg.Val);
+    ByFunction[R.Function].push_back(std::move(R));
+    return true;
+  }
+  bool isAnalysisRemarkEnabled(StringRef) const override { return true; }
+  bool isMissedOptRemarkEnabled(StringRef) const override { return true; }
+  bool isPassedOptRemarkEnabled(StringRef) const override { return true; }
+  bool isAnyRemarkEnabled() const override { return true; }
+
+  std::map<std::string, std::vector<Remark>> ByFunction;
+};
+
+// Optimize M as OptimizeModule does, keeping the remarks made about its
+// functions. They replace those of earlier compiles, even when there are
+// none. The line tables they came from are stripped afterwards.
+void Engine::Impl::OptimizeWithRemarks(Module &M) {
+  LLVMContext &Ctx = M.getContext();
+  auto Collector = std::make_unique<RemarkCollector>();
+  auto &ByFunction = Collector->ByFunction;
+  auto Old = Ctx.getDiagnosticHandler();
+  Ctx.setDiagnosticHandler(std::move(Collector));
+  OptimizeModule(M, TM.get());
+
+  {
+    std::lock_guard<std::mutex> Lock(RemarksMutex);
+    for (llvm::Function &F : M) {
+      if (!F.getSubprogram() || F.isDeclaration() ||
+          F.hasAvailableExternallyLinkage())
+        continue;
+      std::string Name = ProfileName(F.getName());
+      Remarks[Name] = std::move(ByFunction[Name]);
+    }
+  }
+  Ctx.setDiagnosticHandler(std::move(Old));
+  StripDebugInfo(M);
+}
+
+void Engine::Impl::InitializeModule() {
+  // The interpreter drops modules instead of handing them to the JIT, and a
+  // module has to go before its context.
+  CG.Scope = nullptr;
+  CG.DI.reset();
+  CG.Builder.reset();
+  CG.TheModule.reset();
+  CG.TheContext = std::make_unique<LLVMContext>();
+  CG.TheModule = std::make_unique<Module>("Jun's JIT", *CG.TheContext);
+  if (TheJIT)
+    CG.TheModule->setDataLayout(TheJIT->getDataLayout());
+
+  CG.Builder = std::make_unique<IRBuilder<>>(*CG.TheContext);
+}
+
+// Hand the current module to the JIT and start a fresh one. Modules added
+// under RT can be freed by removing it.
+bool Engine::Impl::AddModuleToJIT(orc::ResourceTrackerSP RT) {
+  if (!RT)
+    RT = TheJIT->getMainJITDylib().getDefaultResourceTracker();
+  if (!PreludeFunctions.empty()) {
+    if (auto Err = LinkPrelude(*CG.TheModule, PreludeFunctions)) {
+      InitializeModule();
+      LogError(toString(std::move(Err)).c_str());
+      return false;
+    }
+  }
+  if (CG.DI)
+    CG.DI->finalize();
+  auto Err = TheJIT->addIRModule(
+      RT, orc::ThreadSafeModule(std::move(CG.TheModule),
+                                std::move(CG.TheContext)));
+  InitializeModule();
+  if (Err) {
+    LogError(toString(std::move(Err)).c_str());
+    return false;
+  }
+  return true;
+}
+
+void *Engine::Impl::LookupFunction(const std::string &Name) {
+  // Looking a function up compiles and links it.
+  TimeTraceScope Scope("Materialize", Name);
+  MemoryPhaseScope Memory(MemoryPhase::Link);
+  auto Sym = TheJIT->lookup(Name);
+  if (!Sym) {
+    LogError(toString(Sym.takeError()).c_str());
+    return nullptr;
+  }
+  return jitTargetAddressToPointer<void *>(Sym->getAddress());
+}
+
+// Compile FnAST into a module of its own and point its stub at the result.
+bool Engine::Impl::CompileDefinition(FunctionAST &FnAST, bool Echo) {
+  if (!ExecutorAlive())
+    return false;
+  const std::string &Name = FnAST.Proto->getName();
+  auto *FnIR = FnAST.codegen(CG);
+  if (!FnIR)
+    return false;
+
+  if (Echo) {
+    fmt::print("Parsed a function definition.\n");
+    FnIR->print(errs());
+    std::printf("\n");
+  }
+  if (Interpret) {
+    InitializeModule();
+    return true;
+  }
+
+  // Give the optimizer the bodies of the jlang functions called here, so that
+  // small helpers get inlined. The copies are available_externally: they're
+  // dropped after optimization, and calls left in place go through the stubs.
+  std::vector<std::string> Callees;
+  for (auto &F : *CG.TheModule)
+    if (F.isDeclaration() && FunctionDefs.count(std::string(F.getName())))
+      Callees.push_back(std::string(F.getName()));
+  for (auto &Callee : Callees) {
+    if (auto *F = FunctionDefs[Callee]->codegen(CG))
+      F->setLinkage(GlobalValue::AvailableExternallyLinkage);
+  }
+
+  bool Count = CountCalls && !HotFunctions.count(Name);
+  if (Count)
+    DefineCallCounter(Name);
+  std::string BodyName =
+      Name + (Count ? ".v" : ".h") + std::to_string(++Versions[Name]);
+  FnIR->setName(BodyName);
+  // Lets the object layer tell definitions from expressions.
+  CG.TheModule->setModuleIdentifier("def:" + BodyName);
+
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  void *Addr = AddModuleToJIT(RT) ? LookupFunction(BodyName) : nullptr;
+  if (!Addr) {
+    RemoveTracker(*RT);
+    return false;
+  }
+
+  auto Old = Bodies.find(Name);
+  bool First = Old == Bodies.end();
+  if (auto Err = First ? CreateStub(Name, Addr) : UpdateStub(Name, Addr)) {
+    LogError(toString(std::move(Err)).c_str());
+    RemoveTracker(*RT);
+    return false;
+  }
+  if (!First)
+    RemoveTracker(*Old->second);
+  Bodies[Name] = std::move(RT);
+  ++Compiled.DefinitionsCompiled;
+
+  for (auto &Callee : InlinedCallees[Name])
+    InlinedInto[Callee].erase(Name);
+  for (auto &Callee : Callees)
+    InlinedInto[Callee].insert(Name);
+  InlinedCallees[Name] = std::move(Callees);
+  return true;
+}
+
+// Give the JIT the counter of calls to Name, which compiled code counting
+// them refers to, unless it has it already.
+void Engine::Impl::DefineCallCounter(const std::string &Name) {
+  auto [It, New] = CallCounts.try_emplace(Name, 0);
+  if (!New)
+    return;
+  auto &JD = TheJIT->getMainJITDylib();
+  if (auto Err = JD.define(orc::absoluteSymbols(
+          {{TheJIT->mangleAndIntern(CallCounterPrefix + Name),
+            JITEvaluatedSymbol(pointerToJITTargetAddress(&It->second),
+                               JITSymbolFlags::Exported)}})))
+    LogError(toString(std::move(Err)).c_str());
+}
+
+// Recompile the definitions that have been called HotCallCount times, which
+// places them with the hot code and drops their counter.
+std::size_t Engine::Impl::PlaceHotCode() {
+  if (!CountCalls)
+    return 0;
+  std::vector<std::string> Hot;
+  for (auto &[Name, Calls] : CallCounts)
+    if (Calls.load(std::memory_order_relaxed) >= HotCallCount &&
+        !HotFunctions.count(Name) && FunctionDefs.count(Name))
+      Hot.push_back(Name);
+  std::size_t Placed = 0;
+  for (auto &Name : Hot) {
+    HotFunctions.insert(Name);
+    if (!CompileDefinition(*FunctionDefs[Name], /*Echo=*/false)) {
+      LogError(fmt::format("Couldn't move {} to the hot code", Name).c_str());
+      HotFunctions.erase(Name);
+      continue;
+    }
+    ++Placed;
+    ++Compiled.DefinitionsPromoted;
+    if (echoing())
+      fmt::print("Moved {} to the hot code after {} calls\n", Name,
+                 CallCounts[Name].load(std::memory_order_relaxed));
+  }
+  return Placed;
+}
+
+// Define Name as a stub that jumps to Addr.
+Error Engine::Impl::CreateStub(const std::string &Name, void *Addr) {
+  auto &JD = TheJIT->getMainJITDylib();
+  if (!Remote) {
+    if (auto Err = Stubs->createStub(Name, pointerToJITTargetAddress(Addr),
+                                     JITSymbolFlags::Exported))
+      return Err;
+    return JD.define(orc::absoluteSymbols(
+        {{TheJIT->mangleAndIntern(Name), Stubs->findStub(Name, true)}}));
+  }
+
+  // ORC's stubs for other processes crash in LLVM 14, so the executor gets
+  // a compiled jump through a pointer instead.
+  auto &Ctx = *CG.TheContext;
+  llvm::Function *F = CG.getFunction(Name);
+  auto *PtrTy = F->getType();
+  auto *Target = ConstantExpr::getIntToPtr(
+      ConstantInt::get(Type::getInt64Ty(Ctx), pointerToJITTargetAddress(Addr)),
+      PtrTy);
+  auto *Ptr = new GlobalVariable(*CG.TheModule, PtrTy, false,
+                                 GlobalValue::ExternalLinkage, Target,
+                                 Name + ".stub");
+  IRBuilder<> B(BasicBlock::Create(Ctx, "entry", F));
+  std::vector<Value *> Args;
+  for (auto &Arg : F->args())
+    Args.push_back(&Arg);
+  auto *Call =
+      B.CreateCall(F->getFunctionType(), B.CreateLoad(PtrTy, Ptr), Args);
+  Call->setTailCallKind(CallInst::TCK_MustTail);
+  B.CreateRet(Call);
+
+  if (!AddModuleToJIT())
+    return make_error<StringError>("Couldn't compile the stub of " + Name,
+                                   inconvertibleErrorCode());
+  auto Sym = TheJIT->lookup(Name + ".stub");
+  if (!Sym)
+    return Sym.takeError();
+  RemoteStubs[Name] = Sym->getAddress();
+  return Error::success();
+}
+
+// Point the stub of Name at Addr.
+Error Engine::Impl::UpdateStub(const std::string &Name, void *Addr) {
+  if (!Remote) {
+    std::lock_guard<std::mutex> Lock(LazyMutex);
+    LazyBodies.erase(Name);
+    return Stubs->updatePointer(Name, pointerToJITTargetAddress(Addr));
+  }
+  auto &EPC = TheJIT->getExecutionSession().getExecutorProcessControl();
+  return EPC.getMemoryAccess().writeUInt64s(
+      {{orc::ExecutorAddr(RemoteStubs[Name]),
+        pointerToJITTargetAddress(Addr)}});
+}
+
+// Compile a definition, whether parsed or built through jlang::Builder, and
+// hand it to the JIT.
+bool Engine::Impl::AddDefinition(std::unique_ptr<FunctionAST> FnAST) {
+  std::string Name = FnAST->Proto->getName();
+  if (PreludeFunctions.count(Name)) {
+    LogError(fmt::format("{} is defined by the prelude", Name).c_str());
+    return false;
+  }
+  // Callers, their inlined copies and cached expressions were all checked
+  // against the old arity, so a redefinition has to keep it.
+  auto Old = FunctionDefs.find(Name);
+  if (Old != FunctionDefs.end() &&
+      Old->second->Proto->getArgs().size() != FnAST->Proto->getArgs().size()) {
+    LogError(fmt::format("{} takes {} arguments and can't be redefined with {}",
+                         Name, Old->second->Proto->getArgs().size(),
+                         FnAST->Proto->getArgs().size())
+                 .c_str());
+    return false;
+  }
+  // Nothing runs while a definition is compiled, so old bodies can go.
+  PlaceHotCode();
+  if (!CompileDefinition(*FnAST, echoing()))
+    return false;
+
+  LastFunction = Name;
+  LastExprAddr = nullptr;
+  bool Redefined = FunctionDefs.count(Name);
+  FunctionDefs[Name] = std::move(FnAST);
+  if (Redefined && !Interpret) {
+    Cache.evictCallers(Name);
+    RecompileDependents(Name);
+  }
+  return true;
+}
+
+// Callers compiled against the old body of Name may have inlined it. Everyone
+// else already sees the new body through the stub.
+void Engine::Impl::RecompileDependents(const std::string &Name) {
+  std::set<std::string> Dependents = InlinedInto[Name];
+  for (auto &Dependent : Dependents) {
+    auto Def = FunctionDefs.find(Dependent);
+    if (Def == FunctionDefs.end())
+      continue;
+    if (!CompileDefinition(*Def->second, /*Echo=*/false)) {
+      LogError(fmt::format("Couldn't recompile {} against the new {}",
+                           Dependent, Name)
+                   .c_str());
+      HadError = true;
+    } else {
+      ++Compiled.DefinitionsRecompiled;
+      if (echoing())
+        fmt::print("Recompiled {}, which calls {}\n", Dependent, Name);
+    }
+  }
+}
+
+void Engine::Impl::HandleDefinition() {
+  if (auto FnAST = P.ParseDefinition()) {
+    if (!AddDefinition(std::move(FnAST)))
+      HadError = true;
+  } else {
+    HadError = true;
+    P.getNextTok();
+  }
+}
+
+void Engine::Impl::HandleExtern() {
+  P.getNextTok(); // eat extern
+  if (P.CurTok == tok_var) {
+    HandleExternVar();
+    return;
+  }
+
+  if (auto ProtoAST = P.ParsePrototype()) {
+    auto Def = FunctionDefs.find(ProtoAST->getName());
+    if (Def != FunctionDefs.end() && Def->second->Proto->getArgs().size() !=
+                                         ProtoAST->getArgs().size()) {
+      LogError(fmt::format("{} is defined with {} arguments",
+                           ProtoAST->getName(),
+                           Def->second->Proto->getArgs().size())
+                   .c_str());
+      HadError = true;
+      return;
+    }
+    if (auto *FnIR = ProtoAST->codegen(CG)) {
+      if (echoing()) {
+        fmt::print("Parsed an extern\n");
+        FnIR->print(errs());
+        std::printf("\n");
+      }
+      CG.FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+    }
+  } else {
+    HadError = true;
+    P.getNextTok();
+  }
+}
+
+void Engine::Impl::HandleExternVar() {
+  if (auto VarAST = P.ParseExternVar()) {
+    if (echoing()) {
+      fmt::print("Parsed an extern var\n");
+      VarAST->codegen(CG)->print(errs());
+      std::printf("\n");
+    }
+    CG.ExternVars[VarAST->getName()] = std::move(VarAST);
+  } else {
+    HadError = true;
+    P.getNextTok();
+  }
+}
+
+// Run the items of another file as if they were typed here. Each file is
+// read once, so shared imports and cycles are harmless.
+void Engine::Impl::HandleImport() {
+  std::string Path;
+  if (!P.ParseImport(Path)) {
+    HadError = true;
+    return;
+  }
+  SmallString<256> Full(Path);
+  if (!ImportDir.empty() && sys::path::is_relative(Path)) {
+    Full = ImportDir;
+    sys::path::append(Full, Path);
+  }
+  SmallString<256> Real;
+  auto Buf = MemoryBuffer::getFile(Full, /*IsText=*/true);
+  if (!Buf || sys::fs::real_path(Full, Real)) {
+    LogError(fmt::format("Can't import {}", Full.str()).c_str());
+    HadError = true;
+    return;
+  }
+  if (!Imported.insert(std::string(Real)).second)
+    return;
+
+  auto Saved = P.saveInput();
+  std::string SavedDir =
+      std::exchange(ImportDir, std::string(sys::path::parent_path(Real)));
+  P.setInput((*Buf)->getBuffer(), std::string(Real));
+  P.getNextTok();
+  MainLoop();
+  ImportDir = std::move(SavedDir);
+  P.restoreInput(std::move(Saved));
+}
+
+void Engine::Impl::HandleTopLevelExpression() {
+  auto FnAST = P.ParseTopLevelExpr();
+  if (!FnAST) {
+    HadError = true;
+    P.getNextTok();
+    return;
+  }
+
+  if (!ReplMode && !PinExprs) {
+    LogError("Only definitions, externs and imports can be defined");
+    HadError = true;
+    return;
+  }
+  if (!ExecutorAlive()) {
+    HadError = true;
+    return;
+  }
+
+  auto Start = std::chrono::steady_clock::now();
+  auto Elapsed = [&] {
+    std::chrono::duration<double> D = std::chrono::steady_clock::now() - Start;
+    return D.count();
+  };
+
+  std::string Key;
+  if (!Interpret && Cache.capacity()) {
+    Key = FnAST->profile();
+    if (auto *Hit = Cache.lookup(Key)) {
+      ++Cache.Stats.Hits;
+      Cache.Stats.HitSeconds += Elapsed();
+      LastFunction = Hit->Name;
+      LastExprAddr = Hit->Addr;
+      if (ReplMode) {
+        if (Echo)
+          fmt::print("Reused a compiled top-level expr\n");
+        EvaluateExpr(Hit->Addr, Hit->Code);
+      } else {
+        Hit->Code->Pinned = true;
+      }
+      return;
+    }
+  }
+
+  const std::string Name = FnAST->Proto->getName();
+  auto *FnIR = FnAST->codegen(CG);
+  // Nothing calls an expression by name, so it needs no prototype.
+  CG.FunctionProtos.erase(Name);
+  if (!FnIR) {
+    HadError = true;
+    return;
+  }
+  if (echoing()) {
+    fmt::print("Parsed a top-level expr\n");
+    FnIR->print(errs());
+    std::printf("\n");
+  }
+
+  if (Interpret) {
+    double Result;
+    if (ReplMode && EvalBatch(FunctionDefs, CG.FunctionProtos, Bindings,
+                              *FnAST, {}, &Result, 1)) {
+      if (Evaluator)
+        (*Evaluator)(Evaluation(
+            [Result](double &R) {
+              R = Result;
+              return true;
+            },
+            nullptr));
+      else
+        fmt::print("Evaluated to {}\n", Result);
+    }
+    InitializeModule();
+    return;
+  }
+
+  // The executor process only runs functions with ORC's wrapper-function
+  // signature, so remote expressions are entered through a wrapper.
+  std::string Entry = Remote ? EmitResultWrapper(CG, FnIR) : Name;
+
+  // Every expression gets a module of its own, so that its memory can be
+  // given back once it's no longer needed. The name puts its code with the
+  // cold code of the region.
+  CG.TheModule->setModuleIdentifier("expr:" + Name);
+  std::vector<std::string> Callees;
+  for (auto &F : *CG.TheModule)
+    if (F.isDeclaration())
+      Callees.push_back(std::string(F.getName()));
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  void *Addr = AddModuleToJIT(RT) ? LookupFunction(Entry) : nullptr;
+  if (!Addr) {
+    HadError = true;
+    RemoveTracker(*RT);
+    return;
+  }
+  ++Compiled.ExpressionsCompiled;
+  auto Code = std::make_shared<ExprCode>(std::move(RT));
+  // Code handed out by compile() has to outlive this call.
+  Code->Pinned = !ReplMode;
+
+  LastFunction = Name;
+  LastExprAddr = Addr;
+  if (Cache.capacity()) {
+    ++Cache.Stats.Misses;
+    Cache.Stats.MissSeconds += Elapsed();
+    Cache.insert(std::move(Key), Name, Addr, Code, std::move(Callees));
+  }
+  if (ReplMode)
+    EvaluateExpr(Addr, std::move(Code));
+}
+
+// Whether compiled code can be called from this process. Logs why not.
+bool Engine::Impl::CanCallCode() {
+  if (Interpret) {
+    LogError("No native code is generated in interpreter mode");
+    return false;
+  }
+  if (Remote) {
+    LogError("Compiled code runs in the executor process");
+    return false;
+  }
+  return true;
+}
+
+// Run a compiled expression in the executor process. Returns false if the
+// executor failed to, which it only does once it has died.
+bool Engine::Impl::CallExecutor(void *Addr, double &Val) {
+  auto &EPC = TheJIT->getExecutionSession().getExecutorProcessControl();
+  auto Result =
+      EPC.callWrapper(orc::ExecutorAddr(pointerToJITTargetAddress(Addr)), {});
+  if (const char *Err = Result.getOutOfBandError()) {
+    LogError(fmt::format("The executor failed: {}", Err).c_str());
+    ExecutorLost = true;
+    return false;
+  }
+  if (Result.size() != sizeof(Val)) {
+    LogError("The executor returned a malformed result");
+    return false;
+  }
+  std::memcpy(&Val, Result.data(), sizeof(Val));
+  return true;
+}
+
+// Whether code can still be linked into the executor process. Logs why not.
+bool Engine::Impl::ExecutorAlive() {
+  if (!Remote || !ExecutorLost)
+    return true;
+  LogError("The executor process has died; start a new session");
+  return false;
+}
+
+void Engine::Impl::EvaluateExpr(void *Addr, std::shared_ptr<ExprCode> Code) {
+  std::function<bool(double &)> Fn;
+  if (Remote)
+    Fn = [this, Addr](double &Val) { return CallExecutor(Addr, Val); };
+  else
+    Fn = [Addr](double &Val) {
+      Val = reinterpret_cast<double (*)()>(Addr)();
+      return true;
+    };
+  double Val;
+  if (Evaluator) {
+    (*Evaluator)(Evaluation(std::move(Fn), std::move(Code)));
+    return;
+  }
+  if (Fn(Val))
+    fmt::print("Evaluated to {}\n", Val);
+  PlaceHotCode();
+}
+
+// A snapshot starts with this, then the triple and CPU the code was compiled
+// for, the externs, the extern vars and the definitions.
+static const char SnapshotMagic[8] = {'J', 'L', 'S', 'N', 'A', 'P', '1', '\n'};
+
+static void WriteArgs(std::string &Out, const std::vector<std::string> &Args) {
+  WriteRaw<uint32_t>(Out, Args.size());
+  for (auto &Arg : Args)
+    WriteString(Out, Arg);
+}
+
+static std::vector<std::string> ReadArgs(SnapshotReader &R) {
+  uint32_t N = R.read<uint32_t>();
+  std::vector<std::string> Args;
+  for (uint32_t I = 0; I < N && !R.failed(); ++I)
+    Args.push_back(R.readString().str());
+  return Args;
+}
+
+// Called in place of a restored body that can't be linked.
+static double RestoredCodeFailed() {
+  LogError("Couldn't link restored code");
+  return std::numeric_limits<double>::quiet_NaN();
+}
+
+bool Engine::Impl::Save(const std::string &Path) {
+  if (!CanCallCode())
+    return false;
+
+  std::string Out(SnapshotMagic, sizeof(SnapshotMagic));
+  WriteString(Out, TheJIT->getTargetTriple().str());
+  WriteString(Out, sys::getHostCPUName());
+
+  std::vector<const PrototypeAST *> Externs;
+  for (auto &[Name, Proto] : CG.FunctionProtos)
+    if (!FunctionDefs.count(Name) && !PreludeFunctions.count(Name))
+      Externs.push_back(Proto.get());
+  WriteRaw<uint32_t>(Out, Externs.size());
+  for (auto *Proto : Externs) {
+    WriteString(Out, Proto->getName());
+    WriteArgs(Out, Proto->getArgs());
+  }
+  WriteRaw<uint32_t>(Out, CG.ExternVars.size());
+  for (auto &[Name, Var] : CG.ExternVars)
+    WriteString(Out, Name);
+
+  WriteRaw<uint32_t>(Out, FunctionDefs.size());
+  std::unique_lock<std::mutex> ObjectsLock(ObjectsMutex);
+  for (auto &[Name, Def] : FunctionDefs) {
+    auto Obj = Objects.find(Name);
+    if (Obj == Objects.end()) {
+      LogError(fmt::format("No code to save for {}", Name).c_str());
+      return false;
+    }
+    WriteString(Out, Name);
+    WriteRaw<uint32_t>(Out, Versions[Name]);
+    WriteString(Out, Obj->second.Body);
+    WriteArgs(Out, Def->Proto->getArgs());
+    Def->Body->serialize(Out);
+    WriteArgs(Out, InlinedCallees[Name]);
+    // Aligned, so that the object can be linked straight out of the mapping.
+    StringRef Code = Obj->second.Buffer->getBuffer();
+    WriteRaw<uint64_t>(Out, Code.size());
+    Out.resize(alignTo(Out.size(), 16));
+    Out.append(Code.begin(), Code.end());
+  }
+  ObjectsLock.unlock();
+
+  std::FILE *F = std::fopen(Path.c_str(), "wb");
+  bool Ok = F && std::fwrite(Out.data(), 1, Out.size(), F) == Out.size();
+  if (F && std::fclose(F) != 0)
+    Ok = false;
+  if (!Ok)
+    LogError(fmt::format("Couldn't write {}: {}", Path,
+                         std::strerror(errno))
+                 .c_str());
+  return Ok;
+}
+
+bool Engine::Impl::Restore(const std::string &Path) {
+  if (Remote) {
+    LogError("Snapshots can't be restored into an executor process");
+    return false;
+  }
+  if (!FunctionDefs.empty() || !CG.ExternVars.empty()) {
+    LogError("Snapshots can only be restored into an empty engine");
+    return false;
+  }
+  auto Buf = MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                   /*RequiresNullTerminator=*/false);
+  if (!Buf) {
+    LogError(fmt::format("Couldn't read {}: {}", Path,
+                         Buf.getError().message())
+                 .c_str());
+    return false;
+  }
+
+  // Decode everything before touching the engine, so that a bad snapshot
+  // leaves it as it was.
+  struct Definition {
+    std::string Name;
+    unsigned Version;
+    StringRef Body;
+    std::unique_ptr<FunctionAST> AST;
+    std::vector<std::string> Callees;
+    StringRef Code;
+  };
+  SnapshotReader R((*Buf)->getBuffer());
+  bool Bad = R.readBytes(sizeof(SnapshotMagic)) !=
+             StringRef(SnapshotMagic, sizeof(SnapshotMagic));
+  StringRef Triple = R.readString(), CPU = R.readString();
+  if (!Bad && !Interpret &&
+      (Triple != TheJIT->getTargetTriple().str() ||
+       CPU != sys::getHostCPUName())) {
+    LogError(fmt::format("{} was saved on another kind of host", Path)
+                 .c_str());
+    return false;
+  }
+
+  std::vector<std::unique_ptr<PrototypeAST>> Externs;
+  for (uint32_t I = 0, N = R.read<uint32_t>(); I < N && !R.failed(); ++I) {
+    std::string Name = R.readString().str();
+    Externs.push_back(std::make_unique<PrototypeAST>(Name, ReadArgs(R)));
+  }
+  std::vector<std::string> Vars;
+  for (uint32_t I = 0, N = R.read<uint32_t>(); I < N && !R.failed(); ++I)
+    Vars.push_back(R.readString().str());
+  std::vector<Definition> Defs;
+  for (uint32_t I = 0, N = R.read<uint32_t>(); I < N && !R.failed(); ++I) {
+    Definition D;
+    D.Name = R.readString().str();
+    D.Version = R.read<uint32_t>();
+    D.Body = R.readString();
+    auto Proto = std::make_unique<PrototypeAST>(D.Name, ReadArgs(R));
+    auto Body = ReadExpr(R);
+    if (!Body) {
+      Bad = true;
+      break;
+    }
+    D.AST = std::make_unique<FunctionAST>(std::move(Proto), std::move(Body));
+    D.Callees = ReadArgs(R);
+    D.Code = R.readBytes(R.read<uint64_t>(), 16);
+    Defs.push_back(std::move(D));
+  }
+  if (Bad || R.failed()) {
+    LogError(fmt::format("{} is not a jlang snapshot", Path).c_str());
+    return false;
+  }
+  for (auto &D : Defs)
+    if (PreludeFunctions.count(D.Name)) {
+      LogError(fmt::format("{} is defined by the prelude", D.Name).c_str());
+      return false;
+    }
+
+  for (auto &Proto : Externs)
+    CG.FunctionProtos[Proto->getName()] = std::move(Proto);
+  for (auto &Var : Vars)
+    CG.ExternVars[Var] = std::make_unique<ExternVarAST>(Var);
+  for (auto &D : Defs) {
+    CG.FunctionProtos[D.Name] = std::make_unique<PrototypeAST>(
+        D.Name, D.AST->Proto->getArgs());
+    Versions[D.Name] = D.Version;
+    for (auto &Callee : D.Callees)
+      InlinedInto[Callee].insert(D.Name);
+    InlinedCallees[D.Name] = std::move(D.Callees);
+    FunctionDefs[D.Name] = std::move(D.AST);
+  }
+  if (Interpret)
+    return true;
+
+  auto &ES = TheJIT->getExecutionSession();
+  auto &JD = TheJIT->getMainJITDylib();
+  if (!LazyCalls) {
+    auto LCTM = orc::createLocalLazyCallThroughManager(
+        TheJIT->getTargetTriple(), ES,
+        pointerToJITTargetAddress(&RestoredCodeFailed));
+    if (!LCTM) {
+      LogError(toString(LCTM.takeError()).c_str());
+      return false;
+    }
+    LazyCalls = std::move(*LCTM);
+  }
+
+  // Each body is only registered here; it's linked by the first call through
+  // its stub, which then points the stub at it.
+  orc::IndirectStubsManager::StubInitsMap Inits;
+  for (auto &D : Defs) {
+    auto RT = JD.createResourceTracker();
+    if (auto Err = TheJIT->addObjectFile(
+            RT, MemoryBuffer::getMemBuffer(D.Code, D.Body, false))) {
+      LogError(toString(std::move(Err)).c_str());
+      return false;
+    }
+    auto Trampoline = LazyCalls->getCallThroughTrampoline(
+        JD, TheJIT->mangleAndIntern(D.Body),
+        [this, Name = D.Name, Body = D.Body.str()](JITTargetAddress Addr)
+            -> Error {
+          std::lock_guard<std::mutex> Lock(LazyMutex);
+          auto It = LazyBodies.find(Name);
+          if (It == LazyBodies.end() || It->second != Body)
+            return Error::success();
+          LazyBodies.erase(It);
+          return Stubs->updatePointer(Name, Addr);
+        });
+    if (!Trampoline) {
+      LogError(toString(Trampoline.takeError()).c_str());
+      return false;
+    }
+    Inits[D.Name] = {*Trampoline, JITSymbolFlags::Exported};
+    // Bodies saved while they were counting calls go on counting.
+    DefineCallCounter(D.Name);
+    Bodies[D.Name] = std::move(RT);
+    LazyBodies[D.Name] = D.Body.str();
+    std::lock_guard<std::mutex> Lock(ObjectsMutex);
+    Objects[D.Name] = {D.Body.str(),
+                       MemoryBuffer::getMemBuffer(D.Code, D.Body, false)};
+  }
+  if (auto Err = Stubs->createStubs(Inits)) {
+    LogError(toString(std::move(Err)).c_str());
+    return false;
+  }
+  orc::SymbolMap StubSymbols;
+  for (auto &D : Defs)
+    StubSymbols[TheJIT->mangleAndIntern(D.Name)] =
+        Stubs->findStub(D.Name, true);
+  if (auto Err = JD.define(orc::absoluteSymbols(std::move(StubSymbols)))) {
+    LogError(toString(std::move(Err)).c_str());
+    return false;
+  }
+  Snapshot = std::move(*Buf);
+  return true;
+}
+
+void Engine::Impl::MainLoop() {
+  while (true) {
+    switch (P.CurTok) {
+    case tok_eof:
+      return;
+    case ';':
+      P.getNextTok();
+      break;
+    case tok_def:
+    case tok_export: {
+      TimeTraceScope Scope("Definition");
+      HandleDefinition();
+      break;
+    }
+    case tok_extern: {
+      TimeTraceScope Scope("Extern");
+      HandleExtern();
+      break;
+    }
+    case tok_import: {
+      TimeTraceScope Scope("Import");
+      HandleImport();
+      break;
+    }
+    default: {
+      TimeTraceScope Scope("Expression");
+      HandleTopLevelExpression();
+      break;
+    }
+    }
+  }
+}
+
+static void InitializeTargets() {
+  static std::once_flag Once;
+  std::call_once(Once, [] {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+  });
+}
+
+Engine::Engine(EngineOptions Opts) {
+  InitializeTargets();
+  PImpl = std::make_unique<Impl>(Opts);
+}
+
+Engine::~Engine() = default;
+
+void Engine::run(std::string_view Source) {
+  PImpl->P.setInput(Source);
+  PImpl->P.getNextTok();
+  PImpl->MainLoop();
+}
+
+void Engine::run(std::string_view Source,
+                 const std::function<void(Evaluation)> &Evaluate) {
+  PImpl->Evaluator = &Evaluate;
+  run(Source);
+  PImpl->Evaluator = nullptr;
+}
+
+void Engine::cancel() { PImpl->Cancelled.store(true); }
+
+bool Engine::cancelled() const { return PImpl->Cancelled.load(); }
+
+void Engine::resetCancel() { PImpl->Cancelled.store(false); }
+
+bool Engine::save(const std::string &Path) { return PImpl->Save(Path); }
+
+bool Engine::restore(const std::string &Path) {
+  return PImpl->Restore(Path);
+}
+
+bool Engine::define(std::string_view Source) {
+  PImpl->HadError = false;
+  PImpl->LastFunction.clear();
+  PImpl->LastExprAddr = nullptr;
+  PImpl->ReplMode = false;
+  run(Source);
+  PImpl->ReplMode = true;
+  return !PImpl->HadError;
+}
+
+void *Engine::compileImpl(std::string_view Source, size_t Arity) {
+  if (!PImpl->CanCallCode())
+    return nullptr;
+
+  PImpl->PinExprs = true;
+  bool Defined = define(Source);
+  PImpl->PinExprs = false;
+  if (!Defined)
+    return nullptr;
+  if (PImpl->LastFunction.empty()) {
+    LogError("Expected a function definition or expression");
+    return nullptr;
+  }
+  if (PImpl->LastExprAddr) {
+    if (Arity != 0) {
+      LogError("Incorrect argument number!");
+      return nullptr;
+    }
+    return PImpl->LastExprAddr;
+  }
+  return lookupImpl(PImpl->LastFunction, Arity);
+}
+
+void *Engine::compileImpl(Function Def, size_t Arity) {
+  if (!PImpl->CanCallCode())
+    return nullptr;
+  if (!Def.Node) {
+    if (!Def.Failed)
+      LogError("Expected a function definition");
+    return nullptr;
+  }
+
+  std::string Name = Def.Node->Proto->getName();
+  PImpl->ReplMode = false;
+  bool Added = PImpl->AddDefinition(std::move(Def.Node));
+  PImpl->ReplMode = true;
+  return Added ? lookupImpl(Name, Arity) : nullptr;
+}
+
+void *Engine::lookupImpl(std::string_view Name, size_t Arity) {
+  if (!PImpl->CanCallCode())
+    return nullptr;
+  auto &FunctionProtos = PImpl->CG.FunctionProtos;
+  auto FI = FunctionProtos.find(std::string(Name));
+  if (FI == FunctionProtos.end()) {
+    LogError("Unkown function referenced!");
+    return nullptr;
+  }
+  if (FI->second->getArgs().size() != Arity) {
+    LogError("Incorrect argument number!");
+    return nullptr;
+  }
+  return PImpl->LookupFunction(FI->first);
+}
+
+bool scanFile(std::string_view Source, FileInterface &Interface) {
+  Parser P;
+  P.setInput(Source);
+  P.getNextTok();
+  while (true) {
+    switch (P.CurTok) {
+    case tok_eof:
+      return true;
+    case ';':
+      P.getNextTok();
+      break;
+    case tok_def:
+    case tok_export: {
+      auto FnAST = P.ParseDefinition();
+      if (!FnAST)
+        return false;
+      Interface.Functions.emplace_back(FnAST->Proto->getName(),
+                                       FnAST->Proto->getArgs().size());
+      if (FnAST->Exported)
+        Interface.Exports.emplace_back(FnAST->Proto->getName(),
+                                       FnAST->Proto->getArgs());
+      break;
+    }
+    case tok_extern:
+      P.getNextTok();
+      if (P.CurTok == tok_var ? !P.ParseExternVar() : !P.ParsePrototype())
+        return false;
+      break;
+    case tok_import: {
+      std::string Path;
+      if (!P.ParseImport(Path))
+        return false;
+      Interface.Imports.push_back(std::move(Path));
+      break;
+    }
+    default:
+      if (!P.ParseTopLevelExpr())
+        return false;
+      break;
+    }
+  }
+}
+
+// Target machines for objects that may end up in a shared library. Each
+// function gets a section of its own, so that the build can order them.
+static Expected<std::unique_ptr<TargetMachine>> CreateObjectTargetMachine() {
+  auto JTMB = orc::JITTargetMachineBuilder::detectHost();
+  if (!JTMB)
+    return JTMB.takeError();
+  JTMB->setRelocationModel(Reloc::PIC_);
+  JTMB->getOptions().FunctionSections = true;
+  return JTMB->createTargetMachine();
+}
+
+// Codegen every item of one file of a build into CG's module, unoptimized.
+// PreludeNames receives every function the prelude declares or defines.
+static bool
+CodegenFile(CodeGenContext &CG, std::string_view Name, std::string_view Source,
+            const std::vector<std::pair<std::string, size_t>> &Imported,
+            TargetMachine &TM, std::set<std::string> &PreludeFunctions,
+            std::set<std::string> &PreludeNames) {
+  CG.TheContext = std::make_unique<LLVMContext>();
+  CG.TheModule = std::make_unique<Module>(Name, *CG.TheContext);
+  CG.TheModule->setDataLayout(TM.createDataLayout());
+  CG.TheModule->setTargetTriple(TM.getTargetTriple().str());
+  CG.Builder = std::make_unique<IRBuilder<>>(*CG.TheContext);
+  if (PreludeBitcode().getBufferSize())
+    DeclarePreludeProtos(CG, PreludeFunctions);
+  for (auto &Proto : CG.FunctionProtos)
+    PreludeNames.insert(Proto.first);
+  for (auto &[Fn, Arity] : Imported)
+    CG.FunctionProtos[Fn] =
+        std::make_unique<PrototypeAST>(Fn, PlaceholderArgs(Arity));
+
+  // Like Engine::Impl::MainLoop, but everything goes into one module.
+  Parser P;
+  P.setInput(Source, std::string(Name));
+  P.getNextTok();
+  while (P.CurTok != tok_eof) {
+    switch (P.CurTok) {
+    case ';':
+      P.getNextTok();
+      continue;
+    case tok_import: {
+      // The driver resolved it to Imported.
+      std::string Path;
+      if (!P.ParseImport(Path))
+        return false;
+      continue;
+    }
+    case tok_def:
+    case tok_export: {
+      auto FnAST = P.ParseDefinition();
+      if (!FnAST)
+        return false;
+      const std::string &Fn = FnAST->Proto->getName();
+      auto *Existing = CG.TheModule->getFunction(Fn);
+      if (PreludeFunctions.count(Fn) || (Existing && !Existing->empty())) {
+        LogError(fmt::format("{} is already defined", Fn).c_str());
+        return false;
+      }
+      if (!FnAST->codegen(CG))
+        return false;
+      continue;
+    }
+    case tok_extern:
+      P.getNextTok();
+      if (P.CurTok == tok_var) {
+        auto VarAST = P.ParseExternVar();
+        if (!VarAST)
+          return false;
+        CG.ExternVars[VarAST->getName()] = std::move(VarAST);
+      } else {
+        auto ProtoAST = P.ParsePrototype();
+        if (!ProtoAST || !ProtoAST->codegen(CG))
+          return false;
+        CG.FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+      }
+      continue;
+    default:
+      LogError("Top-level expressions can't be compiled ahead of time");
+      return false;
+    }
+  }
+  return true;
+}
+
+// Every object that calls a prelude function gets its own copy; the linker
+// keeps one.
+static bool LinkPreludeCopies(Module &M,
+                              const std::set<std::string> &PreludeFunctions) {
+  if (auto Err = LinkPrelude(M, PreludeFunctions,
+                             GlobalValue::LinkOnceODRLinkage)) {
+    LogError(toString(std::move(Err)).c_str());
+    return false;
+  }
+  return true;
+}
+
+static bool EmitObject(Module &M, TargetMachine &TM, std::string &Object) {
+  SmallVector<char, 0> Buf;
+  raw_svector_ostream OS(Buf);
+  legacy::PassManager PM;
+  if (TM.addPassesToEmitFile(PM, OS, nullptr, CGFT_ObjectFile)) {
+    LogError("The target can't emit object files");
+    return false;
+  }
+  PM.run(M);
+  Object.assign(Buf.begin(), Buf.end());
+  return true;
+}
+
+// Summarize a function of a file for the build's thin link. Calls to the
+// prelude are pure and not listed.
+static FunctionSummary Summarize(llvm::Function &F,
+                                 const std::set<std::string> &PreludeNames,
+                                 const std::set<std::string> &BuildFunctions) {
+  FunctionSummary S;
+  S.Name = std::string(F.getName());
+  S.Size = F.getInstructionCount();
+  std::string IR;
+  raw_string_ostream OS(IR);
+  F.print(OS);
+  S.Hash = xxHash64(OS.str());
+
+  std::set<std::string> Callees;
+  for (auto &I : instructions(F)) {
+    if (auto *Load = dyn_cast<LoadInst>(&I)) {
+      // Host variables can change between calls.
+      if (isa<GlobalVariable>(Load->getPointerOperand()))
+        S.Pure = false;
+      continue;
+    }
+    auto *Call = dyn_cast<CallInst>(&I);
+    if (!Call || !Call->getCalledFunction() ||
+        Call->getCalledFunction()->isIntrinsic())
+      continue;
+    std::string Callee(Call->getCalledFunction()->getName());
+    if (BuildFunctions.count(Callee))
+      Callees.insert(Callee);
+    else if (!PreludeNames.count(Callee))
+      S.Pure = false; // An extern of the host.
+  }
+  S.Callees.assign(Callees.begin(), Callees.end());
+  return S;
+}
+
+bool compileToBitcode(
+    std::string_view Name, std::string_view Source,
+    const std::vector<std::pair<std::string, size_t>> &Imported,
+    std::string &Bitcode, std::vector<FunctionSummary> &Summaries) {
+  InitializeTargets();
+  auto TM = CreateObjectTargetMachine();
+  if (!TM) {
+    LogError(toString(TM.takeError()).c_str());
+    return false;
+  }
+  CodeGenContext CG;
+  std::set<std::string> PreludeFunctions, PreludeNames;
+  if (!CodegenFile(CG, Name, Source, Imported, **TM, PreludeFunctions,
+                   PreludeNames))
+    return false;
+
+  std::set<std::string> BuildFunctions;
+  for (auto &F : *CG.TheModule)
+    if (!F.isDeclaration())
+      BuildFunctions.insert(std::string(F.getName()));
+  for (auto &Fn : Imported)
+    BuildFunctions.insert(Fn.first);
+  for (auto &F : *CG.TheModule)
+    if (!F.isDeclaration())
+      Summaries.push_back(Summarize(F, PreludeNames, BuildFunctions));
+
+  if (!LinkPreludeCopies(*CG.TheModule, PreludeFunctions))
+    return false;
+  raw_string_ostream OS(Bitcode);
+  WriteBitcodeToFile(*CG.TheModule, OS);
+  OS.flush();
+  return true;
+}
+
+// Link the bodies of the functions Imports names into M as available_externally
+// copies. An imported function may call another import from a module linked
+// earlier, so modules are linked until nothing more is found.
+static Error ImportFunctions(Module &M,
+                             const std::vector<ImportedFunction> &Imports) {
+  // The names to import from each module, which is identified by its data.
+  std::map<const char *, std::pair<StringRef, std::set<std::string>>> ByModule;
+  for (auto &Import : Imports) {
+    auto &Entry = ByModule[Import.Bitcode.data()];
+    Entry.first = StringRef(Import.Bitcode.data(), Import.Bitcode.size());
+    Entry.second.insert(Import.Name);
+  }
+
+  std::set<std::string> Defined;
+  for (auto &F : M)
+    if (!F.isDeclaration())
+      Defined.insert(std::string(F.getName()));
+
+  bool Progress = true;
+  while (Progress) {
+    Progress = false;
+    for (auto &[Data, Entry] : ByModule) {
+      auto &[Bitcode, Names] = Entry;
+      bool Needed = any_of(Names, [&](const std::string &Name) {
+        auto *F = M.getFunction(Name);
+        return F && F->isDeclaration();
+      });
+      if (!Needed)
+        continue;
+      auto Src = getLazyBitcodeModule(MemoryBufferRef(Bitcode, "import"),
+                                      M.getContext());
+      if (!Src)
+        return Src.takeError();
+      (*Src)->setDataLayout(M.getDataLayout());
+      // Only the chosen bodies are read.
+      for (auto &F : **Src)
+        if (!F.isDeclaration() && !Names.count(std::string(F.getName())))
+          F.deleteBody();
+      if (Linker::linkModules(M, std::move(*Src), Linker::LinkOnlyNeeded))
+        return make_error<StringError>("Couldn't import functions",
+                                       inconvertibleErrorCode());
+      Progress = true;
+    }
+  }
+  for (auto &F : M)
+    if (!F.isDeclaration() && !Defined.count(std::string(F.getName())))
+      F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+  return Error::success();
+}
+
+bool compileBitcode(std::string_view Name, std::string_view Bitcode,
+                    const std::vector<ImportedFunction> &Imports,
+                    const std::vector<std::string> &PureFunctions,
+                    std::string &Object, const FunctionLayout &Layout) {
+  InitializeTargets();
+  auto TM = CreateObjectTargetMachine();
+  if (!TM) {
+    LogError(toString(TM.takeError()).c_str());
+    return false;
+  }
+  LLVMContext Ctx;
+  auto M = parseBitcodeFile(
+      MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()), Name), Ctx);
+  if (!M) {
+    LogError(toString(M.takeError()).c_str());
+    return false;
+  }
+  if (auto Err = ImportFunctions(**M, Imports)) {
+    LogError(toString(std::move(Err)).c_str());
+    return false;
+  }
+
+  // Imported code may call prelude functions this file didn't.
+  CodeGenContext CG;
+  std::set<std::string> PreludeFunctions;
+  if (PreludeBitcode().getBufferSize() &&
+      !DeclarePreludeProtos(CG, PreludeFunctions))
+    return false;
+  if (!LinkPreludeCopies(**M, PreludeFunctions))
+    return false;
+
+  // What the thin link learned about functions defined in other files lets
+  // the optimizer combine and hoist calls it couldn't inline.
+  for (auto &Pure : PureFunctions)
+    if (auto *F = (*M)->getFunction(Pure)) {
+      F->addFnAttr(Attribute::ReadNone);
+      F->addFnAttr(Attribute::NoUnwind);
+    }
+
+  // Sections named as the linker's default script expects, so that hot code
+  // ends up together and cold code out of its way even without the build's
+  // ordering script. Calls to cold functions also count as unlikely.
+  for (auto &Name : Layout.Hot) {
+    auto *F = (*M)->getFunction(Name);
+    if (!F || F->isDeclaration())
+      continue;
+    F->setSectionPrefix("hot");
+    F->addFnAttr(Attribute::Hot);
+  }
+  for (auto &Name : Layout.Cold) {
+    auto *F = (*M)->getFunction(Name);
+    if (!F || F->isDeclaration())
+      continue;
+    F->setSectionPrefix("unlikely");
+    F->addFnAttr(Attribute::Cold);
+    F->addFnAttr(Attribute::OptimizeForSize);
+  }
+
+  OptimizeModule(**M, TM->get());
+  return EmitObject(**M, **TM, Object);
+}
+
+std::string compilerId() {
+  return fmt::format("jlang LLVM {} {} {} function-sections prelude {:x}",
+                     LLVM_VERSION_STRING,
+                     sys::getProcessTriple(), sys::getHostCPUName().str(),
+                     xxHash64(PreludeBitcode().getBuffer()));
+}
+
+bool runExecutor(int InFd, int OutFd) {
+  using orc::SimpleRemoteEPCServer;
+  using orc::rt_bootstrap::SimpleExecutorMemoryManager;
+  auto Server =
+      SimpleRemoteEPCServer::Create<orc::FDSimpleRemoteEPCTransport>(
+          [](SimpleRemoteEPCServer::Setup &S) -> Error {
+            S.setDispatcher(
+                std::make_unique<SimpleRemoteEPCServer::ThreadDispatcher>());
+            S.bootstrapSymbols() =
+                SimpleRemoteEPCServer::defaultBootstrapSymbols();
+            S.services().push_back(
+                std::make_unique<SimpleExecutorMemoryManager>());
+            return Error::success();
+          },
+          InFd, OutFd);
+  if (!Server) {
+    LogError(toString(Server.takeError()).c_str());
+    return false;
+  }
+  if (auto Err = (*Server)->waitForDisconnect()) {
+    LogError(toString(std::move(Err)).c_str());
+    return false;
+  }
+  return true;
+}
+
+DynamicFunction Engine::lookupDynamic(std::string_view Name) {
+  if (!PImpl->CanCallCode())
+    return {};
+  auto &FunctionProtos = PImpl->CG.FunctionProtos;
+  auto FI = FunctionProtos.find(std::string(Name));
+  if (FI == FunctionProtos.end()) {
+    LogError("Unkown function referenced!");
+    return {};
+  }
+  size_t Arity = FI->second->getArgs().size();
+  if (Arity > DynamicFunction::MaxArity) {
+    LogError("Too many arguments for a dynamic call");
+    return {};
+  }
+  return DynamicFunction(PImpl->LookupFunction(FI->first), Arity);
+}
+
+double DynamicFunction::operator()(const double *A) const {
+  using D = double;
+  switch (Arity) {
+  case 0:
+    return reinterpret_cast<D (*)()>(Addr)();
+  case 1:
+    return reinterpret_cast<D (*)(D)>(Addr)(A[0]);
+  case 2:
+    return reinterpret_cast<D (*)(D, D)>(Addr)(A[0], A[1]);
+  case 3:
+    return reinterpret_cast<D (*)(D, D, D)>(Addr)(A[0], A[1], A[2]);
+  case 4:
+    return reinterpret_cast<D (*)(D, D, D, D)>(Addr)(A[0], A[1], A[2], A[3]);
+  case 5:
+    return reinterpret_cast<D (*)(D, D, D, D, D)>(Addr)(A[0], A[1], A[2],
+                                                         A[3], A[4]);
+  case 6:
+    return reinterpret_cast<D (*)(D, D, D, D, D, D)>(Addr)(A[0], A[1], A[2],
+                                                            A[3], A[4], A[5]);
+  case 7:
+    return reinterpret_cast<D (*)(D, D, D, D, D, D, D)>(Addr)(
+        A[0], A[1], A[2], A[3], A[4], A[5], A[6]);
+  case 8:
+    return reinterpret_cast<D (*)(D, D, D, D, D, D, D, D)>(Addr)(
+        A[0], A[1], A[2], A[3], A[4], A[5], A[6], A[7]);
+  }
+  llvm_unreachable("arity checked by lookupDynamic");
+}
+
+bool Engine::bind(std::string_view Name, const double *Addr) {
+  std::string Key(Name);
+  if (PImpl->Bindings.count(Key)) {
+    LogError("Variable is already bound");
+    return false;
+  }
+  if (PImpl->Remote) {
+    LogError("Host variables can't be bound in an executor process");
+    return false;
+  }
+
+  if (auto &J = PImpl->TheJIT) {
+    auto Err = J->getMainJITDylib().define(orc::absoluteSymbols(
+        {{J->mangleAndIntern(Key),
+          JITEvaluatedSymbol(pointerToJITTargetAddress(Addr),
+                             JITSymbolFlags::Exported)}}));
+    if (Err) {
+      LogError(toString(std::move(Err)).c_str());
+      return false;
+    }
+  }
+  PImpl->Bindings[Key] = Addr;
+  return true;
+}
+
+ExprCacheStats Engine::exprCacheStats() const { return PImpl->Cache.Stats; }
+
+CodeRegionStats Engine::codeRegionStats() const {
+  return PImpl->Region ? PImpl->Region->stats() : CodeRegionStats();
+}
+
+std::size_t Engine::placeHotCode() { return PImpl->PlaceHotCode(); }
+
+EngineStats Engine::stats() const {
+  EngineStats S = PImpl->P.Stats;
+  auto &C = PImpl->Counters;
+  S.DefinitionsCompiled = PImpl->Compiled.DefinitionsCompiled;
+  S.DefinitionsRecompiled = PImpl->Compiled.DefinitionsRecompiled;
+  S.DefinitionsPromoted = PImpl->Compiled.DefinitionsPromoted;
+  S.ExpressionsCompiled = PImpl->Compiled.ExpressionsCompiled;
+  S.ExpressionsCached = PImpl->Cache.Stats.Hits;
+  S.ModulesOptimized = C.Modules;
+  S.InstructionsBeforeOpt = C.InstructionsBefore;
+  S.InstructionsAfterOpt = C.InstructionsAfter;
+  S.ObjectsLinked = C.Objects;
+  S.CodeBytes = C.CodeBytes;
+  S.DataBytes = C.DataBytes;
+  return S;
+}
+
+// The counters of S by the names text and json give them.
+static std::vector<std::pair<const char *, std::uint64_t>>
+StatFields(const EngineStats &S) {
+  return {{"tokens", S.Tokens},
+          {"identifiers", S.Identifiers},
+          {"ast_numbers", S.NumberNodes},
+          {"ast_variables", S.VariableNodes},
+          {"ast_binary_ops", S.BinaryNodes},
+          {"ast_calls", S.CallNodes},
+          {"ast_prototypes", S.PrototypeNodes},
+          {"ast_functions", S.FunctionNodes},
+          {"definitions_compiled", S.DefinitionsCompiled},
+          {"definitions_recompiled", S.DefinitionsRecompiled},
+          {"definitions_promoted", S.DefinitionsPromoted},
+          {"expressions_compiled", S.ExpressionsCompiled},
+          {"expressions_cached", S.ExpressionsCached},
+          {"modules_optimized", S.ModulesOptimized},
+          {"ir_instructions_before_opt", S.InstructionsBeforeOpt},
+          {"ir_instructions_after_opt", S.InstructionsAfterOpt},
+          {"objects_linked", S.ObjectsLinked},
+          {"jit_code_bytes", S.CodeBytes},
+          {"jit_data_bytes", S.DataBytes}};
+}
+
+std::string EngineStats::text() const {
+  std::string Out;
+  for (auto &[Name, Value] : StatFields(*this))
+    Out += fmt::format("{:<28} {}\n", Name, Value);
+  return Out;
+}
+
+std::string EngineStats::json() const {
+  std::string Out = "{";
+  for (auto &[Name, Value] : StatFields(*this))
+    Out += fmt::format("{}\"{}\": {}", Out.size() > 1 ? ", " : "", Name,
+                       Value);
+  return Out + "}";
+}
+
+EngineMemory Engine::memory() const {
+  EngineMemory M;
+  M.Definitions = PImpl->FunctionDefs.size();
+  M.CachedExpressions = PImpl->Cache.size();
+  {
+    std::lock_guard<std::mutex> Lock(PImpl->ObjectsMutex);
+    for (auto &[Name, Code] : PImpl->Objects)
+      M.ObjectCopyBytes += Code.Buffer->getBufferSize();
+  }
+  std::lock_guard<std::mutex> Lock(PImpl->IRMutex);
+  for (auto &[Name, IR] : PImpl->OptimizedIR)
+    M.OptimizedIRBytes += IR.size();
+  return M;
+}
+
+std::vector<Remark> Engine::remarks(std::string_view Name) const {
+  std::lock_guard<std::mutex> Lock(PImpl->RemarksMutex);
+  auto It = PImpl->Remarks.find(std::string(Name));
+  return It == PImpl->Remarks.end() ? std::vector<Remark>() : It->second;
+}
+
+std::vector<Remark> Engine::explain(std::string_view Name) {
+  if (PImpl->Interpret) {
+    LogError("The interpreter doesn't optimize");
+    return {};
+  }
+  auto Def = PImpl->FunctionDefs.find(std::string(Name));
+  if (Def == PImpl->FunctionDefs.end()) {
+    LogError("Unkown function referenced!");
+    return {};
+  }
+  bool Collecting = std::exchange(PImpl->CollectRemarks, true);
+  PImpl->CG.DebugInfo = true;
+  bool Compiled = PImpl->CompileDefinition(*Def->second, /*Echo=*/false);
+  PImpl->CollectRemarks = PImpl->CG.DebugInfo = Collecting;
+  return Compiled ? remarks(Name) : std::vector<Remark>();
+}
+
+bool Engine::writeRemarks(const std::string &Path) const {
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+  if (EC)
+    return false;
+  auto Serializer = remarks::createRemarkSerializer(
+      remarks::Format::YAML, remarks::SerializerMode::Separate, OS);
+  if (!Serializer) {
+    consumeError(Serializer.takeError());
+    return false;
+  }
+  std::lock_guard<std::mutex> Lock(PImpl->RemarksMutex);
+  for (auto &[Name, List] : PImpl->Remarks) {
+    for (const Remark &R : List) {
+      remarks::Remark Out;
+      Out.RemarkType = StringSwitch<remarks::Type>(R.Kind)
+                           .Case("Passed", remarks::Type::Passed)
+                           .Case("Missed", remarks::Type::Missed)
+                           .Case("Analysis", remarks::Type::Analysis)
+                           .Default(remarks::Type::Failure);
+      Out.PassName = R.Pass;
+      Out.RemarkName = R.Name;
+      Out.FunctionName = R.Function;
+      if (R.Line)
+        Out.Loc = remarks::RemarkLocation{R.File, R.Line, R.Column};
+      for (auto &[Key, Val] : R.Args) {
+        Out.Args.emplace_back();
+        Out.Args.back().Key = Key;
+        Out.Args.back().Val = Val;
+      }
+      (*Serializer)->emit(Out);
+    }
+  }
+  return !OS.has_error();
+}
+
+std::string Engine::optimizedIR(std::string_view Name) const {
+  std::lock_guard<std::mutex> Lock(PImpl->IRMutex);
+  auto It = PImpl->OptimizedIR.find(std::string(Name));
+  return It == PImpl->OptimizedIR.end() ? "" : It->second;
+}
+
+bool Engine::evaluate(std::string_view Name,
+                      const std::vector<const double *> &Columns, double *Out,
+                      size_t N) {
+  auto Def = PImpl->FunctionDefs.find(std::string(Name));
+  if (Def == PImpl->FunctionDefs.end()) {
+    LogError("Unkown function referenced!");
+    return false;
+  }
+  return EvalBatch(PImpl->FunctionDefs, PImpl->CG.FunctionProtos,
+                   PImpl->Bindings, *Def->second, Columns, Out, N);
+}
+
+Expr::Expr(std::unique_ptr<ExprAST> Node) : Node(std::move(Node)) {}
+Expr::Expr(Expr &&) noexcept = default;
+Expr &Expr::operator=(Expr &&) noexcept = default;
+Expr::~Expr() = default;
+
+Function::Function(std::unique_ptr<FunctionAST> Node) : Node(std::move(Node)) {}
+Function::Function(Function &&) noexcept = default;
+Function &Function::operator=(Function &&) noexcept = default;
+Function::~Function() = default;
+
+bool Builder::valid(const Expr &E) {
+  if (E.Node)
+    return true;
+  if (!E.Failed)
+    LogError("Expected an expression; an Expr can only be used once");
+  return false;
+}
+
+Expr Builder::failed() {
+  Expr E(nullptr);
+  E.Failed = true;
+  return E;
+}
+
+Expr Builder::num(double Val) {
+  return Expr(std::make_unique<NumberExprAST>(Val));
+}
+
+Expr Builder::var(std::string_view Name) {
+  return Expr(std::make_unique<VariableExprAST>(std::string(Name)));
+}
+
+Expr Builder::binary(char Op, Expr LHS, Expr RHS) {
+  // The operators the parser knows.
+  if (Op != '+' && Op != '-' && Op != '*' && Op != '<') {
+    LogError(fmt::format("invalid binary operator '{}'", Op).c_str());
+    return failed();
+  }
+  bool Valid = valid(LHS);
+  if (!valid(RHS) || !Valid)
+    return failed();
+  return Expr(std::make_unique<BinaryExprAST>(Op, std::move(LHS.Node),
+                                              std::move(RHS.Node)));
+}
+
+Expr Builder::call(std::string_view Callee, std::vector<Expr> Args) {
+  std::vector<std::unique_ptr<ExprAST>> ArgNodes;
+  bool Valid = true;
+  for (auto &Arg : Args) {
+    Valid = valid(Arg) && Valid;
+    ArgNodes.push_back(std::move(Arg.Node));
+  }
+  if (!Valid)
+    return failed();
+  return Expr(
+      std::make_unique<CallExprAST>(std::string(Callee), std::move(ArgNodes)));
+}
+
+Function Builder::def(std::string_view Name, std::vector<std::string> Params,
+                      Expr Body) {
+  if (!valid(Body)) {
+    Function F(nullptr);
+    F.Failed = true;
+    return F;
+  }
+  auto Proto =
+      std::make_unique<PrototypeAST>(std::string(Name), std::move(Params));
+  return Function(
+      std::make_unique<FunctionAST>(std::move(Proto), std::move(Body.Node)));
+}
+
+} // namespace jlang
@@ -0,0 +1,496 @@
+#ifndef JLANG_H
+#define JLANG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+class ExprAST;
+class FunctionAST;
+
+namespace jlang {
+
+struct EngineOptions {
+  // Run code with the AST interpreter instead of the JIT, for hosts that
+  // can't map executable memory.
+  bool Interpret = false;
+  // How many compiled top-level expressions to keep for reuse. Zero disables
+  // the cache.
+  std::size_t ExprCacheSize = 256;
+  // Have Engine::run print each item and its IR as the REPL does.
+  bool Echo = true;
+  // Make compiled functions poll for Engine::cancel on entry.
+  bool Cancellable = false;
+  // Declare the functions of the standard prelude.
+  // The interpreter never has it.
+  bool Prelude = true;
+  // Run compiled code in an executor process started from this program, so
+  // that code which crashes doesn't take the compiler with it. The program is
+  // passed `filedescs=IN,OUT` and must call runExecutor with them, as jlang
+  // does; llvm-jitlink-executor works too. Code can then only be evaluated
+  // through Engine::run, and host variables can't be bound.
+  std::string Executor;
+  // Address space reserved for the code and data the JIT links in this
+  // process, backed by huge pages where available (see CodeRegionStats).
+  // Zero gives each object pages of its own instead.
+  std::size_t CodeRegionSize = std::size_t(1) << 30;
+  // Definitions start out in the cold code of the region, counting their
+  // calls, and are recompiled into the hot code once they have been called
+  // this many times, so that the code that runs most shares pages (see
+  // Engine::placeHotCode). Zero puts every definition in the hot code.
+  std::uint64_t HotCallCount = 1000;
+  // Name JIT'd functions for perf: append them to /tmp/perf-PID.map and
+  // register them with LLVM's PerfJITEventListener, which writes a jitdump
+  // for `perf inject --jit`. That listener needs LLVM's older linker, so the
+  // code region isn't used.
+  bool Perf = false;
+  // Keep frame pointers in compiled code, so that Profiler can walk the
+  // calls between jlang functions instead of seeing only the innermost.
+  bool FramePointers = false;
+  // Keep LLVM's optimization remarks about every function compiled; see
+  // Engine::remarks. Functions are then generated with line tables, which
+  // are stripped again before code generation.
+  bool Remarks = false;
+};
+
+struct ExprCacheStats {
+  std::uint64_t Hits = 0;
+  std::uint64_t Misses = 0;
+  std::uint64_t Evictions = 0;
+  // Total time from a parsed expression to callable code.
+  double HitSeconds = 0;
+  double MissSeconds = 0;
+
+  double hitRate() const {
+    return Hits + Misses ? double(Hits) / (Hits + Misses) : 0;
+  }
+};
+
+// Counters of the work an engine has done since it was created. They cost an
+// increment each, and a count of the instructions of each module the JIT
+// optimizes, so they are always on.
+struct EngineStats {
+  // Front end. Identifiers count every occurrence of a name.
+  std::uint64_t Tokens = 0;
+  std::uint64_t Identifiers = 0;
+  // AST nodes parsed, by kind.
+  std::uint64_t NumberNodes = 0;
+  std::uint64_t VariableNodes = 0;
+  std::uint64_t BinaryNodes = 0;
+  std::uint64_t CallNodes = 0;
+  std::uint64_t PrototypeNodes = 0;
+  std::uint64_t FunctionNodes = 0;
+  // Definitions compiled, including those recompiled because a function they
+  // inlined changed, which are counted again in Recompiled.
+  std::uint64_t DefinitionsCompiled = 0;
+  std::uint64_t DefinitionsRecompiled = 0;
+  // Definitions recompiled into the hot code by Engine::placeHotCode, also
+  // counted in Compiled.
+  std::uint64_t DefinitionsPromoted = 0;
+  // Top-level expressions compiled, and the ones taken from the cache.
+  std::uint64_t ExpressionsCompiled = 0;
+  std::uint64_t ExpressionsCached = 0;
+  // Modules the JIT optimized, and their IR instructions before and after.
+  std::uint64_t ModulesOptimized = 0;
+  std::uint64_t InstructionsBeforeOpt = 0;
+  std::uint64_t InstructionsAfterOpt = 0;
+  // Objects the JIT linked, and the bytes of code and data in them.
+  std::uint64_t ObjectsLinked = 0;
+  std::uint64_t CodeBytes = 0;
+  std::uint64_t DataBytes = 0;
+
+  // A line per counter, `name value`, with the names the JSON uses.
+  std::string text() const;
+  // One flat JSON object, e.g. {"tokens": 120, "identifiers": 41, ...}.
+  std::string json() const;
+};
+
+// What an engine keeps between items, besides its code (CodeRegionStats) and
+// the AST of its definitions (MemoryPhase::Parse in memory.h).
+struct EngineMemory {
+  std::size_t Definitions = 0;
+  std::size_t CachedExpressions = 0;
+  // Copies of each definition's object code, kept for Engine::save.
+  std::size_t ObjectCopyBytes = 0;
+  // Each definition's optimized IR as text, kept for optimizedIR.
+  std::size_t OptimizedIRBytes = 0;
+};
+
+// Something LLVM's optimizer did to a jlang function, or gave up on and why,
+// with the place in the jlang source it concerns.
+struct Remark {
+  // "Passed", "Missed", "Analysis" or "Failure".
+  std::string Kind;
+  // The pass and its name for the remark, such as inline and NotInlined.
+  std::string Pass;
+  std::string Name;
+  // The jlang function, "<top-level>" for an expression.
+  std::string Function;
+  // The source, and a position in it if the remark has one.
+  std::string File;
+  unsigned Line = 0;
+  unsigned Column = 0;
+  std::string Message;
+  // The named values the message is made of, for the YAML output.
+  std::vector<std::pair<std::string, std::string>> Args;
+};
+
+// Usage of the region the JIT links code into, by zone. Hot code holds the
+// definitions that have been called EngineOptions::HotCallCount times, and
+// cold code the others and the top-level expressions, which mostly run once
+// and are freed.
+struct CodeRegionStats {
+  struct Zone {
+    const char *Name = "";
+    std::size_t Size = 0;
+    // Bytes in live allocations.
+    std::size_t Used = 0;
+    // From the start of the zone to the end of its last allocation.
+    std::size_t Span = 0;
+    std::size_t Allocations = 0;
+    // Holes left below Span by freed allocations, and the largest of them.
+    std::size_t FreeBlocks = 0;
+    std::size_t LargestFree = 0;
+
+    // The share of Span lost to holes.
+    double fragmentation() const { return Span ? 1 - double(Used) / Span : 0; }
+  };
+
+  // False unless the engine JITs in process with a code region.
+  bool Enabled = false;
+  std::size_t Reserved = 0;
+  // How much of the region is mapped with transparent huge pages.
+  std::size_t HugePageBytes = 0;
+  std::vector<Zone> Zones;
+};
+
+namespace detail {
+// jlang functions take and return doubles, so only such signatures can be
+// used for the handles returned by Engine.
+template <typename Fn> struct FnTraits {
+  static constexpr bool Valid = false;
+};
+
+template <typename... Args> struct FnTraits<double(Args...)> {
+  static constexpr bool Valid = (std::is_same_v<Args, double> && ...);
+  static constexpr std::size_t Arity = sizeof...(Args);
+};
+} // namespace detail
+
+// An expression built with Builder. It owns its AST nodes and is consumed by
+// the Builder call it's passed to.
+class Expr {
+public:
+  Expr(Expr &&) noexcept;
+  Expr &operator=(Expr &&) noexcept;
+  ~Expr();
+
+private:
+  friend class Builder;
+  explicit Expr(std::unique_ptr<ExprAST> Node);
+  std::unique_ptr<ExprAST> Node;
+  // Building it failed and the error was logged. An Expr without a node that
+  // didn't fail has been moved from.
+  bool Failed = false;
+};
+
+// A function definition built with Builder, ready for Engine::compile.
+class Function {
+public:
+  Function(Function &&) noexcept;
+  Function &operator=(Function &&) noexcept;
+  ~Function();
+
+private:
+  friend class Builder;
+  friend class Engine;
+  explicit Function(std::unique_ptr<FunctionAST> Node);
+  std::unique_ptr<FunctionAST> Node;
+  bool Failed = false;
+};
+
+// Builds ASTs directly, for hosts that would otherwise print jlang source
+// only for the engine to lex and parse it again:
+//
+//   jlang::Builder B;
+//   auto F = B.def("f", {"x"}, B.add(B.var("x"), B.num(2)));
+//   auto *FP = Engine.compile<double(double)>(std::move(F));
+//
+// Errors are logged like parse errors: an unknown operator or an Expr that
+// was already used yields an empty result, which the calls building on it
+// pass along, and compile returns nullptr.
+class Builder {
+public:
+  Expr num(double Val);
+  Expr var(std::string_view Name);
+  Expr binary(char Op, Expr LHS, Expr RHS);
+  Expr add(Expr LHS, Expr RHS) {
+    return binary('+', std::move(LHS), std::move(RHS));
+  }
+  Expr sub(Expr LHS, Expr RHS) {
+    return binary('-', std::move(LHS), std::move(RHS));
+  }
+  Expr mul(Expr LHS, Expr RHS) {
+    return binary('*', std::move(LHS), std::move(RHS));
+  }
+  Expr lt(Expr LHS, Expr RHS) {
+    return binary('<', std::move(LHS), std::move(RHS));
+  }
+  Expr call(std::string_view Callee, std::vector<Expr> Args);
+  template <typename... ArgTs>
+  Expr call(std::string_view Callee, ArgTs... Args) {
+    std::vector<Expr> ArgsV;
+    (ArgsV.push_back(std::move(Args)), ...);
+    return call(Callee, std::move(ArgsV));
+  }
+  Function def(std::string_view Name, std::vector<std::string> Params,
+               Expr Body);
+
+private:
+  // Whether E holds an expression to build on. Logs why not, unless building
+  // E already did.
+  static bool valid(const Expr &E);
+  static Expr failed();
+};
+
+// A top-level expression compiled by Engine::run and handed to its evaluator
+// rather than evaluated in place. It may be called from any thread, and its
+// code stays alive for as long as the Evaluation does.
+class Evaluation {
+public:
+  // The result, or NaN if the code couldn't be run.
+  double operator()() const {
+    double Result = std::numeric_limits<double>::quiet_NaN();
+    Fn(Result);
+    return Result;
+  }
+  // Store the result in Result. Returns false, having logged why, if the code
+  // couldn't be run, as when the executor process it runs in has died.
+  bool operator()(double &Result) const { return Fn(Result); }
+
+private:
+  friend class Engine;
+  Evaluation(std::function<bool(double &)> Fn, std::shared_ptr<void> Code)
+      : Fn(std::move(Fn)), Code(std::move(Code)) {}
+
+  std::function<bool(double &)> Fn;
+  std::shared_ptr<void> Code;
+};
+
+// A compiled function whose arity is only known at run time, for hosts that
+// take signatures from their input. Empty if the lookup failed.
+class DynamicFunction {
+public:
+  static constexpr std::size_t MaxArity = 8;
+
+  DynamicFunction() = default;
+  explicit operator bool() const { return Addr; }
+  std::size_t arity() const { return Arity; }
+  // Call with arity() arguments read from Args.
+  double operator()(const double *Args) const;
+
+private:
+  friend class Engine;
+  DynamicFunction(void *Addr, std::size_t Arity) : Addr(Addr), Arity(Arity) {}
+
+  void *Addr = nullptr;
+  std::size_t Arity = 0;
+};
+
+// A compiler and JIT session. Engines share no state, so a process may run
+// many of them, each on its own thread.
+class Engine {
+public:
+  explicit Engine(EngineOptions Opts = {});
+  ~Engine();
+  Engine(const Engine &) = delete;
+  Engine &operator=(const Engine &) = delete;
+
+  // Compile every item in Source and return the last function it defines
+  // (a top-level expression counts as a nullary function). Returns nullptr if
+  // compilation fails or the function's arity doesn't match Fn.
+  template <typename Fn> Fn *compile(std::string_view Source) {
+    static_assert(detail::FnTraits<Fn>::Valid,
+                  "jlang functions take and return doubles");
+    return reinterpret_cast<Fn *>(
+        compileImpl(Source, detail::FnTraits<Fn>::Arity));
+  }
+
+  // Compile a definition made with Builder, skipping the lexer and parser.
+  template <typename Fn> Fn *compile(Function Def) {
+    static_assert(detail::FnTraits<Fn>::Valid,
+                  "jlang functions take and return doubles");
+    return reinterpret_cast<Fn *>(
+        compileImpl(std::move(Def), detail::FnTraits<Fn>::Arity));
+  }
+
+  // Find a function defined by an earlier compile or run.
+  template <typename Fn> Fn *lookup(std::string_view Name) {
+    static_assert(detail::FnTraits<Fn>::Valid,
+                  "jlang functions take and return doubles");
+    return reinterpret_cast<Fn *>(
+        lookupImpl(Name, detail::FnTraits<Fn>::Arity));
+  }
+
+  // Compile the definitions, externs and imports in Source without echoing
+  // anything. Top-level expressions are rejected, as nothing would free their
+  // code. Returns false if any item fails to compile.
+  bool define(std::string_view Source);
+
+  // Find a function of any arity up to DynamicFunction::MaxArity.
+  DynamicFunction lookupDynamic(std::string_view Name);
+
+  // Bind a variable declared with `extern var Name` to a host double. Compiled
+  // code loads it on every use, so it sees the host's current value. A name
+  // can be bound once per engine.
+  bool bind(std::string_view Name, const double *Addr);
+
+  // Evaluate the definition Name over N rows with the interpreter. Columns
+  // holds one array of N values per parameter.
+  bool evaluate(std::string_view Name,
+                const std::vector<const double *> &Columns, double *Out,
+                std::size_t N);
+
+  // Statistics of the compiled top-level expression cache.
+  ExprCacheStats exprCacheStats() const;
+
+  // Usage and fragmentation of the region compiled code is placed in.
+  CodeRegionStats codeRegionStats() const;
+
+  // Recompile the definitions called EngineOptions::HotCallCount times into
+  // the hot code of the region. Their old code is freed, so no thread may be
+  // running it. Defining a function does this first, as does run after each
+  // expression it evaluates itself. Returns how many were moved.
+  std::size_t placeHotCode();
+
+  // What the engine has compiled so far.
+  EngineStats stats() const;
+
+  // What the engine holds on to.
+  EngineMemory memory() const;
+
+  // The IR of the definition Name as the JIT optimized it, or an empty string
+  // if it hasn't been compiled yet or came from a snapshot.
+  std::string optimizedIR(std::string_view Name) const;
+
+  // The remarks the optimizer made on the latest compile of Name, with
+  // EngineOptions::Remarks set. "<top-level>" has the last expression's.
+  std::vector<Remark> remarks(std::string_view Name) const;
+  // Compile the definition Name again with remarks on, and return them.
+  std::vector<Remark> explain(std::string_view Name);
+  // Write every function's remarks to Path as LLVM's YAML remarks, which
+  // opt-viewer reads. Returns false if the file can't be written.
+  bool writeRemarks(const std::string &Path) const;
+
+  // Run each item in Source the way the REPL does: echo its IR and evaluate
+  // top-level expressions.
+  void run(std::string_view Source);
+
+  // Like run, but pass top-level expressions to Evaluate instead of running
+  // them, so the caller can evaluate them elsewhere.
+  void run(std::string_view Source,
+           const std::function<void(Evaluation)> &Evaluate);
+
+  // Make running evaluations return NaN at their next function entry; needs
+  // EngineOptions::Cancellable. Safe to call from a signal handler. The flag
+  // stays set until resetCancel.
+  void cancel();
+  bool cancelled() const;
+  void resetCancel();
+
+  // Write every extern and definition, with the compiled code of each body,
+  // to a snapshot at Path. Needs an engine that runs code in this process.
+  bool save(const std::string &Path);
+  // Load a snapshot written by save into an engine that has defined nothing
+  // yet. Bodies are linked on their first call; nothing is reparsed or
+  // recompiled. Host variables have to be bound again.
+  bool restore(const std::string &Path);
+
+private:
+  void *compileImpl(std::string_view Source, std::size_t Arity);
+  void *compileImpl(Function Def, std::size_t Arity);
+  void *lookupImpl(std::string_view Name, std::size_t Arity);
+
+  class Impl;
+  std::unique_ptr<Impl> PImpl;
+};
+
+// What a file imports and defines, for the build driver.
+struct FileInterface {
+  // The files named by the file's import items, as written.
+  std::vector<std::string> Imports;
+  // Each function the file defines, with its arity.
+  std::vector<std::pair<std::string, std::size_t>> Functions;
+  // Each function defined with `export def`, with its parameter names.
+  std::vector<std::pair<std::string, std::vector<std::string>>> Exports;
+};
+
+// Parse Source for its imports and definitions without compiling anything.
+bool scanFile(std::string_view Source, FileInterface &Interface);
+
+// What the build's thin link needs to know about a function to decide
+// whether to import it into the files that call it.
+struct FunctionSummary {
+  std::string Name;
+  // Instructions before optimization.
+  std::size_t Size = 0;
+  // Changes whenever the function's code does.
+  std::uint64_t Hash = 0;
+  // The functions of the build it calls, including those of its own file.
+  std::vector<std::string> Callees;
+  // False if it reads host variables or calls a host function. It is only
+  // pure if its callees are too.
+  bool Pure = true;
+};
+
+// Compile the definitions and externs in Source, a file called Name, to
+// unoptimized bitcode and summarize each function. Imported lists the functions
+// defined by the files it imports, which it calls as external symbols.
+// Top-level expressions aren't allowed. Safe to call from several threads at
+// once.
+bool compileToBitcode(
+    std::string_view Name, std::string_view Source,
+    const std::vector<std::pair<std::string, std::size_t>> &Imported,
+    std::string &Bitcode, std::vector<FunctionSummary> &Summaries);
+
+// A function to copy out of the bitcode of another file so that it can be
+// inlined.
+struct ImportedFunction {
+  std::string_view Bitcode;
+  std::string Name;
+};
+
+// Where a profile says the functions of a file should go.
+struct FunctionLayout {
+  // Optimized for speed and placed in .text.hot sections.
+  std::vector<std::string> Hot;
+  // Optimized for size and placed in .text.unlikely sections.
+  std::vector<std::string> Cold;
+};
+
+// Optimize bitcode from compileToBitcode to a relocatable object for this
+// host, with Imports available for inlining and PureFunctions, which are
+// defined in other files, known not to touch memory. Every function gets a
+// section of its own.
+bool compileBitcode(std::string_view Name, std::string_view Bitcode,
+                    const std::vector<ImportedFunction> &Imports,
+                    const std::vector<std::string> &PureFunctions,
+                    std::string &Object, const FunctionLayout &Layout = {});
+
+// The compiler version and target, which compiled files depend on.
+std::string compilerId();
+
+// Serve compiled code to an engine whose EngineOptions::Executor started this
+// process, until the engine disconnects. Returns false on failure.
+bool runExecutor(int InFd, int OutFd);
+
+} // namespace jlang
+
+#endif // JLANG_H
@@ -0,0 +1,808 @@
+#include "build.h"
+#include "jlang.h"
+#include "memory.h"
+#include "profiler.h"
+#include "server.h"
+#include "thread_pool.h"
+#include "time_trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <fmt/format.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static void PrintCacheStats(const jlang::Engine &Engine) {
+  auto Stats = Engine.exprCacheStats();
+  auto Avg = [](double Seconds, std::uint64_t N) {
+    return N ? Seconds / N * 1e6 : 0.0;
+  };
+  fmt::print("expression cache: {} hits, {} misses, {} evictions, "
+             "{:.1f}% hit rate\n",
+             Stats.Hits, Stats.Misses, Stats.Evictions, Stats.hitRate() * 100);
+  fmt::print("average latency: {:.1f}us on hit, {:.1f}us on miss\n",
+             Avg(Stats.HitSeconds, Stats.Hits),
+             Avg(Stats.MissSeconds, Stats.Misses));
+}
+
+static void PrintCodeRegionStats(const jlang::Engine &Engine) {
+  auto Stats = Engine.codeRegionStats();
+  if (!Stats.Enabled) {
+    fmt::print("no code region: code isn't JIT'd into this process\n");
+    return;
+  }
+  auto KB = [](std::size_t Bytes) { return (Bytes + 1023) / 1024; };
+  fmt::print("code region: {} MB reserved, {} KB in huge pages\n",
+             Stats.Reserved >> 20, KB(Stats.HugePageBytes));
+  fmt::print("{:>15} {:>8} {:>8} {:>7} {:>6} {:>9} {:>6}\n", "zone",
+             "used KB", "span KB", "allocs", "holes", "max hole", "frag");
+  for (auto &Z : Stats.Zones)
+    fmt::print("{:>15} {:>8} {:>8} {:>7} {:>6} {:>9} {:>5.1f}%\n", Z.Name,
+               KB(Z.Used), KB(Z.Span), Z.Allocations, Z.FreeBlocks,
+               KB(Z.LargestFree), Z.fragmentation() * 100);
+}
+
+// Hardware counters of the calling thread from perf_event_open, counting user
+// space only, which the default perf_event_paranoid allows. Events the CPU or
+// a VM doesn't offer read as missing.
+class HardwareCounters {
+public:
+  static constexpr unsigned NumEvents = 4;
+  static constexpr const char *Names[NumEvents] = {
+      "cycles", "instructions", "branch misses", "cache misses"};
+
+  HardwareCounters() {
+    const std::uint64_t Configs[NumEvents] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+    for (unsigned I = 0; I < NumEvents; ++I) {
+      perf_event_attr Attr = {};
+      Attr.size = sizeof(Attr);
+      Attr.type = PERF_TYPE_HARDWARE;
+      Attr.config = Configs[I];
+      Attr.disabled = 1;
+      Attr.exclude_kernel = 1;
+      Attr.exclude_hv = 1;
+      Attr.read_format =
+          PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      Fds[I] = syscall(SYS_perf_event_open, &Attr, 0, -1, -1, 0);
+      if (Fds[I] < 0 && Error.empty())
+        Error = std::strerror(errno);
+    }
+  }
+  ~HardwareCounters() {
+    for (int Fd : Fds)
+      if (Fd >= 0)
+        close(Fd);
+  }
+
+  // Why the first event that failed to open did, if any did.
+  const std::string &error() const { return Error; }
+
+  void start() {
+    for (int Fd : Fds)
+      if (Fd >= 0) {
+        ioctl(Fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(Fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+  }
+  void stop() {
+    for (int Fd : Fds)
+      if (Fd >= 0)
+        ioctl(Fd, PERF_EVENT_IOC_DISABLE, 0);
+  }
+
+  // The count of event I since start, scaled up if the kernel had to share
+  // the hardware with other events, or a negative number if it isn't there.
+  double read(unsigned I) const {
+    std::uint64_t Values[3];
+    if (Fds[I] < 0 ||
+        ::read(Fds[I], Values, sizeof(Values)) != sizeof(Values) || !Values[2])
+      return -1;
+    return double(Values[0]) * Values[1] / Values[2];
+  }
+
+private:
+  int Fds[NumEvents];
+  std::string Error;
+};
+
+// Parse `f(1.5, 2)` into the function and its arguments.
+static bool ParseBenchCall(const std::string &Call, std::string &Name,
+                           std::vector<double> &Args) {
+  auto Open = Call.find('(');
+  auto Close = Call.rfind(')');
+  if (Open == std::string::npos || Close == std::string::npos ||
+      Close < Open || Call.find_first_not_of(" \t", Close + 1) !=
+                          std::string::npos)
+    return false;
+  auto First = Call.find_first_not_of(" \t");
+  auto Last = Call.find_last_not_of(" \t", Open - 1);
+  if (First >= Open || Last == std::string::npos)
+    return false;
+  Name = Call.substr(First, Last - First + 1);
+  std::string List = Call.substr(Open + 1, Close - Open - 1);
+  if (List.find_first_not_of(" \t") == std::string::npos)
+    return true;
+  for (std::size_t Pos = 0;;) {
+    auto Comma = List.find(',', Pos);
+    std::string Arg = List.substr(Pos, Comma - Pos);
+    char *End;
+    double Value = std::strtod(Arg.c_str(), &End);
+    if (End == Arg.c_str() ||
+        std::string(End).find_first_not_of(" \t") != std::string::npos)
+      return false;
+    Args.push_back(Value);
+    if (Comma == std::string::npos)
+      return true;
+    Pos = Comma + 1;
+  }
+}
+
+// :bench f(1.5, 2) calls f in a loop long enough to time, after warming up,
+// and reports the time and hardware counters per call and f's optimized IR.
+// Calls go through the stub every call to f goes through, with the arguments
+// passed as they are to a DynamicFunction.
+static void RunBench(jlang::Engine &Engine, const std::string &Call) {
+  std::string Name;
+  std::vector<double> Args;
+  if (!ParseBenchCall(Call, Name, Args)) {
+    fmt::print("Usage: :bench f(1.5, 2)\n");
+    return;
+  }
+  jlang::DynamicFunction Fn = Engine.lookupDynamic(Name);
+  if (!Fn)
+    return;
+  if (Args.size() != Fn.arity()) {
+    fmt::print("{} takes {} arguments\n", Name, Fn.arity());
+    return;
+  }
+
+  using Clock = std::chrono::steady_clock;
+  volatile double Sink;
+  auto RunBatch = [&](std::uint64_t Calls) {
+    auto Start = Clock::now();
+    for (std::uint64_t I = 0; I < Calls; ++I)
+      Sink = Fn(Args.data());
+    return std::chrono::duration<double, std::nano>(Clock::now() - Start)
+        .count();
+  };
+  // Double the batch until it takes 10ms, which also warms up the caches,
+  // the branch predictors and lazily linked bodies.
+  std::uint64_t Calls = 1;
+  while (RunBatch(Calls) < 1e7 && Calls < (std::uint64_t(1) << 40))
+    Calls *= 2;
+
+  constexpr unsigned Rounds = 10;
+  std::vector<double> NsPerCall;
+  HardwareCounters Counters;
+  Counters.start();
+  for (unsigned R = 0; R < Rounds; ++R)
+    NsPerCall.push_back(RunBatch(Calls) / Calls);
+  Counters.stop();
+  (void)Sink;
+
+  std::sort(NsPerCall.begin(), NsPerCall.end());
+  fmt::print("{}: {:.2f} ns/call, min {:.2f}, over {} rounds of {} calls\n",
+             Call, NsPerCall[Rounds / 2], NsPerCall[0], Rounds, Calls);
+  double PerCall[HardwareCounters::NumEvents];
+  for (unsigned I = 0; I < HardwareCounters::NumEvents; ++I)
+    PerCall[I] = Counters.read(I) / (double(Calls) * Rounds);
+  if (PerCall[0] < 0 && PerCall[1] < 0) {
+    fmt::print("hardware counters unavailable: {}\n", Counters.error());
+  } else {
+    for (unsigned I = 0; I < HardwareCounters::NumEvents; ++I)
+      if (PerCall[I] >= 0)
+        fmt::print("{:>15}: {:.2f}/call\n", HardwareCounters::Names[I],
+                   PerCall[I]);
+    if (PerCall[0] > 0 && PerCall[1] >= 0)
+      fmt::print("{:>15}: {:.2f}\n", "IPC", PerCall[1] / PerCall[0]);
+  }
+
+  std::string IR = Engine.optimizedIR(Name);
+  if (IR.empty())
+    fmt::print("no IR kept for {}\n", Name);
+  else
+    fmt::print("{}\n", IR);
+}
+
+// Where memory goes: the heap by phase of compilation, what the engine keeps
+// and its code.
+static void PrintMemory(std::FILE *Out, const jlang::Engine &Engine) {
+  auto MB = [](std::uint64_t Bytes) { return Bytes / double(1 << 20); };
+  auto KB = [](std::uint64_t Bytes) { return (Bytes + 1023) / 1024; };
+  jlang::MemoryUsage Usage = jlang::memoryUsage();
+  fmt::print(Out, "RSS {:.1f} MB, peak {:.1f} MB\n", MB(Usage.RSS),
+             MB(Usage.PeakRSS));
+  if (Usage.Tracked) {
+    fmt::print(Out, "heap {:.1f} MB live, peak {:.1f} MB\n", MB(Usage.HeapLive),
+               MB(Usage.HeapPeak));
+    fmt::print(Out, "{:>10} {:>13} {:>10} {:>10}\n", "phase", "allocated MB",
+               "blocks", "live KB");
+    for (auto &P : Usage.Phases)
+      fmt::print(Out, "{:>10} {:>13.1f} {:>10} {:>10}\n", P.Name,
+                 MB(P.Allocated), P.Allocations, KB(P.Live));
+  } else {
+    fmt::print(Out, "heap not tracked: operator new isn't hooked\n");
+  }
+  jlang::EngineMemory Held = Engine.memory();
+  fmt::print(Out,
+             "engine: {} definitions, {} cached expressions, {} KB of object "
+             "code copies, {} KB of optimized IR\n",
+             Held.Definitions, Held.CachedExpressions,
+             KB(Held.ObjectCopyBytes), KB(Held.OptimizedIRBytes));
+  auto Region = Engine.codeRegionStats();
+  std::size_t Used = 0, Allocations = 0;
+  for (auto &Z : Region.Zones) {
+    Used += Z.Used;
+    Allocations += Z.Allocations;
+  }
+  if (Region.Enabled)
+    fmt::print(Out, "code region: {} KB in {} allocations\n", KB(Used),
+               Allocations);
+}
+
+// :why f compiles f again with optimization remarks on and lists them in
+// source order: what was inlined, and what the optimizer gave up on and why.
+static void PrintRemarks(jlang::Engine &Engine, const std::string &Name) {
+  std::vector<jlang::Remark> Remarks = Engine.explain(Name);
+  if (Remarks.empty()) {
+    fmt::print("no remarks for {}\n", Name);
+    return;
+  }
+  std::stable_sort(Remarks.begin(), Remarks.end(),
+                   [](const jlang::Remark &A, const jlang::Remark &B) {
+                     return std::tie(A.Line, A.Column) <
+                            std::tie(B.Line, B.Column);
+                   });
+  for (auto &R : Remarks)
+    fmt::print("{}:{}:{}: {} [{}] {}\n", R.File, R.Line, R.Column, R.Kind,
+               R.Pass, R.Message);
+}
+
+// REPL commands start with ':' and are handled here rather than by the engine.
+static bool HandleCommand(jlang::Engine &Engine, const std::string &Line) {
+  if (Line == ":cache") {
+    PrintCacheStats(Engine);
+    return true;
+  }
+  if (Line == ":code") {
+    PrintCodeRegionStats(Engine);
+    return true;
+  }
+  if (Line == ":mem") {
+    PrintMemory(stdout, Engine);
+    return true;
+  }
+  if (Line == ":stats") {
+    fmt::print("{}", Engine.stats().text());
+    return true;
+  }
+  if (Line.rfind(":why ", 0) == 0) {
+    PrintRemarks(Engine, Line.substr(5));
+    return true;
+  }
+  if (Line.rfind(":bench ", 0) == 0) {
+    RunBench(Engine, Line.substr(7));
+    return true;
+  }
+  if (Line.rfind(":save ", 0) == 0) {
+    std::string Path = Line.substr(6);
+    if (Engine.save(Path))
+      fmt::print("Saved the session to {}\n", Path);
+    return true;
+  }
+  return false;
+}
+
+// Compiles input on a background thread and evaluates top-level expressions on
+// a pool, so the prompt comes back at once however slow the last input was.
+// Results are printed in the order their input was submitted.
+class AsyncRepl {
+public:
+  AsyncRepl(jlang::Engine &Engine, unsigned NumWorkers)
+      : Engine(Engine), Evaluators(NumWorkers),
+        Compiler([this] {
+          jlang::TimeTraceThread Trace;
+          compileLoop();
+        }), Printer([this] { printLoop(); }) {
+  }
+
+  ~AsyncRepl() { finish(); }
+
+  // Compile what is left of the input and wait for every result to be
+  // printed. Evaluations that never return keep it waiting until they are
+  // interrupted.
+  void finish() {
+    if (!Compiler.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> Lock(InputMutex);
+      InputDone = true;
+    }
+    InputCV.notify_one();
+    Compiler.join();
+    Printer.join();
+  }
+
+  void submit(std::string Line) {
+    {
+      std::lock_guard<std::mutex> Lock(InputMutex);
+      Input.push_back(std::move(Line));
+    }
+    InputCV.notify_one();
+  }
+
+  // Cancel the evaluations in flight, if there are any. Called from the SIGINT
+  // handler.
+  void interrupt() {
+    if (Running.load() > 0)
+      Engine.cancel();
+  }
+
+private:
+  struct Result {
+    double Value;
+    bool Cancelled;
+    // The error has been logged and there's no value to print.
+    bool Failed;
+  };
+
+  // Whether compiling Line may free code that an evaluation is running:
+  // definitions replace old bodies, and commands may recompile or restore
+  // them. Errs on the side of yes, which only costs overlap.
+  static bool mayFreeCode(const std::string &Line) {
+    return (!Line.empty() && Line[0] == ':') ||
+           Line.find("def") != std::string::npos ||
+           Line.find("import") != std::string::npos;
+  }
+
+  Result evaluate(const jlang::Evaluation &E) {
+    std::shared_lock<std::shared_mutex> Lock(EngineMutex);
+    ++Running;
+    Result R{0, false, false};
+    R.Failed = !E(R.Value);
+    R.Cancelled = Engine.cancelled();
+    if (--Running == 0)
+      Engine.resetCancel();
+    return R;
+  }
+
+  void compileLoop() {
+    while (true) {
+      std::string Line;
+      {
+        std::unique_lock<std::mutex> Lock(InputMutex);
+        InputCV.wait(Lock, [this] { return InputDone || !Input.empty(); });
+        if (Input.empty())
+          break;
+        Line = std::move(Input.front());
+        Input.pop_front();
+      }
+
+      std::vector<std::future<Result>> Results;
+      std::unique_lock<std::shared_mutex> Exclusive(EngineMutex,
+                                                    std::defer_lock);
+      if (mayFreeCode(Line))
+        Exclusive.lock();
+      if (!Line.empty() && Line[0] == ':') {
+        if (!HandleCommand(Engine, Line))
+          fmt::print("Unknown command: {}\n", Line);
+      } else {
+        Engine.run(Line, [&](jlang::Evaluation E) {
+          auto Task = std::make_shared<std::packaged_task<Result()>>(
+              [this, E = std::move(E)] { return evaluate(E); });
+          Results.push_back(Task->get_future());
+          Evaluators.submit([Task] { (*Task)(); });
+        });
+      }
+      if (Exclusive)
+        Exclusive.unlock();
+
+      {
+        std::lock_guard<std::mutex> Lock(OutputMutex);
+        Output.push_back(std::move(Results));
+      }
+      OutputCV.notify_one();
+    }
+
+    {
+      std::lock_guard<std::mutex> Lock(OutputMutex);
+      OutputDone = true;
+    }
+    OutputCV.notify_one();
+  }
+
+  void printLoop() {
+    while (true) {
+      std::vector<std::future<Result>> Results;
+      {
+        std::unique_lock<std::mutex> Lock(OutputMutex);
+        OutputCV.wait(Lock, [this] { return OutputDone || !Output.empty(); });
+        if (Output.empty())
+          return;
+        Results = std::move(Output.front());
+        Output.pop_front();
+      }
+
+      for (auto &F : Results) {
+        Result R = F.get();
+        if (R.Failed)
+          continue;
+        if (R.Cancelled)
+          fmt::print("Evaluation cancelled\n");
+        else
+          fmt::print("Evaluated to {}\n", R.Value);
+      }
+    }
+  }
+
+  jlang::Engine &Engine;
+  ThreadPool Evaluators;
+  std::atomic<unsigned> Running{0};
+  // Evaluations share the engine; compiling a line that may free code has it
+  // to itself, so no evaluation is running code that goes away.
+  std::shared_mutex EngineMutex;
+
+  // Lines waiting to be compiled.
+  std::mutex InputMutex;
+  std::condition_variable InputCV;
+  std::deque<std::string> Input;
+  bool InputDone = false;
+
+  // The pending results of each compiled line, in submission order.
+  std::mutex OutputMutex;
+  std::condition_variable OutputCV;
+  std::deque<std::vector<std::future<Result>>> Output;
+  bool OutputDone = false;
+
+  std::thread Compiler;
+  std::thread Printer;
+};
+
+static AsyncRepl *Interruptible;
+
+static void OnInterrupt(int) {
+  if (Interruptible)
+    Interruptible->interrupt();
+}
+
+static void RunAsync(jlang::Engine &Engine) {
+  AsyncRepl Repl(Engine, std::max(1u, std::thread::hardware_concurrency()));
+  Interruptible = &Repl;
+  std::signal(SIGINT, OnInterrupt);
+
+  std::string Line;
+  while (true) {
+    fmt::print("Jlang>");
+    std::fflush(stdout);
+    if (!std::getline(std::cin, Line))
+      break;
+    // Handled here, as the compiler may be waiting for the evaluations to
+    // finish.
+    if (Line == ":cancel")
+      Repl.interrupt();
+    else
+      Repl.submit(std::move(Line));
+  }
+
+  // Ctrl-C still cancels the evaluations waited for at the end of input.
+  Repl.finish();
+  std::signal(SIGINT, SIG_DFL);
+  Interruptible = nullptr;
+}
+
+// Profiles the session with --profile, and at its end prints a flat profile
+// and the call tree to stderr, or writes collapsed stacks to StacksPath.
+class ProfileSession {
+public:
+  ProfileSession(bool Enabled, const char *StacksPath)
+      : Enabled(Enabled), StacksPath(StacksPath) {
+    if (Enabled && !Prof.start())
+      fmt::print(stderr, "Can't start the profiler\n");
+  }
+  ~ProfileSession() {
+    if (!Enabled)
+      return;
+    Prof.stop();
+    if (!StacksPath) {
+      fmt::print(stderr, "{}\n{}", Prof.flatReport(), Prof.treeReport());
+      return;
+    }
+    std::ofstream Out(StacksPath);
+    Out << Prof.collapsedStacks();
+    if (!Out)
+      fmt::print(stderr, "Can't write {}\n", StacksPath);
+  }
+
+private:
+  jlang::Profiler Prof;
+  bool Enabled;
+  const char *StacksPath;
+};
+
+// Reports the engine's counters when the session ends: as text on stderr
+// with --stats, and as JSON to JsonPath with --stats-json. With --mem-report
+// it prints where memory went first.
+class StatsReport {
+public:
+  StatsReport(const jlang::Engine &Engine, bool Text, const char *JsonPath,
+              bool Memory)
+      : Engine(Engine), Text(Text), JsonPath(JsonPath), Memory(Memory) {}
+  ~StatsReport() {
+    if (Memory)
+      PrintMemory(stderr, Engine);
+    if (!Text && !JsonPath)
+      return;
+    jlang::EngineStats Stats = Engine.stats();
+    if (Text)
+      fmt::print(stderr, "{}", Stats.text());
+    if (JsonPath) {
+      std::ofstream Out(JsonPath);
+      Out << Stats.json() << "\n";
+      if (!Out)
+        fmt::print(stderr, "Can't write {}\n", JsonPath);
+    }
+  }
+
+private:
+  const jlang::Engine &Engine;
+  bool Text;
+  const char *JsonPath;
+  bool Memory;
+};
+
+// Writes the optimization remarks of the session to Path with --remarks.
+class RemarksFile {
+public:
+  RemarksFile(const jlang::Engine &Engine, const char *Path)
+      : Engine(Engine), Path(Path) {}
+  ~RemarksFile() {
+    if (Path && !Engine.writeRemarks(Path))
+      fmt::print(stderr, "Can't write {}\n", Path);
+  }
+
+private:
+  const jlang::Engine &Engine;
+  const char *Path;
+};
+
+// Traces compile time for --time-trace and --time-report, and at the end of
+// the session writes the trace to TracePath and prints the time per phase.
+class TimeTraceSession {
+public:
+  TimeTraceSession(const char *TracePath, bool Report)
+      : TracePath(TracePath), Report(Report) {
+    if (TracePath || Report)
+      jlang::startTimeTrace();
+  }
+  ~TimeTraceSession() {
+    if (!TracePath && !Report)
+      return;
+    if (TracePath && !jlang::writeTimeTrace(TracePath))
+      fmt::print(stderr, "Can't write {}\n", TracePath);
+    if (Report)
+      PrintReport();
+    jlang::stopTimeTrace();
+  }
+
+private:
+  // Every jlang phase, then the slowest of LLVM's scopes. Phases include the
+  // ones nested in them.
+  static void PrintReport() {
+    constexpr std::size_t MaxLLVMRows = 10;
+    double Seconds = jlang::timeTraceSeconds();
+    fmt::print(stderr, "time report: {:.1f}ms traced\n", Seconds * 1e3);
+    fmt::print(stderr, "{:>32} {:>8} {:>10} {:>10} {:>6}\n", "phase", "count",
+               "total ms", "avg us", "share");
+    std::size_t LLVMRows = 0;
+    for (auto &T : jlang::timeTraceTotals()) {
+      if (T.LLVM && LLVMRows++ == 0)
+        fmt::print(stderr, "{:>32}\n", "slowest LLVM scopes:");
+      if (LLVMRows > MaxLLVMRows)
+        break;
+      fmt::print(stderr, "{:>32} {:>8} {:>10.2f} {:>10.1f} {:>5.1f}%\n",
+                 T.Name, T.Count, T.Seconds * 1e3,
+                 T.Count ? T.Seconds * 1e6 / T.Count : 0.0,
+                 Seconds > 0 ? T.Seconds / Seconds * 100 : 0.0);
+    }
+  }
+
+  const char *TracePath;
+  bool Report;
+};
+
+// jlang build [-j N] [-o OUTPUT] [--cache DIR] FILE...
+// argv[0] is the command, `build` or the program for `jlang --shared`.
+static int RunBuild(int argc, char **argv) {
+  jlang::BuildOptions Opts;
+  bool HasOutput = false;
+  for (int I = 1; I < argc; ++I) {
+    if (std::strcmp(argv[I], "--shared") == 0) {
+      Opts.Shared = true;
+    } else if (std::strcmp(argv[I], "-j") == 0 && I + 1 < argc) {
+      Opts.Jobs = std::atoi(argv[++I]);
+    } else if (std::strcmp(argv[I], "-o") == 0 && I + 1 < argc) {
+      Opts.Output = argv[++I];
+      HasOutput = true;
+    } else if (std::strcmp(argv[I], "--cache") == 0 && I + 1 < argc) {
+      Opts.CacheDir = argv[++I];
+    } else if (std::strcmp(argv[I], "--profile-use") == 0 && I + 1 < argc) {
+      Opts.Profile = argv[++I];
+    } else if (std::strcmp(argv[I], "--import-limit") == 0 && I + 1 < argc) {
+      Opts.ImportLimit = std::atoi(argv[++I]);
+    } else if (argv[I][0] == '-') {
+      fmt::print(stderr, "Unknown option: {}\n", argv[I]);
+      return 1;
+    } else {
+      Opts.Inputs.push_back(argv[I]);
+    }
+  }
+  if (Opts.Inputs.empty()) {
+    fmt::print(stderr, "usage: jlang build [--shared] [-j N] [-o OUTPUT] "
+                       "[--cache DIR] [--import-limit N] [--profile-use FILE] "
+                       "FILE...\n");
+    return 1;
+  }
+  if (Opts.Shared && !HasOutput)
+    Opts.Output = "a.so";
+  return jlang::build(Opts) ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  // Started by an engine to run its code out of process.
+  int InFd, OutFd;
+  if (argc == 2 && std::sscanf(argv[1], "filedescs=%d,%d", &InFd, &OutFd) == 2)
+    return jlang::runExecutor(InFd, OutFd) ? 0 : 1;
+
+  if (argc > 1 && std::strcmp(argv[1], "build") == 0)
+    return RunBuild(argc - 1, argv + 1);
+  if (argc > 1 && std::strcmp(argv[1], "--shared") == 0)
+    return RunBuild(argc, argv);
+
+  jlang::EngineOptions Opts;
+  bool Async = false;
+  const char *ServePath = nullptr;
+  const char *RestorePath = nullptr;
+  bool Profile = false;
+  const char *StacksPath = nullptr;
+  const char *TracePath = nullptr;
+  bool TimeReport = false;
+  bool Stats = false;
+  const char *StatsPath = nullptr;
+  bool MemReport = false;
+  const char *RemarksPath = nullptr;
+  for (int I = 1; I < argc; ++I) {
+    if (std::strcmp(argv[I], "--interpret") == 0) {
+      Opts.Interpret = true;
+    } else if (std::strcmp(argv[I], "--async") == 0) {
+      Async = true;
+    } else if (std::strcmp(argv[I], "--perf") == 0) {
+      Opts.Perf = true;
+    } else if (std::strcmp(argv[I], "--time-trace") == 0 && I + 1 < argc) {
+      TracePath = argv[++I];
+    } else if (std::strcmp(argv[I], "--remarks") == 0 && I + 1 < argc) {
+      RemarksPath = argv[++I];
+    } else if (std::strncmp(argv[I], "--remarks=", 10) == 0) {
+      RemarksPath = argv[I] + 10;
+    } else if (std::strcmp(argv[I], "--mem-report") == 0) {
+      MemReport = true;
+    } else if (std::strcmp(argv[I], "--stats") == 0) {
+      Stats = true;
+    } else if (std::strcmp(argv[I], "--stats-json") == 0 && I + 1 < argc) {
+      StatsPath = argv[++I];
+    } else if (std::strcmp(argv[I], "--time-report") == 0) {
+      TimeReport = true;
+    } else if (std::strcmp(argv[I], "--profile") == 0) {
+      Profile = true;
+    } else if (std::strcmp(argv[I], "--profile-stacks") == 0 && I + 1 < argc) {
+      Profile = true;
+      StacksPath = argv[++I];
+    } else if (std::strcmp(argv[I], "--no-prelude") == 0) {
+      Opts.Prelude = false;
+    } else if (std::strcmp(argv[I], "--hot-calls") == 0 && I + 1 < argc) {
+      Opts.HotCallCount = std::strtoull(argv[++I], nullptr, 10);
+    } else if (std::strcmp(argv[I], "--out-of-process") == 0) {
+      Opts.Executor = "/proc/self/exe";
+    } else if (std::strcmp(argv[I], "--serve") == 0 && I + 1 < argc) {
+      ServePath = argv[++I];
+    } else if (std::strcmp(argv[I], "--restore") == 0 && I + 1 < argc) {
+      RestorePath = argv[++I];
+    } else {
+      fmt::print(stderr, "Unknown option: {}\n", argv[I]);
+      return 1;
+    }
+  }
+
+  // Code in an executor process can't poll the host's cancel flag.
+  Opts.Cancellable = Async && Opts.Executor.empty();
+  Opts.FramePointers = Profile;
+  Opts.Remarks = RemarksPath;
+  TimeTraceSession Trace(TracePath, TimeReport);
+  jlang::Engine Engine(Opts);
+  StatsReport Report(Engine, Stats, StatsPath, MemReport);
+  RemarksFile Remarks(Engine, RemarksPath);
+  // Stops before the engine goes, so its teardown isn't profiled.
+  ProfileSession Session(Profile, StacksPath);
+
+  if (RestorePath) {
+    auto Start = std::chrono::steady_clock::now();
+    if (!Engine.restore(RestorePath))
+      return 1;
+    std::chrono::duration<double, std::milli> Elapsed =
+        std::chrono::steady_clock::now() - Start;
+    fmt::print(stderr, "Restored {} in {:.2f}ms\n", RestorePath,
+               Elapsed.count());
+  }
+
+  if (ServePath) {
+    unsigned Workers = std::max(1u, std::thread::hardware_concurrency());
+    return jlang::serve(Engine, ServePath, Workers) ? 0 : 1;
+  }
+
+  // The async REPL reads input a line at a time, even from a script.
+  if (Async) {
+    RunAsync(Engine);
+    return 0;
+  }
+
+  // Scripts are run as a single source so that items may span lines, except
+  // that lines starting with ':' are commands and run the source before them.
+  if (!isatty(STDIN_FILENO)) {
+    std::string Source, Line;
+    while (std::getline(std::cin, Line)) {
+      if (Line.empty() || Line[0] != ':') {
+        Source += Line;
+        Source += '\n';
+        continue;
+      }
+      if (!Source.empty())
+        Engine.run(Source);
+      Source.clear();
+      if (!HandleCommand(Engine, Line))
+        fmt::print("Unknown command: {}\n", Line);
+    }
+    if (!Source.empty())
+      Engine.run(Source);
+    return 0;
+  }
+
+  std::string Line;
+  while (true) {
+    fmt::print("Jlang>");
+    std::fflush(stdout);
+    if (!std::getline(std::cin, Line))
+      break;
+    if (!Line.empty() && Line[0] == ':') {
+      if (!HandleCommand(Engine, Line))
+        fmt::print("Unknown command: {}\n", Line);
+      continue;
+    }
+    Engine.run(Line);
+  }
+  return 0;
+}
@@ -0,0 +1,89 @@
+#include "memory.h"
+
+#include <atomic>
+#include <cstdio>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace jlang {
+namespace {
+
+// Constant-initialized, so allocations made before main are counted too.
+struct PhaseCounters {
+  std::atomic<std::uint64_t> Allocated{0};
+  std::atomic<std::uint64_t> Allocations{0};
+  std::atomic<std::uint64_t> Live{0};
+};
+
+PhaseCounters Counters[NumMemoryPhases];
+std::atomic<std::uint64_t> HeapLive{0};
+std::atomic<std::uint64_t> HeapPeak{0};
+thread_local unsigned CurrentPhase = 0;
+
+const char *const PhaseNames[NumMemoryPhases] = {
+    "other", "parse", "codegen", "optimize", "emit code", "link"};
+
+std::uint64_t ResidentBytes() {
+  long Pages = 0, Resident = 0;
+  if (FILE *Statm = std::fopen("/proc/self/statm", "r")) {
+    if (std::fscanf(Statm, "%ld %ld", &Pages, &Resident) != 2)
+      Resident = 0;
+    std::fclose(Statm);
+  }
+  return std::uint64_t(Resident) * sysconf(_SC_PAGESIZE);
+}
+
+} // namespace
+
+const char *memoryPhaseName(MemoryPhase Phase) {
+  return PhaseNames[static_cast<unsigned>(Phase)];
+}
+
+MemoryPhaseScope::MemoryPhaseScope(MemoryPhase Phase) : Saved(CurrentPhase) {
+  CurrentPhase = static_cast<unsigned>(Phase);
+}
+
+MemoryPhaseScope::~MemoryPhaseScope() { CurrentPhase = Saved; }
+
+unsigned noteAllocation(std::size_t Size) {
+  unsigned Phase = CurrentPhase;
+  PhaseCounters &C = Counters[Phase];
+  C.Allocated.fetch_add(Size, std::memory_order_relaxed);
+  C.Allocations.fetch_add(1, std::memory_order_relaxed);
+  C.Live.fetch_add(Size, std::memory_order_relaxed);
+  std::uint64_t Live =
+      HeapLive.fetch_add(Size, std::memory_order_relaxed) + Size;
+  std::uint64_t Peak = HeapPeak.load(std::memory_order_relaxed);
+  while (Live > Peak && !HeapPeak.compare_exchange_weak(
+                            Peak, Live, std::memory_order_relaxed))
+    ;
+  return Phase;
+}
+
+void noteDeallocation(unsigned Phase, std::size_t Size) {
+  Counters[Phase].Live.fetch_sub(Size, std::memory_order_relaxed);
+  HeapLive.fetch_sub(Size, std::memory_order_relaxed);
+}
+
+MemoryUsage memoryUsage() {
+  MemoryUsage Usage;
+  for (unsigned I = 0; I < NumMemoryPhases; ++I) {
+    MemoryUsage::Phase P;
+    P.Name = PhaseNames[I];
+    P.Allocated = Counters[I].Allocated;
+    P.Allocations = Counters[I].Allocations;
+    P.Live = Counters[I].Live;
+    Usage.Tracked |= P.Allocations != 0;
+    Usage.Phases.push_back(P);
+  }
+  Usage.HeapLive = HeapLive;
+  Usage.HeapPeak = HeapPeak;
+  Usage.RSS = ResidentBytes();
+  rusage Self;
+  if (getrusage(RUSAGE_SELF, &Self) == 0)
+    Usage.PeakRSS = std::uint64_t(Self.ru_maxrss) * 1024;
+  return Usage;
+}
+
+} // namespace jlang
@@ -0,0 +1,74 @@
+#ifndef JLANG_MEMORY_H
+#define JLANG_MEMORY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace jlang {
+
+// Memory accounting by phase of compilation. Each thread has a current phase,
+// set by MemoryPhaseScope, and every allocation is charged to it: the AST to
+// Parse, IR and the constants of its LLVMContext to Codegen and Optimize,
+// machine code to EmitCode, and JIT link graphs and symbol tables to Link.
+// Live bytes stay charged to the phase that allocated them until freed, so a
+// phase whose live bytes keep growing over a session is what leaks.
+//
+// Nothing is counted unless the program replaces operator new and delete with
+// the ones in alloc_hook.cpp, as jlang does.
+enum class MemoryPhase : unsigned {
+  Other,
+  Parse,
+  Codegen,
+  Optimize,
+  EmitCode,
+  Link,
+};
+constexpr unsigned NumMemoryPhases = 6;
+
+const char *memoryPhaseName(MemoryPhase Phase);
+
+// Charges the allocations of this thread to Phase while it lives.
+class MemoryPhaseScope {
+public:
+  explicit MemoryPhaseScope(MemoryPhase Phase);
+  MemoryPhaseScope(const MemoryPhaseScope &) = delete;
+  MemoryPhaseScope &operator=(const MemoryPhaseScope &) = delete;
+  ~MemoryPhaseScope();
+
+private:
+  unsigned Saved;
+};
+
+// For allocators: count an allocation of Size bytes against the current
+// phase, which is returned to be passed back when the block is freed.
+unsigned noteAllocation(std::size_t Size);
+void noteDeallocation(unsigned Phase, std::size_t Size);
+
+struct MemoryUsage {
+  struct Phase {
+    const char *Name = "";
+    // Bytes and blocks allocated in the phase since the process started.
+    std::uint64_t Allocated = 0;
+    std::uint64_t Allocations = 0;
+    // Bytes allocated in the phase and not yet freed.
+    std::uint64_t Live = 0;
+  };
+
+  // Whether operator new is counted at all. If not, only the RSS figures
+  // are filled in.
+  bool Tracked = false;
+  std::vector<Phase> Phases;
+  // Bytes allocated through operator new and not freed, now and at most.
+  std::uint64_t HeapLive = 0;
+  std::uint64_t HeapPeak = 0;
+  // Resident memory of the process, now and at most.
+  std::uint64_t RSS = 0;
+  std::uint64_t PeakRSS = 0;
+};
+
+MemoryUsage memoryUsage();
+
+} // namespace jlang
+
+#endif // JLANG_MEMORY_H
@@ -0,0 +1,113 @@
+; The standard prelude, declared in every engine. It's assembled into bitcode
+; at build time and embedded in libjlang (see the README). Functions are only
+; compiled once something calls them, and the optimizer may inline them into
+; their callers.
+;
+; Every function takes and returns doubles. Declarations are C functions that
+; jlang code can call without an extern.
+
+declare double @sin(double)
+declare double @cos(double)
+declare double @tan(double)
+declare double @asin(double)
+declare double @acos(double)
+declare double @atan(double)
+declare double @atan2(double, double)
+declare double @exp(double)
+declare double @log(double)
+declare double @log10(double)
+declare double @pow(double, double)
+declare double @sqrt(double)
+declare double @hypot(double, double)
+declare double @floor(double)
+declare double @ceil(double)
+declare double @fmod(double, double)
+
+declare double @llvm.minnum.f64(double, double)
+declare double @llvm.maxnum.f64(double, double)
+declare double @llvm.fabs.f64(double)
+declare double @llvm.copysign.f64(double, double)
+
+define double @abs(double %x) {
+  %r = call double @llvm.fabs.f64(double %x)
+  ret double %r
+}
+
+define double @min(double %a, double %b) {
+  %r = call double @llvm.minnum.f64(double %a, double %b)
+  ret double %r
+}
+
+define double @max(double %a, double %b) {
+  %r = call double @llvm.maxnum.f64(double %a, double %b)
+  ret double %r
+}
+
+; 1 for positive x, -1 for negative x, and 0 for zero.
+define double @sign(double %x) {
+  %zero = fcmp oeq double %x, 0.0
+  %one = call double @llvm.copysign.f64(double 1.0, double %x)
+  %r = select i1 %zero, double 0.0, double %one
+  ret double %r
+}
+
+; jlang has no division operator.
+define double @div(double %a, double %b) {
+  %r = fdiv double %a, %b
+  ret double %r
+}
+
+define double @clamp(double %x, double %lo, double %hi) {
+  %l = call double @max(double %x, double %lo)
+  %r = call double @min(double %l, double %hi)
+  ret double %r
+}
+
+define double @saturate(double %x) {
+  %r = call double @clamp(double %x, double 0.0, double 1.0)
+  ret double %r
+}
+
+; a at t = 0, b at t = 1.
+define double @lerp(double %a, double %b, double %t) {
+  %d = fsub double %b, %a
+  %s = fmul double %d, %t
+  %r = fadd double %a, %s
+  ret double %r
+}
+
+; The t for which lerp(a, b, t) is x.
+define double @invlerp(double %a, double %b, double %x) {
+  %n = fsub double %x, %a
+  %d = fsub double %b, %a
+  %r = fdiv double %n, %d
+  ret double %r
+}
+
+; Map x from [a, b] onto [c, d].
+define double @remap(double %x, double %a, double %b, double %c, double %d) {
+  %t = call double @invlerp(double %a, double %b, double %x)
+  %r = call double @lerp(double %c, double %d, double %t)
+  ret double %r
+}
+
+; Hermite interpolation from 0 at e0 to 1 at e1.
+define double @smoothstep(double %e0, double %e1, double %x) {
+  %u = call double @invlerp(double %e0, double %e1, double %x)
+  %t = call double @saturate(double %u)
+  %t2 = fmul double %t, %t
+  %k = fmul double %t, 2.0
+  %m = fsub double 3.0, %k
+  %r = fmul double %t2, %m
+  ret double %r
+}
+
+define double @radians(double %deg) {
+  %r = fmul double %deg, 0x3F91DF46A2529D39
+  ret double %r
+}
+
+define double @degrees(double %rad) {
+  %r = fmul double %rad, 0x404CA5DC1A63C1F8
+  ret double %r
+}
@@ -0,0 +1,348 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <set>
+
+#include <dlfcn.h>
+#include <fmt/format.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+namespace jlang {
+namespace {
+
+// Room for the samples of a run, as words; pages are only committed as
+// samples fill them.
+constexpr std::size_t BufferWords = std::size_t(1) << 22;
+// Frames recorded per sample, counting the leaf.
+constexpr unsigned MaxDepth = 128;
+
+struct JITFunction {
+  std::uint64_t End;
+  std::string Name;
+};
+
+std::mutex RegistryMutex;
+std::map<std::uint64_t, JITFunction> Registry;
+// Bounds of every function registered, which the signal handler reads to
+// stop walking once a return address leaves JIT'd code.
+std::atomic<std::uint64_t> CodeLo{std::numeric_limits<std::uint64_t>::max()};
+std::atomic<std::uint64_t> CodeHi{0};
+
+// The function Addr is in. RegistryMutex must be held.
+const std::string *FindJITFunction(std::uint64_t Addr) {
+  auto It = Registry.upper_bound(Addr);
+  if (It == Registry.begin())
+    return nullptr;
+  --It;
+  return Addr < It->second.End ? &It->second.Name : nullptr;
+}
+
+// Names native code after its library, as the frames in it can't be walked.
+std::string NativeName(std::uint64_t Addr) {
+  Dl_info Info;
+  if (!dladdr(reinterpret_cast<void *>(Addr), &Info) || !Info.dli_fname)
+    return "[unknown]";
+  const char *Slash = std::strrchr(Info.dli_fname, '/');
+  return fmt::format("[{}]", Slash ? Slash + 1 : Info.dli_fname);
+}
+
+} // namespace
+
+struct Profiler::Stack {
+  // Outermost caller first.
+  std::vector<std::string> Frames;
+  std::size_t Count;
+};
+
+// The SIGPROF handler and what it shares with Profiler::start and stop.
+struct Sampler {
+  static std::atomic<Profiler *> Active;
+  // Handlers that may still be using the active profiler.
+  static std::atomic<unsigned> InFlight;
+  static pid_t Pid;
+
+  // Read Size bytes at Addr in this process, failing instead of faulting when
+  // a stale frame pointer leads to unmapped memory.
+  static bool read(std::uint64_t Addr, void *Out, std::size_t Size) {
+    iovec Local{Out, Size};
+    iovec Remote{reinterpret_cast<void *>(Addr), Size};
+    return process_vm_readv(Pid, &Local, 1, &Remote, 1, 0) ==
+           static_cast<ssize_t>(Size);
+  }
+
+  static bool inJITCode(std::uint64_t Addr) {
+    return Addr >= CodeLo.load(std::memory_order_relaxed) &&
+           Addr < CodeHi.load(std::memory_order_relaxed);
+  }
+
+  static void onSignal(int, siginfo_t *, void *Context) {
+    int SavedErrno = errno;
+    InFlight.fetch_add(1);
+    if (Profiler *P = Active.load())
+      sample(*P, *static_cast<ucontext_t *>(Context));
+    InFlight.fetch_sub(1);
+    errno = SavedErrno;
+  }
+
+  static void sample(Profiler &P, const ucontext_t &UC) {
+    std::uint64_t PC, FP, SP;
+#if defined(__x86_64__)
+    PC = UC.uc_mcontext.gregs[REG_RIP];
+    FP = UC.uc_mcontext.gregs[REG_RBP];
+    SP = UC.uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    PC = UC.uc_mcontext.pc;
+    FP = UC.uc_mcontext.regs[29];
+    SP = UC.uc_mcontext.sp;
+#else
+    // No stacks here; the leaf is all there is.
+    PC = FP = SP = 0;
+#endif
+    std::uint64_t Frames[MaxDepth];
+    unsigned Depth = 0;
+    Frames[Depth++] = PC;
+    // Each frame starts with the caller's frame pointer and the return
+    // address. Frames only grow toward the base of the stack.
+    while (Depth < MaxDepth && FP >= SP && FP % sizeof(void *) == 0) {
+      std::uint64_t Frame[2];
+      if (!read(FP, Frame, sizeof(Frame)) || !inJITCode(Frame[1]))
+        break;
+      // Back into the call instruction, which the caller's line is at.
+      Frames[Depth++] = Frame[1] - 1;
+      if (Frame[0] <= FP)
+        break;
+      FP = Frame[0];
+    }
+    P.record(Frames, Depth);
+  }
+};
+
+std::atomic<Profiler *> Sampler::Active{nullptr};
+std::atomic<unsigned> Sampler::InFlight{0};
+pid_t Sampler::Pid = 0;
+
+void registerJITFunction(std::uint64_t Addr, std::uint64_t Size,
+                         std::string Name) {
+  if (!Size)
+    return;
+  std::uint64_t End = Addr + Size;
+  std::lock_guard<std::mutex> Lock(RegistryMutex);
+  // Drop whatever the memory held before, e.g. a freed expression.
+  auto It = Registry.lower_bound(Addr);
+  if (It != Registry.begin() && std::prev(It)->second.End > Addr)
+    --It;
+  while (It != Registry.end() && It->first < End)
+    It = Registry.erase(It);
+  Registry.emplace(Addr, JITFunction{End, std::move(Name)});
+  if (Addr < CodeLo)
+    CodeLo = Addr;
+  if (End > CodeHi)
+    CodeHi = End;
+}
+
+Profiler::~Profiler() {
+  stop();
+  if (Buffer)
+    munmap(Buffer, Capacity * sizeof(std::uint64_t));
+}
+
+bool Profiler::start(unsigned IntervalMicros) {
+  if (Running || !IntervalMicros)
+    return false;
+  if (!Buffer) {
+    void *Mem = mmap(nullptr, BufferWords * sizeof(std::uint64_t),
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (Mem == MAP_FAILED)
+      return false;
+    Buffer = static_cast<std::uint64_t *>(Mem);
+    Capacity = BufferWords;
+  }
+  Profiler *Expected = nullptr;
+  if (!Sampler::Active.compare_exchange_strong(Expected, this))
+    return false;
+  Sampler::Pid = getpid();
+
+  struct sigaction Action = {};
+  Action.sa_sigaction = Sampler::onSignal;
+  // Reads the REPL is blocked in carry on after a sample.
+  Action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&Action.sa_mask);
+  itimerval Timer = {};
+  Timer.it_interval.tv_sec = IntervalMicros / 1000000;
+  Timer.it_interval.tv_usec = IntervalMicros % 1000000;
+  Timer.it_value = Timer.it_interval;
+  if (sigaction(SIGPROF, &Action, nullptr) < 0 ||
+      setitimer(ITIMER_PROF, &Timer, nullptr) < 0) {
+    Sampler::Active = nullptr;
+    return false;
+  }
+  Interval = IntervalMicros;
+  Running = true;
+  return true;
+}
+
+void Profiler::stop() {
+  if (!Running)
+    return;
+  itimerval Timer = {};
+  setitimer(ITIMER_PROF, &Timer, nullptr);
+  // The handler stays installed: a signal still pending would otherwise kill
+  // the process. With no active profiler it does nothing.
+  Sampler::Active = nullptr;
+  while (Sampler::InFlight.load())
+    sched_yield();
+  Running = false;
+}
+
+void Profiler::record(const std::uint64_t *Frames, unsigned Depth) {
+  std::size_t Start = Used.fetch_add(Depth + 1);
+  if (Start + Depth + 1 > Capacity) {
+    ++Dropped;
+    return;
+  }
+  Buffer[Start] = Depth;
+  std::memcpy(Buffer + Start + 1, Frames, Depth * sizeof(std::uint64_t));
+}
+
+std::size_t Profiler::samples() const {
+  std::size_t N = 0;
+  std::size_t End = Buffer ? std::min(Used.load(), Capacity) : 0;
+  // A sample that didn't fit leaves its header zero.
+  for (std::size_t I = 0; I < End && Buffer[I]; I += Buffer[I] + 1)
+    ++N;
+  return N;
+}
+
+std::vector<Profiler::Stack> Profiler::stacks() const {
+  std::map<std::vector<std::string>, std::size_t> Counts;
+  std::map<std::uint64_t, std::string> Native;
+  std::lock_guard<std::mutex> Lock(RegistryMutex);
+  std::size_t End = Buffer ? std::min(Used.load(), Capacity) : 0;
+  for (std::size_t I = 0; I < End && Buffer[I]; I += Buffer[I] + 1) {
+    std::vector<std::string> Frames;
+    for (std::size_t F = 0; F < Buffer[I]; ++F) {
+      std::uint64_t Addr = Buffer[I + 1 + F];
+      if (const std::string *Name = FindJITFunction(Addr)) {
+        Frames.push_back(*Name);
+        continue;
+      }
+      // Past the leaf, only frames in jlang code are to be trusted.
+      if (F)
+        break;
+      auto It = Native.find(Addr);
+      if (It == Native.end())
+        It = Native.emplace(Addr, NativeName(Addr)).first;
+      Frames.push_back(It->second);
+    }
+    std::reverse(Frames.begin(), Frames.end());
+    ++Counts[std::move(Frames)];
+  }
+
+  std::vector<Stack> Stacks;
+  for (auto &[Frames, Count] : Counts)
+    Stacks.push_back({Frames, Count});
+  return Stacks;
+}
+
+// The share of Total that N is, in percent.
+static double Percent(std::size_t N, std::size_t Total) {
+  return Total ? 100.0 * N / Total : 0;
+}
+
+std::string Profiler::flatReport() const {
+  std::map<std::string, std::pair<std::size_t, std::size_t>> Functions;
+  std::size_t Total = 0;
+  for (const Stack &S : stacks()) {
+    Total += S.Count;
+    Functions[S.Frames.back()].first += S.Count;
+    // Recursive functions count once per sample.
+    for (const std::string &Name :
+         std::set<std::string>(S.Frames.begin(), S.Frames.end()))
+      Functions[Name].second += S.Count;
+  }
+
+  std::vector<std::pair<std::string, std::pair<std::size_t, std::size_t>>>
+      Sorted(Functions.begin(), Functions.end());
+  std::stable_sort(Sorted.begin(), Sorted.end(), [](auto &A, auto &B) {
+    return A.second > B.second;
+  });
+  std::string Out = fmt::format("{} samples every {}us", Total, Interval);
+  if (Dropped)
+    Out += fmt::format(", {} dropped", Dropped.load());
+  Out += fmt::format("\n{:>8} {:>6} {:>8} {:>6}  function\n", "self", "",
+                     "total", "");
+  for (auto &[Name, Counts] : Sorted)
+    Out += fmt::format("{:>8} {:>5.1f}% {:>8} {:>5.1f}%  {}\n", Counts.first,
+                       Percent(Counts.first, Total), Counts.second,
+                       Percent(Counts.second, Total), Name);
+  return Out;
+}
+
+namespace {
+
+struct CallNode {
+  std::size_t Count = 0;
+  std::map<std::string, CallNode> Callees;
+};
+
+// Paths under this share of the samples are left out of the tree.
+constexpr double MinTreePercent = 0.5;
+
+// Print the callees of Node, the most expensive first, and theirs under them.
+void PrintCallees(std::string &Out, const CallNode &Node, std::size_t Total,
+                  unsigned Indent) {
+  std::vector<const std::pair<const std::string, CallNode> *> Callees;
+  for (auto &Callee : Node.Callees)
+    if (Percent(Callee.second.Count, Total) >= MinTreePercent)
+      Callees.push_back(&Callee);
+  std::stable_sort(Callees.begin(), Callees.end(), [](auto *A, auto *B) {
+    return A->second.Count > B->second.Count;
+  });
+  for (auto *Callee : Callees) {
+    Out += fmt::format("{:>5.1f}% {:>8}  {:{}}{}\n",
+                       Percent(Callee->second.Count, Total),
+                       Callee->second.Count, "", Indent * 2, Callee->first);
+    PrintCallees(Out, Callee->second, Total, Indent + 1);
+  }
+}
+
+} // namespace
+
+std::string Profiler::treeReport() const {
+  CallNode Root;
+  for (const Stack &S : stacks()) {
+    Root.Count += S.Count;
+    CallNode *Node = &Root;
+    for (const std::string &Name : S.Frames) {
+      Node = &Node->Callees[Name];
+      Node->Count += S.Count;
+    }
+  }
+  std::string Out =
+      fmt::format("call tree, paths under {}% left out\n", MinTreePercent);
+  PrintCallees(Out, Root, Root.Count, 0);
+  return Out;
+}
+
+std::string Profiler::collapsedStacks() const {
+  std::string Out;
+  for (const Stack &S : stacks()) {
+    for (std::size_t I = 0; I < S.Frames.size(); ++I)
+      Out += (I ? ";" : "") + S.Frames[I];
+    Out += fmt::format(" {}\n", S.Count);
+  }
+  return Out;
+}
+
+} // namespace jlang
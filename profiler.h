@@ -0,0 +1,74 @@
+#ifndef JLANG_PROFILER_H
+#define JLANG_PROFILER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace jlang {
+
+// A sampling profiler that needs no privileges. While it runs, SIGPROF
+// interrupts the process every interval of CPU time and the handler records
+// the PC of the thread it lands on and the return addresses up its frame
+// pointer chain. Samples are named when reported: addresses in code an engine
+// linked get the jlang function they belong to, and anything else the library
+// it is in, e.g. [libm.so.6].
+//
+// Stacks are walked through jlang frames only, and need them to keep frame
+// pointers; see EngineOptions::FramePointers. One profiler runs at a time.
+class Profiler {
+public:
+  Profiler() = default;
+  Profiler(const Profiler &) = delete;
+  Profiler &operator=(const Profiler &) = delete;
+  ~Profiler();
+
+  // Start sampling every IntervalMicros of CPU time used by the process.
+  // Returns false if another profiler is running or the timer can't be set.
+  bool start(unsigned IntervalMicros = 1000);
+  // Stop sampling. The samples taken so far are kept for the reports.
+  void stop();
+
+  std::size_t samples() const;
+  // Samples that didn't fit in the buffer.
+  std::size_t dropped() const { return Dropped; }
+
+  // The functions samples landed in (self) and passed through (total), most
+  // expensive first.
+  std::string flatReport() const;
+  // The call tree, outermost callers first, with the share of samples under
+  // each call path.
+  std::string treeReport() const;
+  // A line per distinct stack, outermost caller first: `<top-level>;fib 42`.
+  // flamegraph.pl and speedscope read this.
+  std::string collapsedStacks() const;
+
+private:
+  struct Stack;
+  friend struct Sampler;
+  // Copy a stack of Depth frames, leaf first, into the buffer.
+  void record(const std::uint64_t *Frames, unsigned Depth);
+  // The distinct stacks sampled, with their frames named and cut where jlang
+  // frames end.
+  std::vector<Stack> stacks() const;
+
+  unsigned Interval = 0;
+  // Samples are a word holding the depth followed by that many frames.
+  std::uint64_t *Buffer = nullptr;
+  std::size_t Capacity = 0;
+  std::atomic<std::size_t> Used{0};
+  std::atomic<std::size_t> Dropped{0};
+  bool Running = false;
+};
+
+// Record where a function an engine linked in this process was placed, so
+// that profiles can name it. Later functions at the same addresses replace
+// it.
+void registerJITFunction(std::uint64_t Addr, std::uint64_t Size,
+                         std::string Name);
+
+} // namespace jlang
+
+#endif // JLANG_PROFILER_H
@@ -0,0 +1,369 @@
+#include "server.h"
+
+#include "jlang.h"
+#include "thread_pool.h"
+
+#include <cerrno>
+#include <csignal>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace jlang {
+namespace {
+
+// Written by the signal handler to stop the event loop.
+int StopFd = -1;
+
+void OnStopSignal(int) {
+  std::uint64_t One = 1;
+  (void)!write(StopFd, &One, sizeof(One));
+}
+
+struct Connection {
+  explicit Connection(int Fd) : Fd(Fd) {}
+
+  int Fd;
+  // Bytes read but not yet dispatched. Only touched by the event loop.
+  std::string In;
+
+  // Guards the rest, which workers touch when they respond.
+  std::mutex Mutex;
+  std::string Out;
+  bool Closed = false;
+  // Whether the event loop is waiting for the socket to become writable.
+  bool Writing = false;
+};
+
+class Server {
+public:
+  Server(Engine &E, unsigned NumWorkers) : E(E), Workers(NumWorkers) {}
+  ~Server();
+
+  bool listen(const char *Path);
+  void run();
+
+private:
+  void accept();
+  void read(const std::shared_ptr<Connection> &C);
+  void close(Connection &C);
+  void send(Connection &C, const std::string &Frame);
+  void flush(Connection &C);
+
+  std::string handle(const char *Frame, std::size_t Size);
+  std::string define(std::uint32_t Id, std::string_view Source);
+  std::string evaluate(std::uint32_t Id, const char *P, const char *End,
+                       bool Batch);
+  DynamicFunction find(std::string_view Name);
+
+  Engine &E;
+  std::string Path;
+  int ListenFd = -1;
+  int EpollFd = -1;
+  std::unordered_map<Connection *, std::shared_ptr<Connection>> Connections;
+
+  // Evaluations share the engine; a definition has it to itself, so no code
+  // is running when a redefinition frees the old body.
+  std::shared_mutex EngineMutex;
+  // Functions looked up so far. Their addresses are those of stubs, which a
+  // redefinition repoints, and redefinitions keep the arity.
+  std::mutex FunctionsMutex;
+  std::unordered_map<std::string, DynamicFunction> Functions;
+
+  // Last, so that it finishes queued requests before the rest is destroyed.
+  ThreadPool Workers;
+};
+
+std::string ErrorFrame(std::uint32_t Id, std::string_view Message) {
+  std::string Frame;
+  appendFrameHeader(Frame, Id, std::uint8_t(ResponseStatus::Error),
+                    Message.size());
+  Frame.append(Message);
+  return Frame;
+}
+
+Server::~Server() {
+  if (ListenFd >= 0) {
+    ::close(ListenFd);
+    unlink(Path.c_str());
+  }
+  auto Open = std::move(Connections);
+  for (auto &[Ptr, C] : Open)
+    close(*C);
+  if (EpollFd >= 0)
+    ::close(EpollFd);
+}
+
+bool Server::listen(const char *SocketPath) {
+  sockaddr_un Addr = {};
+  Addr.sun_family = AF_UNIX;
+  if (std::strlen(SocketPath) >= sizeof(Addr.sun_path)) {
+    fmt::print(stderr, "Socket path is too long: {}\n", SocketPath);
+    return false;
+  }
+  std::strcpy(Addr.sun_path, SocketPath);
+
+  // A socket left behind by a server that didn't exit cleanly.
+  struct stat St;
+  if (stat(SocketPath, &St) == 0 && S_ISSOCK(St.st_mode))
+    unlink(SocketPath);
+
+  ListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (ListenFd < 0 ||
+      bind(ListenFd, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) < 0 ||
+      ::listen(ListenFd, SOMAXCONN) < 0) {
+    fmt::print(stderr, "Can't listen on {}: {}\n", SocketPath,
+               std::strerror(errno));
+    return false;
+  }
+  Path = SocketPath;
+
+  EpollFd = epoll_create1(EPOLL_CLOEXEC);
+  epoll_event Ev = {};
+  Ev.events = EPOLLIN;
+  Ev.data.ptr = nullptr;
+  epoll_ctl(EpollFd, EPOLL_CTL_ADD, ListenFd, &Ev);
+  Ev.data.ptr = &StopFd;
+  epoll_ctl(EpollFd, EPOLL_CTL_ADD, StopFd, &Ev);
+  return true;
+}
+
+void Server::run() {
+  epoll_event Events[64];
+  while (true) {
+    int N = epoll_wait(EpollFd, Events, 64, -1);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N < 0)
+      return;
+
+    for (int I = 0; I < N; ++I) {
+      void *Ptr = Events[I].data.ptr;
+      if (Ptr == &StopFd)
+        return;
+      if (!Ptr) {
+        accept();
+        continue;
+      }
+
+      auto CI = Connections.find(static_cast<Connection *>(Ptr));
+      if (CI == Connections.end())
+        continue;
+      std::shared_ptr<Connection> C = CI->second;
+      if (Events[I].events & EPOLLOUT) {
+        std::lock_guard<std::mutex> Lock(C->Mutex);
+        flush(*C);
+      }
+      if (Events[I].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        read(C);
+    }
+  }
+}
+
+void Server::accept() {
+  while (true) {
+    int Fd = accept4(ListenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (Fd < 0)
+      return;
+    auto C = std::make_shared<Connection>(Fd);
+    epoll_event Ev = {};
+    Ev.events = EPOLLIN;
+    Ev.data.ptr = C.get();
+    epoll_ctl(EpollFd, EPOLL_CTL_ADD, Fd, &Ev);
+    Connections.emplace(C.get(), std::move(C));
+  }
+}
+
+void Server::read(const std::shared_ptr<Connection> &C) {
+  char Buf[1 << 16];
+  while (true) {
+    ssize_t R = ::read(C->Fd, Buf, sizeof(Buf));
+    if (R < 0 && errno == EINTR)
+      continue;
+    if (R < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (R <= 0) {
+      close(*C);
+      return;
+    }
+    C->In.append(Buf, R);
+  }
+
+  // Hand every complete frame to a worker.
+  std::size_t Pos = 0;
+  while (C->In.size() - Pos >= 4) {
+    auto Size = readRaw<std::uint32_t>(C->In.data() + Pos);
+    if (Size < FrameHeaderSize - 4 || Size > MaxFrameSize) {
+      fmt::print(stderr, "Closing a connection that sent a bad frame\n");
+      close(*C);
+      return;
+    }
+    if (C->In.size() - Pos - 4 < Size)
+      break;
+    Workers.submit([this, C, Frame = C->In.substr(Pos + 4, Size)] {
+      send(*C, handle(Frame.data(), Frame.size()));
+    });
+    Pos += 4 + Size;
+  }
+  C->In.erase(0, Pos);
+}
+
+void Server::close(Connection &C) {
+  {
+    std::lock_guard<std::mutex> Lock(C.Mutex);
+    C.Closed = true;
+    epoll_ctl(EpollFd, EPOLL_CTL_DEL, C.Fd, nullptr);
+    ::close(C.Fd);
+  }
+  Connections.erase(&C);
+}
+
+void Server::send(Connection &C, const std::string &Frame) {
+  std::lock_guard<std::mutex> Lock(C.Mutex);
+  if (C.Closed)
+    return;
+  C.Out += Frame;
+  flush(C);
+}
+
+// Write as much of C.Out as the socket takes, and have the event loop finish
+// the rest. C.Mutex must be held.
+void Server::flush(Connection &C) {
+  std::size_t Pos = 0;
+  while (Pos < C.Out.size()) {
+    ssize_t W = ::send(C.Fd, C.Out.data() + Pos, C.Out.size() - Pos,
+                       MSG_NOSIGNAL);
+    if (W < 0 && errno == EINTR)
+      continue;
+    if (W < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (W < 0) {
+      // The peer is gone; the event loop closes the connection when it reads
+      // the hangup.
+      Pos = C.Out.size();
+      break;
+    }
+    Pos += W;
+  }
+  C.Out.erase(0, Pos);
+
+  bool Want = !C.Out.empty();
+  if (Want != C.Writing && !C.Closed) {
+    epoll_event Ev = {};
+    Ev.events = EPOLLIN | (Want ? std::uint32_t(EPOLLOUT) : 0);
+    Ev.data.ptr = &C;
+    epoll_ctl(EpollFd, EPOLL_CTL_MOD, C.Fd, &Ev);
+    C.Writing = Want;
+  }
+}
+
+std::string Server::handle(const char *Frame, std::size_t Size) {
+  auto Id = readRaw<std::uint32_t>(Frame);
+  auto Op = RequestOp(readRaw<std::uint8_t>(Frame + 4));
+  const char *P = Frame + FrameHeaderSize - 4;
+  const char *End = Frame + Size;
+  switch (Op) {
+  case RequestOp::Define:
+    return define(Id, std::string_view(P, End - P));
+  case RequestOp::Evaluate:
+    return evaluate(Id, P, End, false);
+  case RequestOp::BatchEvaluate:
+    return evaluate(Id, P, End, true);
+  }
+  return ErrorFrame(Id, "unknown request");
+}
+
+std::string Server::define(std::uint32_t Id, std::string_view Source) {
+  std::unique_lock<std::shared_mutex> Lock(EngineMutex);
+  if (!E.define(Source))
+    return ErrorFrame(Id, "compilation failed");
+
+  std::string Frame;
+  appendFrameHeader(Frame, Id, std::uint8_t(ResponseStatus::Ok), 0);
+  return Frame;
+}
+
+DynamicFunction Server::find(std::string_view Name) {
+  std::lock_guard<std::mutex> Lock(FunctionsMutex);
+  std::string Key(Name);
+  auto FI = Functions.find(Key);
+  if (FI != Functions.end())
+    return FI->second;
+  DynamicFunction F = E.lookupDynamic(Name);
+  if (F)
+    Functions.emplace(std::move(Key), F);
+  return F;
+}
+
+std::string Server::evaluate(std::uint32_t Id, const char *P, const char *End,
+                             bool Batch) {
+  if (End - P < 2)
+    return ErrorFrame(Id, "malformed request");
+  auto NameSize = readRaw<std::uint16_t>(P);
+  P += 2;
+  if (End - P < NameSize + (Batch ? 4 : 0))
+    return ErrorFrame(Id, "malformed request");
+  std::string_view Name(P, NameSize);
+  P += NameSize;
+  std::uint32_t Rows = 1;
+  if (Batch) {
+    Rows = readRaw<std::uint32_t>(P);
+    P += 4;
+  }
+
+  if (std::size_t(Rows) * 8 > MaxFrameSize)
+    return ErrorFrame(Id, "too many rows");
+
+  std::shared_lock<std::shared_mutex> Lock(EngineMutex);
+  DynamicFunction F = find(Name);
+  if (!F)
+    return ErrorFrame(Id, fmt::format("unknown function {}", Name));
+  if (std::size_t(End - P) != std::size_t(Rows) * F.arity() * 8)
+    return ErrorFrame(Id, fmt::format("{} takes {} arguments", Name,
+                                      F.arity()));
+
+  std::string Frame;
+  appendFrameHeader(Frame, Id, std::uint8_t(ResponseStatus::Ok), Rows * 8);
+  double Args[DynamicFunction::MaxArity];
+  for (std::uint32_t Row = 0; Row < Rows; ++Row) {
+    std::memcpy(Args, P, F.arity() * 8);
+    P += F.arity() * 8;
+    appendRaw<double>(Frame, F(Args));
+  }
+  return Frame;
+}
+
+} // namespace
+
+bool serve(Engine &E, const char *Path, unsigned NumWorkers) {
+  StopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  bool Ok;
+  {
+    Server S(E, NumWorkers);
+    Ok = S.listen(Path);
+    if (Ok) {
+      auto OldInt = std::signal(SIGINT, OnStopSignal);
+      auto OldTerm = std::signal(SIGTERM, OnStopSignal);
+      S.run();
+      std::signal(SIGINT, OldInt);
+      std::signal(SIGTERM, OldTerm);
+    }
+  }
+  ::close(StopFd);
+  StopFd = -1;
+  return Ok;
+}
+
+} // namespace jlang
@@ -0,0 +1,86 @@
+#ifndef JLANG_SERVER_H
+#define JLANG_SERVER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace jlang {
+
+class Engine;
+
+// The wire format of `jlang --serve`. Every message is a frame:
+//
+//   u32 Size   bytes that follow
+//   u32 Id     chosen by the client and echoed in the response
+//   u8  Code   a RequestOp or a ResponseStatus
+//   ...        payload
+//
+// Integers and doubles are in native byte order, as both ends share a host.
+// Requests may be pipelined; responses can arrive in any order and are matched
+// to requests by Id.
+//
+// Payloads:
+//   Define         source text of definitions, externs and imports
+//   Evaluate       u16 name size, name, f64 args[arity]
+//   BatchEvaluate  u16 name size, name, u32 rows, f64 args[rows * arity]
+//   Ok             nothing for Define, f64 results[rows] otherwise
+//   Error          a message
+enum class RequestOp : std::uint8_t { Define = 1, Evaluate, BatchEvaluate };
+enum class ResponseStatus : std::uint8_t { Ok = 0, Error };
+
+constexpr std::size_t FrameHeaderSize = 9;
+// Frames larger than this are rejected and the connection closed.
+constexpr std::uint32_t MaxFrameSize = 64 << 20;
+
+template <typename T> void appendRaw(std::string &Buf, T Val) {
+  Buf.append(reinterpret_cast<const char *>(&Val), sizeof(T));
+}
+
+template <typename T> T readRaw(const char *P) {
+  T Val;
+  std::memcpy(&Val, P, sizeof(T));
+  return Val;
+}
+
+// Start a frame of PayloadSize bytes, which the caller appends next.
+inline void appendFrameHeader(std::string &Buf, std::uint32_t Id,
+                              std::uint8_t Code, std::size_t PayloadSize) {
+  appendRaw<std::uint32_t>(Buf, FrameHeaderSize - 4 + PayloadSize);
+  appendRaw<std::uint32_t>(Buf, Id);
+  appendRaw<std::uint8_t>(Buf, Code);
+}
+
+inline void appendDefine(std::string &Buf, std::uint32_t Id,
+                         std::string_view Source) {
+  appendFrameHeader(Buf, Id, std::uint8_t(RequestOp::Define), Source.size());
+  Buf.append(Source);
+}
+
+// Call Name on Rows rows of arguments. Rows of one are sent as Evaluate.
+inline void appendEvaluate(std::string &Buf, std::uint32_t Id,
+                           std::string_view Name, const double *Args,
+                           std::size_t NumArgs, std::uint32_t Rows = 1) {
+  bool Batch = Rows != 1;
+  std::size_t Size = 2 + Name.size() + (Batch ? 4 : 0) + NumArgs * 8;
+  appendFrameHeader(
+      Buf, Id,
+      std::uint8_t(Batch ? RequestOp::BatchEvaluate : RequestOp::Evaluate),
+      Size);
+  appendRaw<std::uint16_t>(Buf, Name.size());
+  Buf.append(Name);
+  if (Batch)
+    appendRaw<std::uint32_t>(Buf, Rows);
+  Buf.append(reinterpret_cast<const char *>(Args), NumArgs * 8);
+}
+
+// Serve requests on the Unix domain socket at Path until SIGINT or SIGTERM.
+// Definitions are compiled one at a time; evaluations run on NumWorkers
+// threads. Returns false if the socket can't be set up.
+bool serve(Engine &Engine, const char *Path, unsigned NumWorkers);
+
+} // namespace jlang
+
+#endif // JLANG_SERVER_H
@@ -0,0 +1,8 @@
+# Repeated expressions come from the cache, except after a function they
+# call is redefined.
+def g(x) x + 1;
+g(1);
+g(1);
+def g(x) x * 5;
+g(1);
+g(1);
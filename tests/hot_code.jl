@@ -0,0 +1,12 @@
+# args: --hot-calls 3
+# f moves to the hot code once it has been called three times. g inlined f, so
+# its calls don't count for f.
+def f(x) x * 2
+def g(x) f(x) + 1
+g(1);
+f(1);
+f(2);
+f(3);
+f(4);
+def f(x) x * 3
+g(1);
@@ -0,0 +1,5 @@
+# args: --interpret
+extern sin(x);
+def f(x) sin(x) * 2 + 1;
+f(0);
+g(1);
@@ -0,0 +1,3 @@
+# The prelude is linked into every build of libjlang.
+clamp(5, 0, 1);
+lerp(0, 10, 0.25);
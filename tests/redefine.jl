@@ -0,0 +1,11 @@
+# Redefining a function recompiles the callers that inlined it. Its arity
+# can't change, since callers and cached expressions were checked against it.
+def g(x) x + 1;
+def f(x) g(x) * 2;
+f(1);
+def g(x) x + 10;
+f(1);
+def g(x y) x + y;
+f(1);
+g(1);
+extern g(a b);
@@ -0,0 +1,106 @@
+#!/bin/sh
+# Regression checks for a built jlang. Each NAME.jl is piped into the REPL,
+# with the options on its `# args:` line, and the results and errors it prints
+# are compared with NAME.expected. The server, snapshots and the build driver
+# are checked by the scripts after that.
+#
+# Usage: tests/run.sh [path/to/jlang]
+
+Tests=$(cd "$(dirname "$0")" && pwd)
+Jlang=$(cd "$(dirname "${1:-./jlang}")" && pwd)/$(basename "${1:-./jlang}")
+Work=$(mktemp -d)
+trap 'rm -rf "$Work"' EXIT
+Failed=0
+
+pass() { echo "PASS $1"; }
+fail() {
+  echo "FAIL $1"
+  Failed=1
+}
+
+# The lines of REPL output that tests look at; async prompts are dropped.
+results() {
+  sed 's/^\(Jlang>\)*//' |
+    grep -E -e '^(Evaluated to|Evaluation cancelled|Log Error|Reused)' \
+      -e '^(Recompiled|Moved)'
+}
+
+for Case in "$Tests"/*.jl; do
+  Name=$(basename "$Case" .jl)
+  Args=$(sed -n 's/^# args: //p' "$Case")
+  # shellcheck disable=SC2086
+  "$Jlang" $Args <"$Case" 2>/dev/null | results >"$Work/$Name.out"
+  if diff -u "$Tests/$Name.expected" "$Work/$Name.out"; then
+    pass "$Name"
+  else
+    fail "$Name"
+  fi
+done
+
+# The server answers define, evaluate and batch-evaluate requests, rejects
+# expressions in a define and keeps the arity across redefinitions.
+if command -v python3 >/dev/null; then
+  "$Jlang" --serve "$Work/sock" >/dev/null 2>&1 &
+  Server=$!
+  if python3 "$Tests/server_client.py" "$Work/sock"; then
+    pass server
+  else
+    fail server
+  fi
+  kill "$Server"
+  wait "$Server" 2>/dev/null
+else
+  echo "SKIP server: no python3"
+fi
+
+# A session saved with :save and restored runs its definitions without
+# recompiling them, including the callers that inlined another.
+printf 'def f(x) x * 2\ndef g(x) f(x) + 1\n:save %s\n' "$Work/s.jls" |
+  "$Jlang" >/dev/null 2>&1
+Out=$(printf 'g(3);\nf(4);\n' | "$Jlang" --restore "$Work/s.jls" 2>/dev/null |
+  results | tr '\n' ' ')
+if [ "$Out" = "Evaluated to 7 Evaluated to 8 " ]; then
+  pass snapshot
+else
+  fail "snapshot: $Out"
+fi
+
+# Builds only recompile what changed, and a shared library links from C.
+cd "$Work" || exit 1
+printf 'def sq(x) x * x\n' >base.jl
+printf 'import "base.jl"\nexport def hyp(a b) sqrt(sq(a) + sq(b))\n' >main.jl
+Build() {
+  "$Jlang" build -j 2 -o out.o main.jl 2>&1 | sed 's/ in [0-9.]*s$//;
+    s/, [0-9.]*s)$/)/'
+}
+Check() {
+  if [ "$2" = "$3" ]; then
+    pass "$1"
+  else
+    fail "$1: $3"
+  fi
+}
+Check "build from scratch" \
+  "Compiled 2 and optimized 2 of 2 files, and linked out.o" "$(Build)"
+Check "build with nothing changed" "out.o is up to date (2 files)" "$(Build)"
+# main.jl inlined sq, so it's reoptimized but not recompiled.
+printf 'def sq(x) x * x * 1\n' >base.jl
+Check "build after an edit" \
+  "Compiled 1 and optimized 2 of 2 files, and linked out.o" "$(Build)"
+
+"$Jlang" --shared main.jl -o libhyp.so >/dev/null 2>&1
+cat >use.c <<'EOF'
+#include <stdio.h>
+#include "libhyp.h"
+int main(void) {
+  printf("%g\n", hyp(3, 4));
+  return 0;
+}
+EOF
+if cc use.c -L. -lhyp -o use 2>/dev/null; then
+  Check "shared library" "5" "$(LD_LIBRARY_PATH=. ./use)"
+else
+  fail "shared library: use.c doesn't build against libhyp.h"
+fi
+
+exit $Failed
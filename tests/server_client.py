@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+# Drives a jlang server with pipelined requests, in the framing of server.h,
+# and checks each response. Exits non-zero on the first mismatch.
+#
+# Usage: server_client.py SOCKET
+
+import socket
+import struct
+import sys
+import time
+
+DEFINE, EVALUATE, BATCH_EVALUATE = 1, 2, 3
+OK, ERROR = 0, 1
+
+
+def frame(id, op, payload):
+    return struct.pack("=IIB", 5 + len(payload), id, op) + payload
+
+
+def define(id, source):
+    return frame(id, DEFINE, source.encode())
+
+
+def evaluate(id, name, args, rows=1):
+    name = name.encode()
+    payload = struct.pack("=H", len(name)) + name
+    if rows != 1:
+        payload += struct.pack("=I", rows)
+    payload += struct.pack("=%dd" % len(args), *args)
+    return frame(id, BATCH_EVALUATE if rows != 1 else EVALUATE, payload)
+
+
+def connect(path):
+    for _ in range(100):
+        try:
+            s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            s.connect(path)
+            return s
+        except OSError:
+            time.sleep(0.05)
+    sys.exit("can't connect to " + path)
+
+
+def read_exact(s, n):
+    data = b""
+    while len(data) < n:
+        chunk = s.recv(n - len(data))
+        if not chunk:
+            sys.exit("the server closed the connection")
+        data += chunk
+    return data
+
+
+def roundtrip(s, requests):
+    s.sendall(b"".join(requests))
+    responses = {}
+    for _ in requests:
+        size, id, status = struct.unpack("=IIB", read_exact(s, 9))
+        responses[id] = (status, read_exact(s, size - 5))
+    return responses
+
+
+def expect(responses, id, status, values=None):
+    got_status, payload = responses[id]
+    if got_status != status:
+        sys.exit("request %d: status %d, %r" % (id, got_status, payload))
+    if values is not None:
+        got = list(struct.unpack("=%dd" % (len(payload) // 8), payload))
+        if got != values:
+            sys.exit("request %d: %r, expected %r" % (id, got, values))
+
+
+s = connect(sys.argv[1])
+r = roundtrip(s, [define(1, "def f(x y) x * y + 1"), define(2, "f(1, 2)")])
+expect(r, 1, OK)
+expect(r, 2, ERROR)
+
+r = roundtrip(s, [
+    evaluate(3, "f", [2, 3]),
+    evaluate(4, "f", [1, 1, 2, 2, 3, 3], rows=3),
+    evaluate(5, "f", [1]),
+    evaluate(6, "g", [1]),
+])
+expect(r, 3, OK, [7])
+expect(r, 4, OK, [2, 5, 10])
+expect(r, 5, ERROR)
+expect(r, 6, ERROR)
+
+r = roundtrip(s, [define(7, "def f(x) x"), define(8, "def f(x y) x - y")])
+expect(r, 7, ERROR)
+expect(r, 8, OK)
+r = roundtrip(s, [evaluate(9, "f", [5, 3])])
+expect(r, 9, OK, [2])
@@ -0,0 +1,61 @@
+#ifndef JLANG_THREAD_POOL_H
+#define JLANG_THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads running queued tasks. Queued tasks are finished
+// before destruction.
+class ThreadPool {
+public:
+  explicit ThreadPool(unsigned NumThreads) {
+    for (unsigned I = 0; I < NumThreads; ++I)
+      Threads.emplace_back([this] { work(); });
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Done = true;
+    }
+    CV.notify_all();
+    for (auto &T : Threads)
+      T.join();
+  }
+
+  void submit(std::function<void()> Task) {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Tasks.push_back(std::move(Task));
+    }
+    CV.notify_one();
+  }
+
+private:
+  void work() {
+    while (true) {
+      std::function<void()> Task;
+      {
+        std::unique_lock<std::mutex> Lock(Mutex);
+        CV.wait(Lock, [this] { return Done || !Tasks.empty(); });
+        if (Tasks.empty())
+          return;
+        Task = std::move(Tasks.front());
+        Tasks.pop_front();
+      }
+      Task();
+    }
+  }
+
+  std::mutex Mutex;
+  std::condition_variable CV;
+  std::deque<std::function<void()>> Tasks;
+  bool Done = false;
+  std::vector<std::thread> Threads;
+};
+
+#endif // JLANG_THREAD_POOL_H
@@ -0,0 +1,124 @@
+#include "time_trace.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+
+using namespace llvm;
+
+namespace jlang {
+namespace {
+
+// The granularity of the trace, which threads joining it take, or negative
+// when none was started.
+std::atomic<int> Granularity{-1};
+std::chrono::steady_clock::time_point Started;
+
+// The scopes jlang opens, items first and then phases in pipeline order.
+const char *const Phases[] = {"Definition", "Extern",   "Import",
+                              "Expression", "Lex",      "Parse",
+                              "Codegen",    "Verify",   "Materialize",
+                              "Optimize",   "EmitCode"};
+
+} // namespace
+
+void startTimeTrace(unsigned GranularityMicros) {
+  if (timeTraceProfilerEnabled())
+    return;
+  timeTraceProfilerInitialize(GranularityMicros, "jlang");
+  Started = std::chrono::steady_clock::now();
+  Granularity = static_cast<int>(GranularityMicros);
+}
+
+TimeTraceThread::TimeTraceThread() {
+  int G = Granularity.load();
+  if (G < 0 || timeTraceProfilerEnabled())
+    return;
+  timeTraceProfilerInitialize(G, "jlang");
+  Joined = true;
+}
+
+TimeTraceThread::~TimeTraceThread() {
+  // Hands this thread's scopes to the thread that writes the trace.
+  if (Joined)
+    timeTraceProfilerFinishThread();
+}
+
+bool writeTimeTrace(const std::string &Path) {
+  if (!timeTraceProfilerEnabled())
+    return false;
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+  if (EC)
+    return false;
+  timeTraceProfilerWrite(OS);
+  return !OS.has_error();
+}
+
+// The totals are only kept in the trace, as "Total <name>" events with the
+// count in their arguments.
+std::vector<PhaseTime> timeTraceTotals() {
+  std::vector<PhaseTime> Totals;
+  if (!timeTraceProfilerEnabled())
+    return Totals;
+  SmallString<0> Trace;
+  raw_svector_ostream OS(Trace);
+  timeTraceProfilerWrite(OS);
+  auto Parsed = json::parse(Trace);
+  if (!Parsed) {
+    consumeError(Parsed.takeError());
+    return Totals;
+  }
+  auto *Root = Parsed->getAsObject();
+  auto *Events = Root ? Root->getArray("traceEvents") : nullptr;
+  if (!Events)
+    return Totals;
+  for (const json::Value &E : *Events) {
+    auto *Event = E.getAsObject();
+    auto Name = Event ? Event->getString("name") : None;
+    if (!Name || !Name->consume_front("Total "))
+      continue;
+    PhaseTime T;
+    T.Name = Name->str();
+    T.Seconds = Event->getInteger("dur").getValueOr(0) / 1e6;
+    if (auto *Args = Event->getObject("args"))
+      T.Count = Args->getInteger("count").getValueOr(0);
+    Totals.push_back(std::move(T));
+  }
+  auto Rank = [](const PhaseTime &T) {
+    return std::size_t(std::find(std::begin(Phases), std::end(Phases),
+                                 T.Name) -
+                       std::begin(Phases));
+  };
+  for (PhaseTime &T : Totals)
+    T.LLVM = Rank(T) == std::size(Phases);
+  std::stable_sort(Totals.begin(), Totals.end(),
+                   [&](const PhaseTime &A, const PhaseTime &B) {
+                     if (A.LLVM != B.LLVM || !A.LLVM)
+                       return Rank(A) < Rank(B);
+                     return A.Seconds > B.Seconds;
+                   });
+  return Totals;
+}
+
+double timeTraceSeconds() {
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Started;
+  return Granularity >= 0 ? Elapsed.count() : 0;
+}
+
+void stopTimeTrace() {
+  if (!timeTraceProfilerEnabled())
+    return;
+  Granularity = -1;
+  timeTraceProfilerCleanup();
+}
+
+} // namespace jlang
@@ -0,0 +1,59 @@
+#ifndef JLANG_TIME_TRACE_H
+#define JLANG_TIME_TRACE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace jlang {
+
+// Tracing of where compile time goes, with LLVM's time profiler. Each
+// top-level item is a scope (Definition, Extern, Import or Expression), and
+// so are the phases of compiling it: Parse, Codegen, Verify, Optimize with
+// the optimizer's passes under it, EmitCode, and Materialize, which holds
+// optimization, emission and JIT linking. Lexing runs inside parsing a token
+// at a time, so it only shows in the totals, as Lex.
+//
+// A trace covers the thread that started it and the threads that join it
+// with a TimeTraceThread.
+
+// Start tracing on the calling thread. Scopes shorter than GranularityMicros
+// are left out of the trace but still count toward the totals.
+void startTimeTrace(unsigned GranularityMicros = 50);
+
+// Joins the trace, if one was started, for as long as it lives. Must be gone
+// before the trace is written.
+class TimeTraceThread {
+public:
+  TimeTraceThread();
+  TimeTraceThread(const TimeTraceThread &) = delete;
+  TimeTraceThread &operator=(const TimeTraceThread &) = delete;
+  ~TimeTraceThread();
+
+private:
+  bool Joined = false;
+};
+
+struct PhaseTime {
+  std::string Name;
+  std::uint64_t Count = 0;
+  double Seconds = 0;
+  // A scope of LLVM's, such as an optimizer pass, rather than one above.
+  bool LLVM = false;
+};
+
+// Write the trace in Chrome's trace event format, which Perfetto and
+// chrome://tracing open. Returns false if it can't be written.
+bool writeTimeTrace(const std::string &Path);
+// The time spent in scopes of each name: jlang's in the order above, then
+// LLVM's, most first. A scope nested in another of the same name, as in an
+// import of an import, counts once.
+std::vector<PhaseTime> timeTraceTotals();
+// Seconds since the trace started.
+double timeTraceSeconds();
+// Stop tracing and drop the trace.
+void stopTimeTrace();
+
+} // namespace jlang
+
+#endif // JLANG_TIME_TRACE_H